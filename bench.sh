@@ -0,0 +1,127 @@
+#!/bin/sh
+#
+# bench.sh: end-to-end timings for the dos tools on synthetic images.
+#
+# For each image configuration, dos_genimg builds an image and then
+# dos_ls, dos_cat, dos_cp (both directions) and scandisk are each run
+# RUNS times.  One JSON object per tool and configuration is written
+# to stdout, with latency percentiles in milliseconds and throughput
+# in MB/s where the tool moves file data.
+#
+# usage: bench.sh [-r runs] [-o outdir] [genimg options ...]
+#
+# With no genimg options, BENCH_IMAGES is used: a ';' separated list
+# of dos_genimg option sets.
+
+RUNS=10
+OUTDIR=${TMPDIR:-/tmp}/dos_bench.$$
+BIN=$(cd "$(dirname "$0")" && pwd)
+
+while getopts "r:o:" opt; do
+    case $opt in
+	r) RUNS=$OPTARG ;;
+	o) OUTDIR=$OPTARG ;;
+	*) echo "usage: $0 [-r runs] [-o outdir] [genimg options ...]" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -gt 0 ]; then
+    BENCH_IMAGES="$*"
+fi
+: ${BENCH_IMAGES:="-s 2880 -n 100 -d 2 -z exp:4096;-s 2880 -n 100 -d 2 -z exp:4096 -f 30;-s 65000 -c 16 -n 1000 -d 3 -b 3 -z exp:16384 -f 10"}
+
+mkdir -p "$OUTDIR" || exit 1
+trap 'rm -rf "$OUTDIR"' EXIT
+
+now_ns() {
+    date +%s%N
+}
+
+# report <tool> <config> <bytes> <file of per-run times in ns>
+report() {
+    sort -n "$4" | awk -v tool="$1" -v config="$2" -v bytes="$3" '
+	{ t[NR] = $1 / 1e6; sum += t[NR] }
+	function pct(p,   i) { i = int(p * NR + 0.999999); if (i < 1) i = 1; return t[i] }
+	END {
+	    mean = sum / NR
+	    tput = (bytes > 0 && mean > 0) ? bytes / 1e6 / (mean / 1e3) : 0
+	    printf "{\"tool\":\"%s\",\"config\":\"%s\",\"runs\":%d,\"bytes\":%d,", tool, config, NR, bytes
+	    printf "\"min_ms\":%.3f,\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f,", t[1], pct(0.5), pct(0.9), pct(0.99), t[NR]
+	    printf "\"mean_ms\":%.3f,\"throughput_mbps\":%.3f}\n", mean, tput
+	}'
+}
+
+# output_size <file or directory>: bytes of data in it
+output_size() {
+    if [ -d "$1" ]; then
+	find "$1" -type f -exec cat {} + | wc -c
+    else
+	wc -c < "$1"
+    fi
+}
+
+# time_runs <tool> <config> <bytes> <setup command> <output> <command ...>
+# setup runs before each timed run, outside the timing.  output is
+# where the command puts the data it moves: "-" for its stdout, a file
+# or directory, or "" if there is nothing to check.  A run that fails,
+# or leaves less than <bytes> there, stops the benchmark rather than
+# reporting a time for work that wasn't done.
+time_runs() {
+    tool=$1; config=$2; bytes=$3; setup=$4; output=$5
+    shift 5
+    : > "$OUTDIR/times"
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+	eval "$setup"
+	start=$(now_ns)
+	"$@" > "$OUTDIR/stdout" 2> "$OUTDIR/stderr"
+	rc=$?
+	end=$(now_ns)
+	if [ $rc -ne 0 ]; then
+	    echo "$tool ($config) failed with status $rc:" >&2
+	    cat "$OUTDIR/stderr" >&2
+	    exit 1
+	fi
+	if [ -n "$output" ]; then
+	    [ "$output" = - ] && output=$OUTDIR/stdout
+	    got=$(output_size "$output")
+	    if [ "${got:-0}" -lt "$bytes" ]; then
+		echo "$tool ($config) wrote $got bytes, expected $bytes" >&2
+		exit 1
+	    fi
+	fi
+	echo $((end - start)) >> "$OUTDIR/times"
+	i=$((i + 1))
+    done
+    report "$tool" "$config" "$bytes" "$OUTDIR/times"
+}
+
+echo "$BENCH_IMAGES" | tr ';' '\n' | while read -r config; do
+    [ -n "$config" ] || continue
+    img=$OUTDIR/bench.img
+    work=$OUTDIR/work.img
+    # shellcheck disable=SC2086
+    if ! "$BIN/dos_genimg" $config -m "$OUTDIR/manifest" "$img" > /dev/null; then
+	echo "dos_genimg $config failed" >&2
+	continue
+    fi
+
+    # the biggest file is the one we cat and copy
+    set -- $(sort -k2 -n "$OUTDIR/manifest" | tail -1)
+    file=$1
+    size=${2:-0}
+    total=$(awk '{ s += $2 } END { print s + 0 }' "$OUTDIR/manifest")
+    "$BIN/dos_cp" "$img" "a:$file" "$OUTDIR/host.dat" > /dev/null 2>&1
+
+    time_runs dos_ls "$config" 0 : "" "$BIN/dos_ls" "$img"
+    time_runs dos_cat "$config" "$size" : - "$BIN/dos_cat" "$img" "$file"
+    time_runs dos_cp_out "$config" "$size" : "$OUTDIR/out.dat" \
+	"$BIN/dos_cp" "$img" "a:$file" "$OUTDIR/out.dat"
+    time_runs dos_cp_out_tree "$config" "$total" "rm -rf '$OUTDIR/tree'" "$OUTDIR/tree" \
+	"$BIN/dos_cp" -r "$img" a: "$OUTDIR/tree"
+    time_runs dos_cp_in "$config" "$size" "cp '$img' '$work'" "" \
+	"$BIN/dos_cp" "$work" "$OUTDIR/host.dat" a:/BENCHIN.DAT
+    time_runs scandisk "$config" 0 "cp '$img' '$work'" "" \
+	"$BIN/scandisk" "$work"
+done
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bitmap.h"
+
+/* round a number of words up to a multiple of 256 bits */
+#define BITMAP_PADDED(nwords) (((nwords) + 3) & ~3)
+
+
+struct bitmap *bitmap_create(uint32_t nbits)
+{
+    struct bitmap *bm = malloc(sizeof(struct bitmap));
+
+    if (bm == NULL) 
+    {
+	fprintf(stderr, "Out of memory for bitmap\n");
+	exit(1);
+    }
+    bm->nbits = nbits;
+    bm->nwords = (nbits + 63) / 64;
+    bm->bits = calloc(BITMAP_PADDED(bm->nwords), sizeof(uint64_t));
+    if (bm->bits == NULL) 
+    {
+	fprintf(stderr, "Out of memory for bitmap of %u bits\n", nbits);
+	exit(1);
+    }
+    return bm;
+}
+
+void bitmap_free(struct bitmap *bm)
+{
+    if (bm == NULL)
+	return;
+    free(bm->bits);
+    free(bm);
+}
+
+
+/* word_mask has a bit for every bit of word that exists */
+static uint64_t word_mask(const struct bitmap *bm, uint32_t word)
+{
+    if (word + 1 == bm->nwords && bm->nbits % 64)
+	return (1ULL << (bm->nbits % 64)) - 1;
+    return ~0ULL;
+}
+
+void bitmap_set(struct bitmap *bm, uint32_t bit)
+{
+    uint32_t word = bit / 64;
+    uint64_t mask = 1ULL << (bit % 64);
+
+    if (bit >= bm->nbits)
+	return;
+    __atomic_fetch_or(&bm->bits[word], mask, __ATOMIC_RELAXED);
+}
+
+/* bitmap_set_word stores a whole word of bits at once, for a single
+   thread filling in a bitmap in order */
+void bitmap_set_word(struct bitmap *bm, uint32_t word, uint64_t bits)
+{
+    if (word >= bm->nwords)
+	return;
+    bm->bits[word] = bits & word_mask(bm, word);
+}
+
+int bitmap_test(const struct bitmap *bm, uint32_t bit)
+{
+    if (bit >= bm->nbits)
+	return 0;
+    return (bm->bits[bit / 64] >> (bit % 64)) & 1;
+}
+
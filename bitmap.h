@@ -0,0 +1,28 @@
+#ifndef __BITMAP_H__
+#define __BITMAP_H__
+
+/* A bitmap, one bit per cluster, on the heap.
+
+   bitmap_set is atomic, so several threads may mark the same bitmap
+   at once.  Bits past the end are ignored by bitmap_set and read as
+   clear, so a corrupt cluster number can't write out of bounds.
+
+   The bits are padded with zeroes to a multiple of 256, so they can
+   be processed four words at a time. */
+
+#include <stdint.h>
+
+struct bitmap 
+{
+    uint32_t nbits;
+    uint32_t nwords;		/* 64-bit words of bits */
+    uint64_t *bits;
+};
+
+struct bitmap *bitmap_create(uint32_t nbits);
+void bitmap_free(struct bitmap *);
+void bitmap_set(struct bitmap *, uint32_t bit);
+void bitmap_set_word(struct bitmap *, uint32_t word, uint64_t bits);
+int bitmap_test(const struct bitmap *, uint32_t bit);
+
+#endif // __BITMAP_H__
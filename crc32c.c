@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "crc32c.h"
+
+/* the reflected Castagnoli polynomial */
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc_fn)(uint32_t, const uint8_t *, size_t);
+
+
+/* slicing-by-8: table[k][b] is the CRC of byte b followed by k zero
+   bytes, so eight bytes can be folded in with eight lookups */
+static uint32_t crc32c_table(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t word;
+
+    while (len > 0 && ((uintptr_t)p & 7) != 0)
+    {
+	crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	len--;
+    }
+    while (len >= 8)
+    {
+	memcpy(&word, p, 8);
+	word ^= crc;
+	crc = crc_table[7][word & 0xff]
+	    ^ crc_table[6][(word >> 8) & 0xff]
+	    ^ crc_table[5][(word >> 16) & 0xff]
+	    ^ crc_table[4][(word >> 24) & 0xff]
+	    ^ crc_table[3][(word >> 32) & 0xff]
+	    ^ crc_table[2][(word >> 40) & 0xff]
+	    ^ crc_table[1][(word >> 48) & 0xff]
+	    ^ crc_table[0][word >> 56];
+	p += 8;
+	len -= 8;
+    }
+    while (len-- > 0)
+	crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t c = crc, word;
+
+    while (len > 0 && ((uintptr_t)p & 7) != 0)
+    {
+	c = _mm_crc32_u8(c, *p++);
+	len--;
+    }
+    while (len >= 8)
+    {
+	memcpy(&word, p, 8);
+	c = _mm_crc32_u64(c, word);
+	p += 8;
+	len -= 8;
+    }
+    while (len-- > 0)
+	c = _mm_crc32_u8(c, *p++);
+    return c;
+}
+#endif
+
+
+static void crc32c_init(void)
+{
+    uint32_t crc;
+    int i, j, k;
+
+    for (i = 0; i < 256; i++)
+    {
+	crc = i;
+	for (j = 0; j < 8; j++)
+	    crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+	crc_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++)
+	for (k = 1; k < 8; k++)
+	    crc_table[k][i] = crc_table[0][crc_table[k - 1][i] & 0xff]
+		^ (crc_table[k - 1][i] >> 8);
+
+    crc_fn = crc32c_table;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+	crc_fn = crc32c_sse42;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    pthread_once(&crc_once, crc32c_init);
+    return ~crc_fn(~crc, buf, len);
+}
@@ -0,0 +1,18 @@
+#ifndef __CRC32C_H__
+#define __CRC32C_H__
+
+/* CRC32C (Castagnoli), as used by iSCSI, ext4 and friends.
+
+   On x86-64 CPUs with SSE4.2 it uses the crc32 instruction, eight
+   bytes at a time; elsewhere a table-driven version that handles
+   eight bytes per step.  Both give the same answers.
+
+   crc is the running value: start with 0, and pass the result of
+   one call into the next to checksum data that comes in pieces. */
+
+#include <stdint.h>
+#include <stddef.h>
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif // __CRC32C_H__
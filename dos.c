@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/mman.h>
@@ -13,12 +14,15 @@
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
+#include "overlay.h"
+#include "packed.h"
+#include "stats.h"
 
 
 static int imagesize = 0;
 
-/* memory map the FAT-12  disk image file */
-uint8_t *mmap_file(char *filename, int *fd)
+/* memory map the FAT-12  disk image file, for writing or not */
+static uint8_t *map_image(char *filename, int *fd, int writable)
 {
     struct stat statbuf;
     uint8_t *image_buf;
@@ -48,6 +52,7 @@ uint8_t *mmap_file(char *filename, int *fd)
     /* Step 2: find out how big the disk image file is */
     /* we can use "stat" to do this, by checking the file status */
 
+    STAT_INC(syscalls);
     if (stat(pathname, &statbuf) < 0) 
     {
 	fprintf(stderr, "Cannot read disk image file %s:\n%s\n", 
@@ -56,10 +61,30 @@ uint8_t *mmap_file(char *filename, int *fd)
     }
     imagesize = statbuf.st_size;
 
+    /* a packed image is decompressed a chunk at a time, as it is
+       touched */
+    if (packed_file(pathname))
+    {
+	size_t size;
+
+	if (overlay_path != NULL)
+	{
+	    fprintf(stderr, "Can't use --overlay on packed image %s\n", pathname);
+	    exit(1);
+	}
+	image_buf = packed_map(pathname, fd, &size);
+	imagesize = size;
+	return image_buf;
+    }
+
+    /* with --overlay the image itself is never written */
+    if (overlay_path != NULL)
+	return overlay_map(pathname, fd, imagesize);
 
     /* Step 3: open the file for read/write */
 
-    *fd = open(pathname, O_RDWR);
+    STAT_INC(syscalls);
+    *fd = open(pathname, writable ? O_RDWR : O_RDONLY);
     if (*fd < 0) 
     {
 	fprintf(stderr, "Cannot read disk image file %s:\n%s\n", 
@@ -70,7 +95,9 @@ uint8_t *mmap_file(char *filename, int *fd)
 
     /* Step 4: we memory map the file */
 
-    image_buf = mmap(NULL, imagesize, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    STAT_INC(syscalls);
+    image_buf = mmap(NULL, imagesize, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+		     MAP_SHARED, *fd, 0);
     if (image_buf == MAP_FAILED) 
     {
 	fprintf(stderr, "Failed to memory map: \n%s\n", strerror(errno));
@@ -79,16 +106,73 @@ uint8_t *mmap_file(char *filename, int *fd)
     return image_buf;
 }
 
+uint8_t *mmap_file(char *filename, int *fd)
+{
+    return map_image(filename, fd, 1);
+}
+
+/* mmap_file_readonly is for tools that only read the image, so that
+   an image without write permission can still be used */
+uint8_t *mmap_file_readonly(char *filename, int *fd)
+{
+    return map_image(filename, fd, 0);
+}
+
+
+/* is_same_file says whether two paths name the same file, so a tool can
+   refuse to write its output over the image it is reading */
+int is_same_file(const char *a, const char *b)
+{
+    struct stat sa, sb;
+
+    STAT_ADD(syscalls, 2);
+    if (stat(a, &sa) < 0 || stat(b, &sb) < 0)
+	return 0;
+    return sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+
+/* mmap_size is the size of the image mmap_file mapped last, which for
+   a packed image isn't the size of the file */
+size_t mmap_size(void)
+{
+    return imagesize;
+}
+
 
 void unmmap_file(uint8_t *image, int *fd)
 {
+    if (packed_unmap(image))
+    {
+	close(*fd);
+	STAT_INC(syscalls);
+	return;
+    }
+    if (overlay_path != NULL)
+	overlay_commit(image, imagesize);
     munmap(image, imagesize);
     close(*fd);
+    STAT_ADD(syscalls, 2);
+}
+
+
+/* dos_verbosity is raised by --verbose; 0 means only real errors */
+int dos_verbosity;
+
+void dos_debug(int level, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (dos_verbosity < level)
+	return;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
 }
 
 
 /* read the bootsector from the disk, and check that it is sane */
-/* define DEBUG to see what the disk parameters actually are */
+/* run with --verbose to see what the disk parameters actually are */
 
 struct bpb33* check_bootsector(uint8_t *image_buf)
 {
@@ -96,17 +180,13 @@ struct bpb33* check_bootsector(uint8_t *image_buf)
     struct byte_bpb33* bpb;  /* BIOS parameter block */
     struct bpb33* bpb_aligned;
 
-#ifdef DEBUG
-    fprintf(stderr, "Size of BPB: %lu\n", sizeof(struct bootsector33));
-#endif
+    dos_debug(1, "Size of BPB: %lu\n", sizeof(struct bootsector33));
 
     bootsect = (struct bootsector33*)image_buf;
     if (bootsect->bsJump[0] == 0xe9 ||
 	(bootsect->bsJump[0] == 0xeb && bootsect->bsJump[2] == 0x90)) 
     {
-#ifdef DEBUG
-	fprintf(stderr, "Found good jump instruction in boot sector\n");
-#endif
+	dos_debug(1, "Found good jump instruction in boot sector\n");
     } 
     else 
     {
@@ -115,17 +195,13 @@ struct bpb33* check_bootsector(uint8_t *image_buf)
 		bootsect->bsJump[2]); 
     } 
 
-#ifdef DEBUG
-    fprintf(stderr, "OemName: %s\n", bootsect->bsOemName);
-#endif
+    dos_debug(1, "OemName: %.8s\n", bootsect->bsOemName);
 
     if (bootsect->bsBootSectSig0 == BOOTSIG0
 	&& bootsect->bsBootSectSig0 == BOOTSIG0) 
     {
 	//Good boot sector sig;
-#ifdef DEBUG
-	fprintf(stderr, "Good boot sector signature\n");
-#endif
+	dos_debug(1, "Good boot sector signature\n");
     } 
     else 
     {
@@ -151,16 +227,14 @@ struct bpb33* check_bootsector(uint8_t *image_buf)
     bpb_aligned->bpbHiddenSecs = getushort(bpb->bpbHiddenSecs);
     
 
-#ifdef DEBUG
-    fprintf(stderr, "Bytes per sector: %d\n", bpb_aligned->bpbBytesPerSec);
-    fprintf(stderr, "Sectors per cluster: %d\n", bpb_aligned->bpbSecPerClust);
-    fprintf(stderr, "Reserved sectors: %d\n", bpb_aligned->bpbResSectors);
-    fprintf(stderr, "Number of FATs: %d\n", bpb->bpbFATs);
-    fprintf(stderr, "Number of root dir entries: %d\n", bpb_aligned->bpbRootDirEnts);
-    fprintf(stderr, "Total number of sectors: %d\n", bpb_aligned->bpbSectors);
-    fprintf(stderr, "Number of sectors per FAT: %d\n", bpb_aligned->bpbFATsecs);
-    fprintf(stderr, "Number of hidden sectors: %d\n", bpb_aligned->bpbHiddenSecs);
-#endif
+    dos_debug(1, "Bytes per sector: %d\n", bpb_aligned->bpbBytesPerSec);
+    dos_debug(1, "Sectors per cluster: %d\n", bpb_aligned->bpbSecPerClust);
+    dos_debug(1, "Reserved sectors: %d\n", bpb_aligned->bpbResSectors);
+    dos_debug(1, "Number of FATs: %d\n", bpb->bpbFATs);
+    dos_debug(1, "Number of root dir entries: %d\n", bpb_aligned->bpbRootDirEnts);
+    dos_debug(1, "Total number of sectors: %d\n", bpb_aligned->bpbSectors);
+    dos_debug(1, "Number of sectors per FAT: %d\n", bpb_aligned->bpbFATsecs);
+    dos_debug(1, "Number of hidden sectors: %d\n", bpb_aligned->bpbHiddenSecs);
 
     return bpb_aligned;
 }
@@ -174,9 +248,11 @@ uint16_t get_fat_entry(uint16_t clusternum,
     uint16_t value;
     uint8_t b1, b2;
     
+    STAT_INC(fat_reads);
+
     /* this involves some really ugly bit shifting.  This probably
        only works on a little-endian machine. */
-    offset = bpb->bpbResSectors * bpb->bpbBytesPerSec * bpb->bpbSecPerClust 
+    offset = bpb->bpbResSectors * bpb->bpbBytesPerSec 
 	+ (3 * (clusternum/2));
     switch(clusternum % 2) 
     {
@@ -204,9 +280,11 @@ void set_fat_entry(uint16_t clusternum, uint16_t value,
     uint32_t offset;
     uint8_t *p1, *p2;
     
+    STAT_INC(fat_writes);
+
     /* this involves some really ugly bit shifting.  This probably
        only works on a little-endian machine. */
-    offset = bpb->bpbResSectors * bpb->bpbBytesPerSec * bpb->bpbSecPerClust 
+    offset = bpb->bpbResSectors * bpb->bpbBytesPerSec 
 	+ (3 * (clusternum/2));
     switch(clusternum % 2) 
     {
@@ -239,6 +317,25 @@ int is_valid_cluster(uint16_t cluster, struct bpb33 *bpb)
 }
 
 
+/* get_cluster_count returns one more than the highest cluster number
+   the data area has room for, i.e. the size a per-cluster table needs
+   to be */
+uint16_t get_cluster_count(struct bpb33 *bpb)
+{
+    uint32_t root_secs, data_secs, meta_secs;
+
+    root_secs = (bpb->bpbRootDirEnts * sizeof(struct direntry) 
+		 + bpb->bpbBytesPerSec - 1) / bpb->bpbBytesPerSec;
+    meta_secs = bpb->bpbResSectors + bpb->bpbFATs * bpb->bpbFATsecs + root_secs;
+    if (meta_secs >= bpb->bpbSectors)
+	return CLUST_FIRST;
+    data_secs = bpb->bpbSectors - meta_secs;
+    if (data_secs / bpb->bpbSecPerClust + CLUST_FIRST > (FAT12_MASK & CLUST_RSRVDS))
+	return FAT12_MASK & CLUST_RSRVDS;
+    return data_secs / bpb->bpbSecPerClust + CLUST_FIRST;
+}
+
+
 /* is_end_of_file returns true if the FAT entry for cluster indicates
    this is the last cluster in a file */
 int is_end_of_file(uint16_t cluster) 
@@ -276,6 +373,8 @@ uint8_t *cluster_to_addr(uint16_t cluster, uint8_t *image_buf,
     p = root_dir_addr(image_buf, bpb);
     if (cluster != MSDOSFSROOT) 
     {
+	STAT_INC(clusters_visited);
+
 	/* move to the end of the root directory */
 	p += bpb->bpbRootDirEnts * sizeof(struct direntry);
 
@@ -285,3 +384,379 @@ uint8_t *cluster_to_addr(uint16_t cluster, uint8_t *image_buf,
     return p;
 }
 
+
+
+/* get_dirent_name copies the name of a directory entry into buffer
+   (which must hold MAXFILENAME bytes) with the space padding removed.
+   The extension is only appended if there is one. */
+void get_dirent_name(struct direntry *dirent, char *buffer)
+{
+    int i, len = 0;
+
+    for (i = 0; i < 8 && dirent->deName[i] != ' '; i++)
+	buffer[len++] = dirent->deName[i];
+
+    /* a leading 0x05 stands for a real 0xe5 */
+    if (len > 0 && (uint8_t)buffer[0] == SLOT_E5)
+	buffer[0] = (char)SLOT_DELETED;
+
+    if (dirent->deExtension[0] != ' ') 
+    {
+	buffer[len++] = '.';
+	for (i = 0; i < 3 && dirent->deExtension[i] != ' '; i++)
+	    buffer[len++] = dirent->deExtension[i];
+    }
+    buffer[len] = '\0';
+}
+
+
+/* is_dot_dirent returns true for the "." and ".." entries that every
+   subdirectory starts with */
+int is_dot_dirent(struct direntry *dirent)
+{
+    return dirent->deName[0] == '.';
+}
+
+
+/* for_each_dirent calls fn on every live entry of the directory that
+   starts at cluster (MSDOSFSROOT for the root directory).  Empty,
+   deleted and long filename entries are skipped, and the walk stops
+   at the first never-used slot, or at a cluster past the end of the
+   data area.  If fn returns non-zero the walk stops early and that
+   value is returned. */
+int for_each_dirent(uint16_t cluster, uint8_t *image_buf, struct bpb33 *bpb,
+		    dirent_fn fn, void *arg)
+{
+    struct direntry *dirent;
+    int i, rv, num_entries;
+    int hops = 0;
+    int max_hops = bpb->bpbSectors / bpb->bpbSecPerClust;
+    uint16_t maxclust = get_cluster_count(bpb);
+
+    if (cluster == MSDOSFSROOT)
+	num_entries = bpb->bpbRootDirEnts;
+    else if (is_valid_cluster(cluster, bpb) && cluster < maxclust)
+	num_entries = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) 
+	    / sizeof(struct direntry);
+    else
+	return 0;
+
+    while (1) 
+    {
+	dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+	for (i = 0; i < num_entries; i++, dirent++) 
+	{
+	    STAT_INC(dirents_parsed);
+	    if (dirent->deName[0] == SLOT_EMPTY)
+		return 0;
+	    if (dirent->deName[0] == SLOT_DELETED)
+		continue;
+	    if ((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN)
+		continue;
+	    rv = fn(dirent, arg);
+	    if (rv)
+		return rv;
+	}
+
+	/* the root directory is a fixed size and not in the FAT */
+	if (cluster == MSDOSFSROOT)
+	    return 0;
+
+	/* guard against a looped chain in a damaged image */
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+	if (!is_valid_cluster(cluster, bpb) || cluster >= maxclust
+	    || ++hops > max_hops)
+	    return 0;
+    }
+}
+
+
+struct walk_state
+{
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+    tree_fn fn;
+    void *arg;
+    const char *dir;
+    int depth;
+    int problems;
+};
+
+static int walk_dirent(struct direntry *dirent, void *arg)
+{
+    struct walk_state *w = arg, sub;
+    char name[MAXFILENAME];
+    char path[MAXPATHLEN+1];
+
+    if (is_dot_dirent(dirent) || (dirent->deAttributes & ATTR_VOLUME) != 0)
+	return 0;
+    get_dirent_name(dirent, name);
+    if (snprintf(path, sizeof(path), "%s/%s", w->dir, name) >= (int)sizeof(path))
+    {
+	fprintf(stderr, "Path too long: %s/%s\n", w->dir, name);
+	w->problems++;
+	return 0;
+    }
+
+    if (w->fn(dirent, path, w->depth, w->arg) != 0
+	|| (dirent->deAttributes & ATTR_DIRECTORY) == 0)
+	return 0;
+    if (w->depth + 1 >= WALK_MAXDEPTH)
+    {
+	fprintf(stderr, "Directory %s nested too deeply\n", path);
+	w->problems++;
+	return 0;
+    }
+    sub = *w;
+    sub.dir = path;
+    sub.depth = w->depth + 1;
+    sub.problems = 0;
+    for_each_dirent(getushort(dirent->deStartCluster), w->image_buf, w->bpb,
+		    walk_dirent, &sub);
+    w->problems += sub.problems;
+    return 0;
+}
+
+/* walk_tree calls fn on every file and directory below the directory
+   at cluster, depth first, a directory before what is in it.  fn gets
+   the entry's path (dir, '/' and its name) and its depth below
+   cluster, and returns non-zero to leave a directory's contents out.
+   Hidden directories are walked like any other.
+
+   Directories nested more than WALK_MAXDEPTH deep aren't followed,
+   since a damaged image can contain a directory that contains itself,
+   and paths longer than MAXPATHLEN are left out.  Both are reported,
+   and walk_tree returns how many there were. */
+int walk_tree(uint16_t cluster, const char *dir, uint8_t *image_buf,
+	      struct bpb33 *bpb, tree_fn fn, void *arg)
+{
+    struct walk_state w;
+
+    w.image_buf = image_buf;
+    w.bpb = bpb;
+    w.fn = fn;
+    w.arg = arg;
+    w.dir = dir;
+    w.depth = 0;
+    w.problems = 0;
+    for_each_dirent(cluster, image_buf, bpb, walk_dirent, &w);
+    return w.problems;
+}
+
+
+/* get_extent returns the number of clusters in the run of contiguous
+   clusters that starts at cluster, looking at no more than max of
+   them.  The cluster that follows the run in the chain is stored in
+   *next. */
+uint16_t get_extent(uint16_t cluster, uint16_t max, uint16_t *next,
+		    uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint16_t count = 0;
+    uint16_t following;
+
+    while (1) 
+    {
+	following = get_fat_entry(cluster, image_buf, bpb);
+	count++;
+	if (count >= max || following != cluster + 1)
+	    break;
+	cluster = following;
+    }
+    *next = following;
+    return count;
+}
+
+
+/* alloc_free_cluster finds a free cluster, looking first just after near
+   so that a growing chain stays contiguous, marks it as the end of a
+   chain and zeroes it.  Returns 0 if the disk is full. */
+uint16_t alloc_free_cluster(uint16_t near, uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint16_t maxclust = get_cluster_count(bpb);
+    uint16_t i, start;
+
+    if (maxclust <= CLUST_FIRST)
+	return 0;
+    start = (near >= CLUST_FIRST && near + 1 < maxclust) ? near + 1 : CLUST_FIRST;
+    i = start;
+    do
+    {
+	if (get_fat_entry(i, image_buf, bpb) == CLUST_FREE)
+	{
+	    set_fat_entry(i, FAT12_MASK & CLUST_EOFS, image_buf, bpb);
+	    memset(cluster_to_addr(i, image_buf, bpb), 0,
+		   bpb->bpbBytesPerSec * bpb->bpbSecPerClust);
+	    return i;
+	}
+	if (++i == maxclust)
+	    i = CLUST_FIRST;
+    } while (i != start);
+    return 0;
+}
+
+
+/* chain_length counts the clusters in the chain starting at cluster,
+   a run at a time.  A looped chain is cut off at the size of the
+   disk. */
+uint32_t chain_length(uint16_t cluster, uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint32_t n = 0;
+    uint32_t max = get_cluster_count(bpb);
+
+    while (is_valid_cluster(cluster, bpb) && n < max)
+	n += get_extent(cluster, max - n, &cluster, image_buf, bpb);
+    return n;
+}
+
+
+struct find_path_state 
+{
+    char *name;
+    struct direntry *found;
+};
+
+static int match_dirent(struct direntry *dirent, void *arg)
+{
+    struct find_path_state *state = arg;
+    char name[MAXFILENAME];
+
+    if (is_dot_dirent(dirent) || (dirent->deAttributes & ATTR_VOLUME) != 0)
+	return 0;
+    get_dirent_name(dirent, name);
+    if (strcasecmp(name, state->name) == 0) 
+    {
+	state->found = dirent;
+	return 1;
+    }
+    return 0;
+}
+
+/* find_path looks up a '/' separated path (relative to the root
+   directory) and returns its directory entry, or NULL if there is no
+   such file or directory.  The root directory itself has no entry, so
+   an empty path also gives NULL. */
+struct direntry *find_path(const char *path, uint8_t *image_buf, 
+			   struct bpb33 *bpb)
+{
+    char buf[MAXPATHLEN+1];
+    struct find_path_state state;
+    uint16_t cluster = MSDOSFSROOT;
+    char *p, *next;
+
+    strncpy(buf, path, MAXPATHLEN);
+    buf[MAXPATHLEN] = '\0';
+    state.found = NULL;
+
+    for (p = buf; p != NULL; p = next) 
+    {
+	while (*p == '/' || *p == '\\')
+	    p++;
+	if (*p == '\0')
+	    break;
+	next = strpbrk(p, "/\\");
+	if (next != NULL)
+	    *next++ = '\0';
+
+	/* only directories have anything underneath them */
+	if (state.found != NULL
+	    && (state.found->deAttributes & ATTR_DIRECTORY) == 0)
+	    return NULL;
+
+	state.name = p;
+	state.found = NULL;
+	for_each_dirent(cluster, image_buf, bpb, match_dirent, &state);
+	if (state.found == NULL)
+	    return NULL;
+	cluster = getushort(state.found->deStartCluster);
+    }
+    return state.found;
+}
+
+
+/* plan_fat12 fills in bpbFATsecs for a new FAT-12 file system, given
+   the rest of the geometry in bpb.  The size of the FAT depends on
+   the number of clusters, which in turn depends on the size of the
+   FAT, so we just try successively bigger FATs.  Returns -1 if the
+   geometry doesn't make a usable FAT-12 file system. */
+int plan_fat12(struct bpb33 *bpb)
+{
+    uint32_t root_secs, meta_secs, clusters;
+
+    if (bpb->bpbBytesPerSec == 0 || bpb->bpbSecPerClust == 0
+	|| (bpb->bpbSecPerClust & (bpb->bpbSecPerClust - 1)) != 0
+	|| bpb->bpbFATs == 0 || bpb->bpbRootDirEnts == 0
+	|| (bpb->bpbRootDirEnts * sizeof(struct direntry)) 
+	   % bpb->bpbBytesPerSec != 0)
+	return -1;
+
+    root_secs = bpb->bpbRootDirEnts * sizeof(struct direntry) 
+	/ bpb->bpbBytesPerSec;
+    for (bpb->bpbFATsecs = 1; ; bpb->bpbFATsecs++) 
+    {
+	meta_secs = bpb->bpbResSectors + bpb->bpbFATs * bpb->bpbFATsecs 
+	    + root_secs;
+	if (meta_secs >= bpb->bpbSectors)
+	    return -1;
+	clusters = (bpb->bpbSectors - meta_secs) / bpb->bpbSecPerClust;
+	if ((3 * (clusters + CLUST_FIRST) + 1) / 2
+	    <= (uint32_t)bpb->bpbFATsecs * bpb->bpbBytesPerSec)
+	    break;
+    }
+
+    /* any more and it would have to be FAT-16 */
+    if (clusters < 1 || clusters > 4084)
+	return -1;
+    return 0;
+}
+
+
+/* write_bootsector fills in a boot sector for the file system
+   described by bpb.  buf must hold bpbBytesPerSec zeroed bytes. */
+void write_bootsector(uint8_t *buf, struct bpb33 *bpb)
+{
+    struct bootsector33 *bootsect = (struct bootsector33*)buf;
+    struct byte_bpb33 *bytes = (struct byte_bpb33*)bootsect->bsBPB;
+
+    bootsect->bsJump[0] = 0xeb;
+    bootsect->bsJump[1] = 0x3c;
+    bootsect->bsJump[2] = 0x90;
+    memcpy(bootsect->bsOemName, "BSD  4.4", 8);
+    putushort(bytes->bpbBytesPerSec, bpb->bpbBytesPerSec);
+    bytes->bpbSecPerClust = bpb->bpbSecPerClust;
+    putushort(bytes->bpbResSectors, bpb->bpbResSectors);
+    bytes->bpbFATs = bpb->bpbFATs;
+    putushort(bytes->bpbRootDirEnts, bpb->bpbRootDirEnts);
+    putushort(bytes->bpbSectors, bpb->bpbSectors);
+    bytes->bpbMedia = bpb->bpbMedia;
+    putushort(bytes->bpbFATsecs, bpb->bpbFATsecs);
+    putushort(bytes->bpbSecPerTrack, bpb->bpbSecPerTrack);
+    putushort(bytes->bpbHeads, bpb->bpbHeads);
+    putushort(bytes->bpbHiddenSecs, bpb->bpbHiddenSecs);
+    bootsect->bsBootSectSig0 = BOOTSIG0;
+    bootsect->bsBootSectSig1 = BOOTSIG1;
+}
+
+
+/* dos_hash64 is a fast non-cryptographic hash, good enough to notice
+   that a sector or cluster has changed.  Chain calls by passing the
+   previous result as the seed. */
+uint64_t dos_hash64(const void *buf, size_t len, uint64_t seed)
+{
+    const uint8_t *p = buf;
+    uint64_t h = seed ^ (len * 0x9e3779b97f4a7c15ULL);
+    uint64_t w;
+
+    while (len >= 8) 
+    {
+	memcpy(&w, p, 8);
+	h = (h ^ w) * 0xff51afd7ed558ccdULL;
+	h ^= h >> 32;
+	p += 8;
+	len -= 8;
+    }
+    w = 0;
+    memcpy(&w, p, len);
+    h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 29;
+    return h;
+}
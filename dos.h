@@ -12,11 +12,17 @@
 /* prototypes for functions in dos.c */
 
 #include <stdint.h>
+#include <stddef.h>
 
 uint8_t *mmap_file(char *, int *);
+uint8_t *mmap_file_readonly(char *, int *);
 void unmmap_file(uint8_t *, int *);
+size_t mmap_size(void);
+int is_same_file(const char *, const char *);
 
 struct bpb33* check_bootsector(uint8_t *);
+int plan_fat12(struct bpb33 *);
+void write_bootsector(uint8_t *, struct bpb33 *);
 
 uint16_t get_fat_entry(uint16_t, uint8_t *, struct bpb33 *);
 
@@ -24,9 +30,33 @@ void set_fat_entry(uint16_t, uint16_t, uint8_t *, struct bpb33 *);
 
 int is_end_of_file(uint16_t);
 int is_valid_cluster(uint16_t, struct bpb33 *);
+uint16_t get_cluster_count(struct bpb33 *);
 
 uint8_t *root_dir_addr(uint8_t *, struct bpb33 *);
 
 uint8_t *cluster_to_addr(uint16_t, uint8_t *, struct bpb33 *);
 
+struct direntry;
+typedef int (*dirent_fn)(struct direntry *, void *);
+
+void get_dirent_name(struct direntry *, char *);
+int is_dot_dirent(struct direntry *);
+int for_each_dirent(uint16_t, uint8_t *, struct bpb33 *, dirent_fn, void *);
+
+#define WALK_MAXDEPTH 64
+typedef int (*tree_fn)(struct direntry *, const char *path, int depth, void *);
+int walk_tree(uint16_t, const char *, uint8_t *, struct bpb33 *, tree_fn, void *);
+struct direntry *find_path(const char *, uint8_t *, struct bpb33 *);
+
+uint16_t get_extent(uint16_t, uint16_t, uint16_t *, uint8_t *, struct bpb33 *);
+uint32_t chain_length(uint16_t, uint8_t *, struct bpb33 *);
+uint16_t alloc_free_cluster(uint16_t, uint8_t *, struct bpb33 *);
+
+uint64_t dos_hash64(const void *, size_t, uint64_t);
+
+/* debugging chatter on stderr, shown when dos_verbosity >= level */
+extern int dos_verbosity;
+void dos_debug(int level, const char *fmt, ...) 
+    __attribute__((format(printf, 2, 3)));
+
 #endif // __DOS_H__
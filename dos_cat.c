@@ -13,221 +13,97 @@
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
+#include "dos_file.h"
+#include "packed.h"
+#include "stats.h"
 
 
-uint16_t get_dirent(struct direntry *dirent, char *buffer)
+/* do_cat writes length bytes of the file starting at offset; a
+   negative offset counts back from the end of the file */
+void do_cat(struct dos_file *f, char *name, int64_t offset, uint32_t length)
 {
-    uint16_t followclust = 0;
-    memset(buffer, 0, MAXFILENAME);
-
-    int i;
-    char name[9];
-    char extension[4];
-    uint16_t file_cluster;
-    name[8] = ' ';
-    extension[3] = ' ';
-    memcpy(name, &(dirent->deName[0]), 8);
-    memcpy(extension, dirent->deExtension, 3);
-    if (name[0] == SLOT_EMPTY)
-    {
-	return followclust;
-    }
-
-    /* skip over deleted entries */
-    if (((uint8_t)name[0]) == SLOT_DELETED)
-    {
-	return followclust;
-    }
-
-    if (((uint8_t)name[0]) == 0x2E)
-    {
-	// dot entry ("." or "..")
-	// skip it
-        return followclust;
-    }
+    const uint8_t *p;
+    uint32_t end, nbytes;
 
-    /* names are space padded - remove the spaces */
-    for (i = 8; i > 0; i--) 
-    {
-	if (name[i] == ' ') 
-	    name[i] = '\0';
-	else 
-	    break;
-    }
+    fprintf(stderr, "doing cat for %s, size %d\n", name, f->size);
 
-    /* remove the spaces from extensions */
-    for (i = 3; i > 0; i--) 
-    {
-	if (extension[i] == ' ') 
-	    extension[i] = '\0';
-	else 
-	    break;
-    }
+    if (offset < 0)
+	offset = (-offset > f->size) ? 0 : f->size + offset;
+    if (offset > f->mapped)
+	offset = f->mapped;
+    end = (length < f->mapped - offset) ? offset + length : f->mapped;
 
-    if ((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN)
-    {
-	// ignore any long file name extension entries
-	//
-	// printf("Win95 long-filename entry seq 0x%0x\n", dirent->deName[0]);
-    }
-    else if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) 
-    {
-        // don't deal with hidden directories; MacOS makes these
-        // for trash directories and such; just ignore them.
-	if ((dirent->deAttributes & ATTR_HIDDEN) != ATTR_HIDDEN)
-        {
-            strcpy(buffer, name);
-            file_cluster = getushort(dirent->deStartCluster);
-            followclust = file_cluster;
-        }
-    }
-    else 
+    /* a run of contiguous clusters at a time; the extent map finds
+       where offset is without reading anything before it */
+    for ( ; offset < end; offset += nbytes)
     {
-        /*
-         * a "regular" file entry
-         * print attributes, size, starting cluster, etc.
-         */
-        strcpy(buffer, name);
-        if (strlen(extension))  
-        {
-            strcat(buffer, ".");
-            strcat(buffer, extension);
-        }
+        nbytes = end - offset;
+        p = dos_map(f, offset, &nbytes);
+        nbytes = packed_fault_in(p, nbytes);
+        fwrite(p, 1, nbytes, stdout);
+        packed_release(p, nbytes);
+        STAT_ADD(bytes_copied, nbytes);
     }
-
-    return followclust;
 }
 
 
-struct direntry *follow_dir(char *searchpath, uint16_t cluster, 
-		            uint8_t *image_buf, struct bpb33* bpb)
+/* range_option takes --offset N and --length N (or --offset=N,
+   --length=N) out of the command line.  N may be decimal, octal or
+   hex, and only the offset may be negative. */
+void range_option(int *argc, char **argv, int64_t *offset, uint32_t *length)
 {
-    char *next_path_component = index(searchpath, '/');
-    int entry_len = strlen(searchpath);
-    if (next_path_component != NULL)
-    {
-        entry_len = next_path_component - searchpath;
-        *next_path_component = '\0';
-        next_path_component++;
-    }
+    int i, j, used;
+    char *name, *value, *end;
+    long long n;
 
-    struct direntry *rv = NULL;
-
-    while (is_valid_cluster(cluster, bpb))
+    for (i = 1; i < *argc; )
     {
-        struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
-
-        int numDirEntries = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) / sizeof(struct direntry);
-        int i = 0;
-	for ( ; i < numDirEntries; i++)
+	used = 0;
+	value = NULL;
+	if (strncmp(argv[i], "--offset", 8) == 0 || strncmp(argv[i], "--length", 8) == 0)
 	{
-            char buffer[MAXFILENAME]; 
-            uint16_t followclust = get_dirent(dirent, buffer);
-
-            if (strncasecmp(searchpath, buffer, strlen(searchpath)) == 0)
-            {
-                if (next_path_component)
-                {
-                    if (followclust)
-                        rv = follow_dir(buffer, followclust, image_buf, bpb);
-                }
-                else
-                {
-                    rv = dirent; 
-                }
-            }
-
-            if (rv)
-                break;
-
-            dirent++;
+	    if (argv[i][8] == '=')
+	    {
+		value = argv[i] + 9;
+		used = 1;
+	    }
+	    else if (argv[i][8] == '\0' && i + 1 < *argc)
+	    {
+		value = argv[i + 1];
+		used = 2;
+	    }
+	}
+	if (used == 0)
+	{
+	    i++;
+	    continue;
 	}
 
-	cluster = get_fat_entry(cluster, image_buf, bpb);
-    }
-
-    return rv;
-}
-
-
-struct direntry *traverse_root(char *searchpath, uint8_t *image_buf, struct bpb33* bpb)
-{
-    uint16_t cluster = 0;
-    struct direntry *rv = NULL;
-
-    struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
-
-    char *next_path_component = index(searchpath, '/');
-    int root_entry_len = strlen(searchpath);
-    if (next_path_component != NULL)
-    {
-        root_entry_len = next_path_component - searchpath;
-        *next_path_component = '\0';
-        next_path_component++;
-    }
-
-    char buffer[MAXFILENAME];
-
-    int i = 0;
-    for ( ; i < bpb->bpbRootDirEnts; i++)
-    {
-        uint16_t followclust = get_dirent(dirent, buffer);
-
-        if (strncasecmp(searchpath, buffer, strlen(searchpath)) == 0)
-        {
-            if (!next_path_component)
-                rv = dirent;
-            else if (is_valid_cluster(followclust, bpb))
-                rv = follow_dir(next_path_component, followclust, image_buf, bpb);
-        }
-
-        if (rv)
-            break;
-
-        dirent++;
-    }
-
-    return rv;
-}
-
-
-struct direntry *find_file(char *searchpath, uint8_t *image_buf, struct bpb33 *bpb)
-{
-    /* strip any leading '/' from search path */
-    while (*searchpath == '/' && *searchpath != '\0') searchpath++;
-    return traverse_root(searchpath, image_buf, bpb);
-}
-
-
-void do_cat(struct direntry *dirent, uint8_t *image_buf, struct bpb33 *bpb)
-{
-    uint16_t cluster = getushort(dirent->deStartCluster);
-    uint32_t bytes_remaining = getulong(dirent->deFileSize);
-    uint16_t cluster_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
-
-    char buffer[MAXFILENAME];
-    get_dirent(dirent, buffer);
-
-    fprintf(stderr, "doing cat for %s, size %d\n", buffer, bytes_remaining);
-
-    while (is_valid_cluster(cluster, bpb))
-    {
-        /* map the cluster number to the data location */
-        uint8_t *p = cluster_to_addr(cluster, image_buf, bpb);
-
-        uint32_t nbytes = bytes_remaining > cluster_size ? cluster_size : bytes_remaining;
-
-        fwrite(p, 1, nbytes, stdout);
-        bytes_remaining -= nbytes;
-    
-        cluster = get_fat_entry(cluster, image_buf, bpb);
+	name = argv[i];
+	n = strtoll(value, &end, 0);
+	if (*value == '\0' || *end != '\0' || n > UINT32_MAX
+	    || n < (name[2] == 'o' ? -(long long)UINT32_MAX : 0))
+	{
+	    fprintf(stderr, "%s: bad value %s for %.8s\n", argv[0], value, name);
+	    exit(1);
+	}
+	if (name[2] == 'o')
+	    *offset = n;
+	else
+	    *length = n;
+
+	for (j = i; j + used <= *argc; j++)
+	    argv[j] = argv[j + used];
+	*argc -= used;
     }
 }
 
 
 void usage(char *progname)
 {
-    fprintf(stderr, "usage: %s <imagename> <filename>\n", progname);
+    fprintf(stderr, "usage: %s [--stats] [--offset N] [--length N] <imagename> <filename>\n", progname);
+    fprintf(stderr, "\t--offset N  start N bytes in; a negative N counts from the end\n");
+    fprintf(stderr, "\t--length N  write no more than N bytes\n");
     exit(1);
 }
 
@@ -237,6 +113,12 @@ int main(int argc, char** argv)
     uint8_t *image_buf;
     int fd;
     struct bpb33* bpb;
+    struct dos_file *f;
+    int64_t offset = 0;
+    uint32_t length = UINT32_MAX;
+
+    stats_option(&argc, argv);
+    range_option(&argc, argv, &offset, &length);
     if (argc != 3)
     {
 	usage(argv[0]);
@@ -245,9 +127,15 @@ int main(int argc, char** argv)
     image_buf = mmap_file(argv[1], &fd);
     bpb = check_bootsector(image_buf);
 
-    struct direntry *dirent = find_file(argv[2], image_buf, bpb);
-    if (dirent)
-        do_cat(dirent, image_buf, bpb);
+    f = dos_open(argv[2], image_buf, bpb);
+    if (f == NULL)
+    {
+	fprintf(stderr, "%s: %s\n", argv[2],
+		errno == EISDIR ? "is a directory" : "not found");
+	exit(1);
+    }
+    do_cat(f, argv[2], offset, length);
+    dos_close(f);
 
     unmmap_file(image_buf, &fd);
 
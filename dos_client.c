@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string.h>
+#include <limits.h>
+
+#include "direntry.h"
+#include "report.h"
+#include "dos_proto.h"
+
+
+/* dos_client asks a running dos_server about an image, instead of
+   opening the image itself.  The image is named as dos_server was
+   given it, or by its last path component. */
+
+static int sock;
+
+static void write_full(const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    ssize_t n;
+
+    while (len > 0)
+    {
+	n = write(sock, p, len);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0)
+	{
+	    fprintf(stderr, "Lost the server: %s\n", strerror(errno));
+	    exit(1);
+	}
+	p += n;
+	len -= n;
+    }
+}
+
+static void read_full(void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    ssize_t n;
+
+    while (len > 0)
+    {
+	n = read(sock, p, len);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	{
+	    fprintf(stderr, "Lost the server\n");
+	    exit(1);
+	}
+	p += n;
+	len -= n;
+    }
+}
+
+/* request sends one request and reads the response header; the
+   caller reads the payload */
+static uint64_t request(int op, const char *image, const char *path,
+			const char *dest, uint64_t offset, uint64_t length)
+{
+    struct dsrv_req req;
+    struct dsrv_resp resp;
+    char names[DSRV_MAXNAMES];
+    size_t len;
+
+    len = snprintf(names, sizeof(names), "%s%c%s%c%s", image, 0, path, 0, dest) + 1;
+    if (len > sizeof(names))
+    {
+	fprintf(stderr, "Names too long\n");
+	exit(1);
+    }
+    memset(&req, 0, sizeof(req));
+    req.reqMagic = DSRV_MAGIC;
+    req.reqOp = op;
+    req.reqNameLen = len;
+    req.reqOffset = offset;
+    req.reqLength = length;
+    write_full(&req, sizeof(req));
+    write_full(names, len);
+
+    read_full(&resp, sizeof(resp));
+    if (resp.respMagic != DSRV_MAGIC)
+    {
+	fprintf(stderr, "Bad response from server\n");
+	exit(1);
+    }
+    if (resp.respStatus != 0)
+    {
+	fprintf(stderr, "%s: %s\n", resp.respStatus == ENODEV ? image : path,
+		strerror(resp.respStatus));
+	exit(1);
+    }
+    return resp.respLength;
+}
+
+static void *xmalloc(size_t len)
+{
+    void *buf = malloc(len);
+
+    if (buf == NULL)
+    {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+    return buf;
+}
+
+static void *read_payload(uint64_t len)
+{
+    void *buf = xmalloc(len + 1);
+
+    read_full(buf, len);
+    return buf;
+}
+
+
+static void print_stat(struct dsrv_stat *st)
+{
+    if (st->stAttr & ATTR_DIRECTORY)
+    {
+	printf("%s/ (directory)\n", st->stName);
+	return;
+    }
+    printf("%s (%u bytes) (starting cluster %d) %c%c%c%c\n",
+	   st->stName, st->stSize, st->stCluster,
+	   (st->stAttr & ATTR_READONLY) ? 'r' : ' ',
+	   (st->stAttr & ATTR_HIDDEN) ? 'h' : ' ',
+	   (st->stAttr & ATTR_SYSTEM) ? 's' : ' ',
+	   (st->stAttr & ATTR_ARCHIVE) ? 'a' : ' ');
+}
+
+static void do_list(const char *image, const char *path)
+{
+    uint64_t len = request(DSRV_LIST, image, path, "", 0, 0);
+    struct dsrv_stat *st = read_payload(len);
+    uint64_t i;
+
+    for (i = 0; i < len / sizeof(struct dsrv_stat); i++)
+	print_stat(&st[i]);
+    free(st);
+}
+
+static void do_stat(const char *image, const char *path)
+{
+    uint64_t len = request(DSRV_STAT, image, path, "", 0, 0);
+    struct dsrv_stat *st = read_payload(len);
+
+    print_stat(st);
+    printf("  %u clusters, modified %04d-%02d-%02d %02d:%02d:%02d\n",
+	   st->stClusters,
+	   1980 + (st->stMDate >> 9), (st->stMDate >> 5) & 0xf, st->stMDate & 0x1f,
+	   st->stMTime >> 11, (st->stMTime >> 5) & 0x3f, (st->stMTime & 0x1f) * 2);
+    free(st);
+}
+
+/* do_cat reads a range of a file, DSRV_MAXREAD bytes at a time */
+static void do_cat(const char *image, const char *path,
+		   uint64_t offset, uint64_t length)
+{
+    uint8_t *buf = xmalloc(DSRV_MAXREAD);
+    uint64_t want, len;
+
+    while (length > 0)
+    {
+	want = length < DSRV_MAXREAD ? length : DSRV_MAXREAD;
+	len = request(DSRV_READ, image, path, "", offset, want);
+	read_full(buf, len);
+	fwrite(buf, 1, len, stdout);
+	if (len < want)
+	    break;
+	offset += len;
+	length -= len;
+    }
+    free(buf);
+}
+
+static void do_copyout(const char *image, const char *path, const char *dest)
+{
+    char abs[PATH_MAX];
+
+    /* the server has its own working directory */
+    if (dest[0] != '/')
+    {
+	if (getcwd(abs, sizeof(abs)) == NULL
+	    || strlen(abs) + strlen(dest) + 2 > sizeof(abs))
+	{
+	    fprintf(stderr, "Can't resolve %s\n", dest);
+	    exit(1);
+	}
+	strcat(abs, "/");
+	strcat(abs, dest);
+	dest = abs;
+    }
+    request(DSRV_COPYOUT, image, path, dest, 0, 0);
+}
+
+static void do_check(const char *image)
+{
+    uint64_t len = request(DSRV_CHECK, image, "", "", 0, 0);
+    uint8_t *buf = read_payload(len), *p = buf;
+    struct dsrv_finding fi;
+    char path[DSRV_MAXNAMES];
+    int n = 0;
+
+    while (p + sizeof(fi) <= buf + len)
+    {
+	memcpy(&fi, p, sizeof(fi));
+	p += sizeof(fi);
+	snprintf(path, sizeof(path), "%.*s", (int)fi.fiPathLen, (char*)p);
+	p += fi.fiPathLen;
+	n++;
+	switch (fi.fiKind)
+	{
+	case FIND_BAD_CLUSTER:
+	    printf("%s: bad cluster after %d\n", path, fi.fiCluster);
+	    break;
+	case FIND_MISSING_BLOCK:
+	    printf("%s: chain longer than file size\n", path);
+	    break;
+	case FIND_EXCESS_BLOCKS:
+	    printf("%s: chain shorter than file size\n", path);
+	    break;
+	case FIND_ORPHAN:
+	    printf("orphan cluster %d\n", fi.fiCluster);
+	    break;
+	}
+    }
+    printf("%d problems found\n", n);
+    free(buf);
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-s socket] <imagename> <command>\n", progname);
+    fprintf(stderr, "\tls [path]                    list a directory\n");
+    fprintf(stderr, "\tstat <path>                  describe one file\n");
+    fprintf(stderr, "\tcat <path> [offset [length]] print (part of) a file\n");
+    fprintf(stderr, "\tcp <path> <hostfile>         copy a file out of the image\n");
+    fprintf(stderr, "\tcheck                        look for problems, like scandisk\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    struct sockaddr_un addr;
+    const char *socket_path = DSRV_SOCKET, *image, *cmd;
+    char *progname = argv[0];
+    int opt, nargs;
+
+    while ((opt = getopt(argc, argv, "s:")) != -1)
+    {
+	switch (opt)
+	{
+	case 's':
+	    socket_path = optarg;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (argc - optind < 2)
+	usage(argv[0]);
+    image = argv[optind];
+    cmd = argv[optind + 1];
+    argv += optind + 2;
+    nargs = argc - optind - 2;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+	fprintf(stderr, "Can't connect to %s: %s\n", socket_path, strerror(errno));
+	exit(1);
+    }
+
+    if (strcmp(cmd, "ls") == 0 && nargs <= 1)
+	do_list(image, nargs ? argv[0] : "/");
+    else if (strcmp(cmd, "stat") == 0 && nargs == 1)
+	do_stat(image, argv[0]);
+    else if (strcmp(cmd, "cat") == 0 && nargs >= 1 && nargs <= 3)
+	do_cat(image, argv[0],
+	       nargs > 1 ? strtoull(argv[1], NULL, 0) : 0,
+	       nargs > 2 ? strtoull(argv[2], NULL, 0) : UINT32_MAX);
+    else if (strcmp(cmd, "cp") == 0 && nargs == 2)
+	do_copyout(image, argv[0], argv[1]);
+    else if (strcmp(cmd, "check") == 0 && nargs == 0)
+	do_check(image);
+    else
+	usage(progname);
+
+    close(sock);
+    return 0;
+}
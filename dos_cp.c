@@ -9,12 +9,18 @@
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #include "bootsect.h"
 #include "bpb.h"
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
+#include "dos_file.h"
+#include "dos_dir.h"
+#include "overlay.h"
+#include "packed.h"
+#include "stats.h"
 
 
 /* get_name retrieves the filename from a directory entry */
@@ -67,6 +73,7 @@ void get_name(char *fullname, struct direntry *dirent)
    directory */
 #define FIND_FILE 0
 #define FIND_DIR 1
+#define FIND_TREE 2
 
 struct direntry* find_file(char *infilename, uint16_t cluster,
 			   int find_mode,
@@ -129,6 +136,7 @@ struct direntry* find_file(char *infilename, uint16_t cluster,
 	     d < bpb->bpbBytesPerSec * bpb->bpbSecPerClust; 
 	     d += sizeof(struct direntry)) 
 	{
+	    STAT_INC(dirents_parsed);
 	    if (dirent->deName[0] == SLOT_EMPTY) 
 	    {
 		/* we failed to find the file */
@@ -151,7 +159,9 @@ struct direntry* find_file(char *infilename, uint16_t cluster,
 		    /* it's a directory */
 		    if (next_name == NULL) 
 		    {
-			fprintf(stderr, "Cannot copy out a directory\n");
+			if (find_mode == FIND_TREE)
+			    return dirent;
+			fprintf(stderr, "Cannot copy out a directory (use -r)\n");
 			exit(1);
 		    }
 		    dir_cluster = getushort(dirent->deStartCluster);
@@ -190,50 +200,33 @@ struct direntry* find_file(char *infilename, uint16_t cluster,
 }
 
 
-/* copy_out_file actually does the work of copying, recursing through
-   the clusters of the memory disk image, and copying out a cluster at
-   a time */
+/* copy_out_file actually does the work of copying, a run of
+   contiguous clusters at a time, from the file's extent map */
 
-void copy_out_file(FILE *fd, uint16_t cluster, uint32_t bytes_remaining,
+void copy_out_file(FILE *fd, struct direntry *dirent,
 		   uint8_t *image_buf, struct bpb33* bpb)
 {
-    int total_clusters, clust_size;
-    uint8_t *p;
-
-    clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
-    total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
-
-    assert(cluster <= total_clusters);
+    struct dos_file *f = dos_open_dirent(dirent, image_buf, bpb);
+    const uint8_t *p;
+    uint32_t offset, n;
 
-    if (cluster == 0) 
+    if (f == NULL)
     {
-	fprintf(stderr, "Bad file termination\n");
+	fprintf(stderr, "Can't copy out a directory\n");
 	return;
     }
-    else if (is_end_of_file(cluster)) 
+    for (offset = 0; offset < f->mapped; offset += n)
     {
-	return;	
-    } 
-
-
-    /* map the cluster number to the data location */
-    p = cluster_to_addr(cluster, image_buf, bpb);
-
-    if (bytes_remaining <= clust_size) 
-    {
-	/* this is the last cluster */
-	fwrite(p, bytes_remaining, 1, fd);
-    } 
-    else 
-    {
-	/* more clusters after this one */
-	fwrite(p, clust_size, 1, fd);
-
-	/* recurse, continuing to copy */
-	copy_out_file(fd, get_fat_entry(cluster, image_buf, bpb), 
-		      bytes_remaining - clust_size, image_buf, bpb);
+	n = f->mapped - offset;
+	p = dos_map(f, offset, &n);
+	n = packed_fault_in(p, n);
+	fwrite(p, n, 1, fd);
+	packed_release(p, n);
+	STAT_ADD(bytes_copied, n);
     }
-    return;
+    if (f->mapped < f->size)
+	fprintf(stderr, "Bad file termination\n");
+    dos_close(f);
 }
 
 /* copyout copies a file from the FAT-12 memory disk image to a
@@ -244,8 +237,6 @@ void copyout(char *infilename, char* outfilename,
 {
     struct direntry *dirent = (void*)1;
     FILE *fd;
-    uint16_t start_cluster;
-    uint32_t size;
 
     /* skip the volume name */
     assert(strncmp("a:", infilename, 2)==0);
@@ -261,6 +252,7 @@ void copyout(char *infilename, char* outfilename,
     }
 
     /* open the real file for writing */
+    STAT_INC(syscalls);
     fd = fopen(outfilename, "w");
     if (fd == NULL) 
     {
@@ -270,13 +262,222 @@ void copyout(char *infilename, char* outfilename,
     }
 
     /* do the actual copy out*/
-    start_cluster = getushort(dirent->deStartCluster);
-    size = getulong(dirent->deFileSize);
-    copy_out_file(fd, start_cluster, size, image_buf, bpb);
+    copy_out_file(fd, dirent, image_buf, bpb);
     
     fclose(fd);
 }
 
+/* a file waiting to be written out by one of the copy-out workers */
+struct extract_job 
+{
+    struct direntry *dirent;
+    char *path;
+};
+
+/* the work list shared between the tree walk and the worker threads.
+   Workers claim jobs by atomically bumping next. */
+struct extract_queue 
+{
+    struct extract_job *jobs;
+    int count;
+    int alloc;
+    int next;
+    int errors;
+    const char *hostdir;
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+};
+
+/* collect_dirent is called for each entry of the tree being
+   extracted.  Directories are created straight away, so that they
+   all exist before any worker starts writing files into them */
+int collect_dirent(struct direntry *dirent, const char *path, int depth, void *arg)
+{
+    struct extract_queue *queue = arg;
+    char *hostpath;
+
+    (void)depth;
+    hostpath = malloc(strlen(queue->hostdir) + strlen(path) + 1);
+    sprintf(hostpath, "%s%s", queue->hostdir, path);
+
+    if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) 
+    {
+	STAT_INC(syscalls);
+	if (mkdir(hostpath, 0755) < 0 && errno != EEXIST) 
+	{
+	    fprintf(stderr, "Can't create directory %s: %s\n",
+		    hostpath, strerror(errno));
+	    queue->errors++;
+	    free(hostpath);
+	    return 1;
+	}
+	free(hostpath);
+	return 0;
+    }
+
+    if (queue->count == queue->alloc) 
+    {
+	queue->alloc = queue->alloc ? queue->alloc * 2 : 64;
+	queue->jobs = realloc(queue->jobs, 
+			      queue->alloc * sizeof(struct extract_job));
+    }
+    queue->jobs[queue->count].dirent = dirent;
+    queue->jobs[queue->count].path = hostpath;
+    queue->count++;
+    return 0;
+}
+
+/* extract_file writes one file out with positional writes, one
+   pwrite per run of contiguous clusters */
+int extract_file(struct extract_job *job, uint8_t *image_buf, 
+		 struct bpb33 *bpb)
+{
+    uint16_t cluster, run_start;
+    uint32_t bytes_remaining, run_bytes;
+    uint32_t clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
+    off_t offset = 0;
+    size_t len;
+    ssize_t n;
+    uint8_t *p;
+    int fd;
+
+    STAT_INC(syscalls);
+    fd = open(job->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) 
+    {
+	fprintf(stderr, "Can't open file %s to copy data out: %s\n",
+		job->path, strerror(errno));
+	return -1;
+    }
+
+    cluster = getushort(job->dirent->deStartCluster);
+    bytes_remaining = getulong(job->dirent->deFileSize);
+    while (bytes_remaining > 0 && is_valid_cluster(cluster, bpb)) 
+    {
+	/* gather as many contiguous clusters as we can */
+	run_start = cluster;
+	run_bytes = clust_size * get_extent(cluster, 
+					    (bytes_remaining - 1) / clust_size + 1,
+					    &cluster, image_buf, bpb);
+	if (run_bytes > bytes_remaining)
+	    run_bytes = bytes_remaining;
+
+	p = cluster_to_addr(run_start, image_buf, bpb);
+	while (run_bytes > 0) 
+	{
+	    STAT_INC(syscalls);
+	    len = packed_fault_in(p, run_bytes);
+	    n = pwrite(fd, p, len, offset);
+	    packed_release(p, len);
+	    if (n < 0) 
+	    {
+		fprintf(stderr, "Write to %s failed: %s\n", 
+			job->path, strerror(errno));
+		close(fd);
+		return -1;
+	    }
+	    STAT_ADD(bytes_copied, n);
+	    p += n;
+	    offset += n;
+	    run_bytes -= n;
+	    bytes_remaining -= n;
+	}
+    }
+
+    if (bytes_remaining > 0)
+	fprintf(stderr, "Bad file termination in %s\n", job->path);
+
+    close(fd);
+    STAT_INC(syscalls);
+    return 0;
+}
+
+void *extract_worker(void *arg)
+{
+    struct extract_queue *queue = arg;
+    int i;
+
+    while ((i = __sync_fetch_and_add(&queue->next, 1)) < queue->count) 
+    {
+	if (extract_file(&queue->jobs[i], queue->image_buf, queue->bpb) < 0)
+	    __sync_fetch_and_add(&queue->errors, 1);
+    }
+    stats_flush();
+    return NULL;
+}
+
+/* copyout_tree copies a directory (or the whole volume) out of the
+   disk image into hostdir.  The directory tree is created first, and
+   then the files are written by a pool of nthreads workers. */
+
+int copyout_tree(char *infilename, char *hostdir, int nthreads,
+		 uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct extract_queue queue;
+    struct direntry *dirent;
+    uint16_t cluster = MSDOSFSROOT;
+    pthread_t *threads;
+    int i;
+
+    assert(strncmp("a:", infilename, 2)==0);
+    infilename+=2;
+
+    while (*infilename == '/' || *infilename == '\\')
+	infilename++;
+
+    if (*infilename != '\0') 
+    {
+	dirent = find_file(infilename, 0, FIND_TREE, image_buf, bpb);
+	if (dirent == NULL || (dirent->deAttributes & ATTR_DIRECTORY) == 0) 
+	{
+	    fprintf(stderr, "No directory called %s exists in the disk image\n",
+		    infilename);
+	    exit(1);
+	}
+	cluster = getushort(dirent->deStartCluster);
+    }
+
+    if (mkdir(hostdir, 0755) < 0 && errno != EEXIST) 
+    {
+	fprintf(stderr, "Can't create directory %s: %s\n",
+		hostdir, strerror(errno));
+	exit(1);
+    }
+
+    memset(&queue, 0, sizeof(queue));
+    queue.image_buf = image_buf;
+    queue.bpb = bpb;
+    queue.hostdir = hostdir;
+    queue.errors += walk_tree(cluster, "", image_buf, bpb, collect_dirent, &queue);
+
+    if (nthreads > queue.count)
+	nthreads = queue.count;
+    if (nthreads < 1)
+	nthreads = 1;
+
+    threads = malloc(nthreads * sizeof(pthread_t));
+    for (i = 0; i < nthreads; i++) 
+    {
+	if (pthread_create(&threads[i], NULL, extract_worker, &queue) != 0) 
+	{
+	    /* carry on with the workers we did get */
+	    nthreads = i;
+	    break;
+	}
+    }
+    if (nthreads == 0)
+	extract_worker(&queue);
+    for (i = 0; i < nthreads; i++)
+	pthread_join(threads[i], NULL);
+    free(threads);
+
+    for (i = 0; i < queue.count; i++)
+	free(queue.jobs[i].path);
+    free(queue.jobs);
+
+    return queue.errors;
+}
+
 /* copy_in_file actually does the copying of the file into the memory
    image, updates the FAT, and returns the starting cluster of the
    file */
@@ -335,6 +536,7 @@ uint16_t copy_in_file(FILE* fd, uint8_t *image_buf, struct bpb33* bpb,
 
 	    /* copy the data into the cluster */
 	    memcpy(cluster_to_addr(i, image_buf, bpb), buf, clust_size);
+	    STAT_ADD(bytes_copied, bytes);
 	}
 
 	if (bytes < clust_size) 
@@ -350,57 +552,41 @@ uint16_t copy_in_file(FILE* fd, uint8_t *image_buf, struct bpb33* bpb,
     return start_cluster;
 }
 
-/* write the values into a directory entry */
-void write_dirent(struct direntry *dirent, char *filename, 
-		  uint16_t start_cluster, uint32_t size)
+/* dos_name turns the last part of a path into the upper case, space
+   padded 8.3 name a directory entry holds, 11 bytes in all.  It
+   returns 0 if the path has no extension, and the caller says that
+   the extension defaults to ___. */
+int dos_name(const char *filename, uint8_t *name)
 {
-    char *p, *p2;
-    char *uppername;
-    int len, i;
-
-    /* clean out anything old that used to be here */
-    memset(dirent, 0, sizeof(struct direntry));
-
-    /* extract just the filename part */
-    uppername = strdup(filename);
-    p2 = uppername;
-    for (i = 0; i < strlen(filename); i++) 
-    {
-	if (p2[i] == '/' || p2[i] == '\\') 
-	{
-	    uppername = p2+i+1;
-	}
-    }
+    const char *base = filename, *p;
+    int i;
 
-    /* convert filename to upper case */
-    for (i = 0; i < strlen(uppername); i++) 
-    {
-	uppername[i] = toupper(uppername[i]);
-    }
+    for (p = filename; *p != '\0'; p++)
+	if (*p == '/' || *p == '\\')
+	    base = p + 1;
 
-    /* set the file name and extension */
-    memset(dirent->deName, ' ', 8);
-    p = strchr(uppername, '.');
-    memcpy(dirent->deExtension, "___", 3);
-    if (p == NULL) 
+    memset(name, ' ', 11);
+    for (i = 0, p = base; *p != '\0' && *p != '.'; p++)
+	if (i < 8)
+	    name[i++] = toupper((unsigned char)*p);
+    if (*p != '.')
     {
-	fprintf(stderr, "No filename extension given - defaulting to .___\n");
-    }
-    else 
-    {
-	*p = '\0';
-	p++;
-	len = strlen(p);
-	if (len > 3) len = 3;
-	memcpy(dirent->deExtension, p, len);
+	memcpy(name + 8, "___", 3);
+	return 0;
     }
+    for (i = 8, p++; *p != '\0' && i < 11; p++)
+	name[i++] = toupper((unsigned char)*p);
+    return 1;
+}
 
-    if (strlen(uppername)>8) 
-    {
-	uppername[8]='\0';
-    }
-    memcpy(dirent->deName, uppername, strlen(uppername));
-    free(p2);
+/* set_dirent fills in a directory entry for a file named by dos_name */
+void set_dirent(struct direntry *dirent, const uint8_t *name,
+		uint16_t start_cluster, uint32_t size)
+{
+    /* clean out anything old that used to be here */
+    memset(dirent, 0, sizeof(struct direntry));
+    memcpy(dirent->deName, name, 8);
+    memcpy(dirent->deExtension, name + 8, 3);
 
     /* set the attributes and file size */
     dirent->deAttributes = ATTR_NORMAL;
@@ -411,46 +597,164 @@ void write_dirent(struct direntry *dirent, char *filename,
        cared... */
 }
 
+/* write the values into a directory entry */
+void write_dirent(struct direntry *dirent, char *filename, 
+		  uint16_t start_cluster, uint32_t size)
+{
+    uint8_t name[11];
 
-/* create_dirent finds a free slot in the directory, and write the
-   directory entry */
+    if (!dos_name(filename, name))
+	fprintf(stderr, "No filename extension given - defaulting to .___\n");
+    set_dirent(dirent, name, start_cluster, size);
+}
 
-void create_dirent(struct direntry *dirent, char *filename, 
-		   uint16_t start_cluster, uint32_t size,
-		   uint8_t *image_buf, struct bpb33* bpb)
+
+/* dir_cluster finds the first cluster of the directory a path puts
+   a file in (MSDOSFSROOT for the root), or -1 if there's no such
+   directory */
+
+int dir_cluster(char *filename, uint8_t *image_buf, struct bpb33* bpb)
 {
-    while (1) 
+    char buf[MAXPATHLEN+1];
+    struct direntry *dirent;
+    char *p;
+
+    strncpy(buf, filename, MAXPATHLEN);
+    buf[MAXPATHLEN] = '\0';
+    for (p = buf + strlen(buf); p > buf && p[-1] != '/' && p[-1] != '\\'; p--)
+	;
+    *p = '\0';
+    if (strspn(buf, "/\\") == strlen(buf))
+	return MSDOSFSROOT;
+
+    dirent = find_path(buf, image_buf, bpb);
+    if (dirent == NULL || (dirent->deAttributes & ATTR_DIRECTORY) == 0)
+	return -1;
+    return getushort(dirent->deStartCluster);
+}
+
+/* how copyin treats a file that already exists */
+#define COPY_NEW 0		/* refuse to touch it */
+#define COPY_APPEND 1		/* add to the end of it */
+#define COPY_OVERWRITE 2	/* replace its contents */
+
+/* next_in_chain returns the cluster after prev in a file's chain (or
+   the first cluster, if prev is 0), extending the chain by a new
+   cluster if it ends there */
+uint16_t next_in_chain(struct direntry *dirent, uint16_t prev,
+		       uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint16_t cluster;
+
+    if (prev == 0)
+	cluster = getushort(dirent->deStartCluster);
+    else
+	cluster = get_fat_entry(prev, image_buf, bpb);
+    if (is_valid_cluster(cluster, bpb))
+	return cluster;
+
+    cluster = alloc_free_cluster(prev, image_buf, bpb);
+    if (cluster == 0)
     {
-	if (dirent->deName[0] == SLOT_EMPTY) 
-	{
-	    /* we found an empty slot at the end of the directory */
-	    write_dirent(dirent, filename, start_cluster, size);
-	    dirent++;
+	fprintf(stderr, "No more space in filesystem\n");
+	exit(1);
+    }
+    if (prev == 0)
+	putushort(dirent->deStartCluster, cluster);
+    else
+	set_fat_entry(prev, cluster, image_buf, bpb);
+    return cluster;
+}
 
-	    /* make sure the next dirent is set to be empty, just in
-	       case it wasn't before */
-	    memset((uint8_t*)dirent, 0, sizeof(struct direntry));
-	    dirent->deName[0] = SLOT_EMPTY;
-	    return;
-	}
+/* truncate_chain cuts a file's chain down to the clusters that size
+   bytes need, and frees the rest */
+void truncate_chain(struct direntry *dirent, uint32_t size,
+		    uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
+    uint32_t keep = (size + clust_size - 1) / clust_size;
+    uint32_t n = 0, max = get_cluster_count(bpb);
+    uint16_t cluster, next, last = 0;
+
+    cluster = getushort(dirent->deStartCluster);
+    while (is_valid_cluster(cluster, bpb) && n < max)
+    {
+	next = get_fat_entry(cluster, image_buf, bpb);
+	if (n < keep)
+	    last = cluster;
+	else
+	    set_fat_entry(cluster, FAT12_MASK&CLUST_FREE, image_buf, bpb);
+	cluster = next;
+	n++;
+    }
+    if (last != 0)
+	set_fat_entry(last, FAT12_MASK&CLUST_EOFS, image_buf, bpb);
+    else
+	putushort(dirent->deStartCluster, 0);
+}
+
+/* update_file writes the contents of fd into an existing file, from
+   offset on, in place: clusters of the chain are reused, new ones are
+   added after its tail, and clusters past the new end are freed.
+   With skip_same, a cluster that already holds the same data isn't
+   written at all.  offset must be within the file. */
+void update_file(FILE *fd, struct direntry *dirent, uint32_t offset, 
+		 int skip_same, uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
+    uint32_t within, written = 0, skipped = 0;
+    uint16_t cluster = 0;
+    uint8_t *buf, *p;
+    size_t bytes;
+
+    buf = malloc(clust_size);
 
-	if (dirent->deName[0] == SLOT_DELETED) 
+    /* find the cluster that offset falls in */
+    for (within = offset; within >= clust_size; within -= clust_size)
+	cluster = next_in_chain(dirent, cluster, image_buf, bpb);
+
+    while (1)
+    {
+	bytes = fread(buf, 1, clust_size - within, fd);
+	if (bytes == 0)
+	    break;
+
+	cluster = next_in_chain(dirent, cluster, image_buf, bpb);
+	p = cluster_to_addr(cluster, image_buf, bpb) + within;
+	if (skip_same && memcmp(p, buf, bytes) == 0)
+	{
+	    skipped++;
+	}
+	else
 	{
-	    /* we found a deleted entry - we can just overwrite it */
-	    write_dirent(dirent, filename, start_cluster, size);
-	    return;
+	    memcpy(p, buf, bytes);
+	    /* keep the slack after the end of the file clean */
+	    if (within + bytes < clust_size)
+		memset(p + bytes, 0, clust_size - within - bytes);
+	    STAT_ADD(bytes_copied, bytes);
+	    written++;
 	}
-	dirent++;
+	offset += bytes;
+	if (within + bytes < clust_size)
+	    break;
+	within = 0;
     }
+
+    truncate_chain(dirent, offset, image_buf, bpb);
+    putulong(dirent->deFileSize, offset);
+    dos_debug(1, "%u clusters written, %u unchanged\n", written, skipped);
+    free(buf);
 }
 
 /* copyin copies a file from a regular file on the filesystem into a
    file in the FAT-12 memory disk image  */
 
-void copyin(char *infilename, char* outfilename,
+void copyin(char *infilename, char* outfilename, int mode, int skip_same,
 	    uint8_t *image_buf, struct bpb33* bpb)
 {
     struct direntry *dirent = (void*)1;
+    struct dir_index *dir;
+    int cluster;
     FILE *fd;
     uint16_t start_cluster;
     uint32_t size = 0;
@@ -458,23 +762,16 @@ void copyin(char *infilename, char* outfilename,
     assert(strncmp("a:", outfilename, 2)==0);
     outfilename+=2;
 
-    /* check that the file doesn't already exist */
+    /* check whether the file already exists */
     dirent = find_file(outfilename, 0, FIND_FILE, image_buf, bpb);
-    if (dirent != NULL) 
+    if (dirent != NULL && mode == COPY_NEW) 
     {
 	fprintf(stderr, "File %s already exists\n", outfilename);
 	exit(1);
     }
 
-    /* find the dirent of the directory to put the file in */
-    dirent = find_file(outfilename, 0, FIND_DIR, image_buf, bpb);
-    if (dirent == NULL) 
-    {
-	fprintf(stderr, "Directory does not exists in the disk image\n");
-	exit(1);
-    }
-
     /* open the real file for reading */
+    STAT_INC(syscalls);
     fd = fopen(infilename, "r");
     if (fd == NULL) 
     {
@@ -483,21 +780,385 @@ void copyin(char *infilename, char* outfilename,
 	exit(1);
     }
 
+    if (dirent != NULL)
+    {
+	/* append or overwrite, reusing the file's chain */
+	size = getulong(dirent->deFileSize);
+	update_file(fd, dirent, mode == COPY_APPEND ? size : 0, 
+		    skip_same, image_buf, bpb);
+	fclose(fd);
+	return;
+    }
+
+    /* find the directory to put the file in, and a slot in it,
+       before anything is written */
+    cluster = dir_cluster(outfilename, image_buf, bpb);
+    if (cluster < 0) 
+    {
+	fprintf(stderr, "Directory does not exists in the disk image\n");
+	exit(1);
+    }
+    dir = dir_index_build(cluster, image_buf, bpb);
+    dirent = dir_index_slot(dir);
+    dir_index_free(dir);
+    if (dirent == NULL) 
+    {
+	fprintf(stderr, "No room in the directory for %s\n", outfilename);
+	exit(1);
+    }
+
     /* do the actual copy in*/
     start_cluster = copy_in_file(fd, image_buf, bpb, &size);
 
     /* create the directory entry */
-    create_dirent(dirent, outfilename, start_cluster, size, image_buf, bpb);
+    write_dirent(dirent, outfilename, start_cluster, size);
     
     fclose(fd);
 }
 
+/* Bulk copy-in from a manifest.  Everything is checked and planned
+   before the image is touched: each file's clusters are allocated in
+   a private copy of the FAT, the data is streamed into those clusters
+   (which the image still records as free), and only then are the FAT
+   and the new directory entries written back, in one go.  If anything
+   fails before that, the image's FAT and directories are unchanged. */
+
+struct bulk_file 
+{
+    char *host;
+    char *path;			/* in the image, without the "a:" */
+    uint8_t name[11];		/* its 8.3 name, from dos_name */
+    int dir;			/* index into the bulk_dir array */
+    uint32_t size;
+    uint16_t start_cluster;
+};
+
+struct bulk_dir 
+{
+    uint16_t cluster;
+    struct dir_index *index;
+    uint32_t nfiles;
+};
+
+/* a name in a directory, new or already there, for spotting clashes */
+struct bulk_name 
+{
+    uint16_t cluster;
+    char name[11];
+    int file;			/* index of the new file, or -1 */
+};
+
+static int name_cmp(const void *a, const void *b)
+{
+    const struct bulk_name *na = a, *nb = b;
+
+    if (na->cluster != nb->cluster)
+	return na->cluster < nb->cluster ? -1 : 1;
+    return memcmp(na->name, nb->name, sizeof(na->name));
+}
+
+struct name_list 
+{
+    struct bulk_name *names;
+    int count, alloc;
+    uint16_t cluster;
+};
+
+static void add_name(struct name_list *list, uint16_t cluster, 
+		     const uint8_t *name, int file)
+{
+    if (list->count == list->alloc) 
+    {
+	list->alloc = list->alloc ? list->alloc * 2 : 256;
+	list->names = realloc(list->names, list->alloc * sizeof(struct bulk_name));
+	if (list->names == NULL) 
+	{
+	    fprintf(stderr, "Out of memory\n");
+	    exit(1);
+	}
+    }
+    list->names[list->count].cluster = cluster;
+    memcpy(list->names[list->count].name, name, 11);
+    list->names[list->count].file = file;
+    list->count++;
+}
+
+static int add_existing(struct direntry *dirent, void *arg)
+{
+    struct name_list *list = arg;
+
+    if (!is_dot_dirent(dirent) && (dirent->deAttributes & ATTR_VOLUME) == 0)
+	add_name(list, list->cluster, dirent->deName, -1);
+    return 0;
+}
+
+/* read_manifest reads "hostfile imagefile" pairs, one per line;
+   blank lines and lines starting with # are skipped */
+struct bulk_file *read_manifest(char *manifest, int *nfiles)
+{
+    struct bulk_file *files = NULL;
+    int count = 0, alloc = 0, lineno = 0;
+    char line[2 * MAXPATHLEN + 8];
+    char host[MAXPATHLEN + 1], path[MAXPATHLEN + 1];
+    FILE *mf;
+
+    STAT_INC(syscalls);
+    mf = fopen(manifest, "r");
+    if (mf == NULL) 
+    {
+	fprintf(stderr, "Can't open manifest %s\n", manifest);
+	exit(1);
+    }
+    while (fgets(line, sizeof(line), mf) != NULL) 
+    {
+	lineno++;
+	if (sscanf(line, "%255s", host) != 1 || host[0] == '#')
+	    continue;
+	if (sscanf(line, "%255s %255s", host, path) != 2) 
+	{
+	    fprintf(stderr, "%s:%d: expected a host file and an image file\n",
+		    manifest, lineno);
+	    exit(1);
+	}
+	if (count == alloc) 
+	{
+	    alloc = alloc ? alloc * 2 : 64;
+	    files = realloc(files, alloc * sizeof(struct bulk_file));
+	    if (files == NULL) 
+	    {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	    }
+	}
+	memset(&files[count], 0, sizeof(struct bulk_file));
+	files[count].host = strdup(host);
+	files[count].path = strdup(strncmp(path, "a:", 2) == 0 ? path + 2 : path);
+	count++;
+    }
+    fclose(mf);
+    *nfiles = count;
+    return files;
+}
+
+/* bulk_stream allocates a file's clusters in the private FAT, next
+   fit from *cursor, and reads the host file straight into them */
+void bulk_stream(struct bulk_file *file, uint8_t *fat_buf, uint16_t *cursor,
+		 uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
+    uint32_t nclust = (file->size + clust_size - 1) / clust_size;
+    uint16_t maxclust = get_cluster_count(bpb);
+    uint16_t cluster, prev = 0, next;
+    uint32_t i, run, want, done = 0;
+    uint8_t *p;
+    ssize_t n;
+    int fd;
+
+    for (i = 0; i < nclust; i++) 
+    {
+	/* there is room: bulk_copyin counted the free clusters */
+	while (get_fat_entry(*cursor, fat_buf, bpb) != CLUST_FREE)
+	    if (++*cursor == maxclust)
+		*cursor = CLUST_FIRST;
+	cluster = *cursor;
+	set_fat_entry(cluster, FAT12_MASK&CLUST_EOFS, fat_buf, bpb);
+	if (prev == 0)
+	    file->start_cluster = cluster;
+	else
+	    set_fat_entry(prev, cluster, fat_buf, bpb);
+	prev = cluster;
+    }
+    if (nclust == 0)
+	return;
+
+    STAT_INC(syscalls);
+    fd = open(file->host, O_RDONLY);
+    if (fd < 0) 
+    {
+	fprintf(stderr, "Can't open file %s to copy data in: %s\n",
+		file->host, strerror(errno));
+	exit(1);
+    }
+    /* one read per run of contiguous clusters */
+    for (cluster = file->start_cluster; done < file->size; cluster = next) 
+    {
+	run = get_extent(cluster, nclust, &next, fat_buf, bpb);
+	p = cluster_to_addr(cluster, image_buf, bpb);
+	want = run * clust_size;
+	if (want > file->size - done)
+	    want = file->size - done;
+	for (i = 0; i < want; i += n) 
+	{
+	    STAT_INC(syscalls);
+	    n = read(fd, p + i, want - i);
+	    if (n <= 0) 
+	    {
+		fprintf(stderr, "%s is shorter than it was (%u bytes); nothing copied\n",
+			file->host, file->size);
+		exit(1);
+	    }
+	}
+	/* keep the slack after the end of the file clean */
+	if (want < run * clust_size)
+	    memset(p + want, 0, run * clust_size - want);
+	STAT_ADD(bytes_copied, want);
+	done += want;
+    }
+    close(fd);
+    STAT_INC(syscalls);
+}
+
+void bulk_copyin(char *manifest, uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct bulk_file *files;
+    struct bulk_dir *dirs;
+    struct name_list names;
+    struct direntry *dirent;
+    struct stat st;
+    uint32_t clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
+    uint32_t fat_offset = bpb->bpbResSectors * bpb->bpbBytesPerSec;
+    uint32_t fat_bytes = bpb->bpbFATsecs * bpb->bpbBytesPerSec;
+    uint32_t need = 0, nfree = 0, room, total;
+    uint16_t maxclust = get_cluster_count(bpb), c, cursor = CLUST_FIRST;
+    uint8_t *fat_buf;
+    int nfiles, ndirs = 0, i, j, cluster;
+
+    files = read_manifest(manifest, &nfiles);
+    dirs = malloc((nfiles + 1) * sizeof(struct bulk_dir));
+    memset(&names, 0, sizeof(names));
+
+    /* check every file, and where it's going */
+    for (i = 0; i < nfiles; i++) 
+    {
+	STAT_INC(syscalls);
+	if (stat(files[i].host, &st) < 0 || !S_ISREG(st.st_mode)) 
+	{
+	    fprintf(stderr, "Can't copy in %s\n", files[i].host);
+	    exit(1);
+	}
+	if (st.st_size > UINT32_MAX) 
+	{
+	    fprintf(stderr, "%s is too big\n", files[i].host);
+	    exit(1);
+	}
+	files[i].size = st.st_size;
+	need += (files[i].size + clust_size - 1) / clust_size;
+
+	cluster = dir_cluster(files[i].path, image_buf, bpb);
+	if (cluster < 0) 
+	{
+	    fprintf(stderr, "Directory for %s does not exist in the disk image\n",
+		    files[i].path);
+	    exit(1);
+	}
+	for (j = 0; j < ndirs && dirs[j].cluster != cluster; j++)
+	    ;
+	if (j == ndirs) 
+	{
+	    dirs[j].cluster = cluster;
+	    dirs[j].index = dir_index_build(cluster, image_buf, bpb);
+	    dirs[j].nfiles = 0;
+	    names.cluster = cluster;
+	    for_each_dirent(cluster, image_buf, bpb, add_existing, &names);
+	    ndirs++;
+	}
+	files[i].dir = j;
+	dirs[j].nfiles++;
+
+	if (!dos_name(files[i].path, files[i].name))
+	    fprintf(stderr, "No filename extension given for %s - defaulting to .___\n",
+		    files[i].path);
+	add_name(&names, cluster, files[i].name, i);
+    }
+
+    /* no name may clash with one already there, or another new one */
+    qsort(names.names, names.count, sizeof(struct bulk_name), name_cmp);
+    for (i = 1; i < names.count; i++) 
+    {
+	if (name_cmp(&names.names[i - 1], &names.names[i]) != 0)
+	    continue;
+	j = names.names[i].file >= 0 ? names.names[i].file : names.names[i - 1].file;
+	fprintf(stderr, "File %s %s\n", files[j].path,
+		names.names[i - 1].file >= 0 && names.names[i].file >= 0 
+		? "is in the manifest twice" : "already exists");
+	exit(1);
+    }
+
+    /* full subdirectories will need new clusters; the root can't grow */
+    for (j = 0; j < ndirs; j++) 
+    {
+	total = dirs[j].index->nclusters * dirs[j].index->per_cluster;
+	room = dirs[j].index->ndeleted + total - dirs[j].index->end;
+	if (dirs[j].nfiles <= room)
+	    continue;
+	if (dirs[j].cluster == MSDOSFSROOT || dirs[j].index->nclusters == 0) 
+	{
+	    fprintf(stderr, "No room in the directory for %u more files\n",
+		    dirs[j].nfiles);
+	    exit(1);
+	}
+	need += (dirs[j].nfiles - room + dirs[j].index->per_cluster - 1) 
+	    / dirs[j].index->per_cluster;
+    }
+    for (c = CLUST_FIRST; c < maxclust; c++)
+	if (get_fat_entry(c, image_buf, bpb) == CLUST_FREE)
+	    nfree++;
+    if (need > nfree) 
+    {
+	fprintf(stderr, "No more space in filesystem: %u clusters needed, %u free\n",
+		need, nfree);
+	exit(1);
+    }
+
+    /* stream the data in, planning the FAT on the side */
+    fat_buf = malloc(fat_offset + fat_bytes);
+    if (fat_buf == NULL) 
+    {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+    memcpy(fat_buf, image_buf, fat_offset + fat_bytes);
+    for (i = 0; i < nfiles; i++)
+	bulk_stream(&files[i], fat_buf, &cursor, image_buf, bpb);
+
+    /* commit: the FAT, then the directory entries (which may take
+       clusters of their own), then the other copies of the FAT */
+    memcpy(image_buf + fat_offset, fat_buf + fat_offset, fat_bytes);
+    for (i = 0; i < nfiles; i++) 
+    {
+	dirent = dir_index_slot(dirs[files[i].dir].index);
+	assert(dirent != NULL);
+	set_dirent(dirent, files[i].name, files[i].start_cluster, files[i].size);
+    }
+    for (i = 1; i < bpb->bpbFATs; i++)
+	memcpy(image_buf + fat_offset + i * fat_bytes, image_buf + fat_offset, fat_bytes);
+
+    for (j = 0; j < ndirs; j++)
+	dir_index_free(dirs[j].index);
+    for (i = 0; i < nfiles; i++) 
+    {
+	free(files[i].host);
+	free(files[i].path);
+    }
+    free(files);
+    free(dirs);
+    free(names.names);
+    free(fat_buf);
+}
+
 void usage(char *progname)
 {
-    fprintf(stderr, "usage: %s <imagename> a:<filename1> <filename2>\n", progname);
+    fprintf(stderr, "usage: %s [--stats] <imagename> a:<filename1> <filename2>\n", progname);
     fprintf(stderr, "\tcopies file called filename1 from disk image to a normal file\n");
-    fprintf(stderr, "usage: %s <imagename> <filename3> a:<filename4>\n", progname);
+    fprintf(stderr, "usage: %s [--overlay delta [--layer delta]...] [-a|-o [-s]] <imagename> <filename3> a:<filename4>\n", progname);
     fprintf(stderr, "\tcopies normal file called filename3 into disk image as filename4\n");
+    fprintf(stderr, "\t-a appends to filename4 if it exists, -o overwrites it in place;\n");
+    fprintf(stderr, "\t-s with -o skips clusters that are already the same\n");
+    fprintf(stderr, "usage: %s [--overlay delta [--layer delta]...] -m <manifest> <imagename>\n", progname);
+    fprintf(stderr, "\tcopies in every \"hostfile a:imagefile\" pair listed in manifest,\n");
+    fprintf(stderr, "\tall or nothing\n");
+    fprintf(stderr, "usage: %s -r [-j threads] <imagename> a:<dirname> <hostdir>\n", progname);
+    fprintf(stderr, "\tcopies a directory (a: for the whole disk) out of the disk image\n");
     exit(1);
 }
 
@@ -506,16 +1167,93 @@ int main(int argc, char** argv)
     int fd;
     uint8_t *image_buf;
     struct bpb33* bpb;
-    if (argc < 4 || argc > 4) 
+    char *progname = argv[0];
+    int recursive = 0;
+    int mode = COPY_NEW, skip_same = 0;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    char *manifest = NULL;
+    int opt;
+
+    stats_option(&argc, argv);
+    overlay_option(&argc, argv);
+
+    while ((opt = getopt(argc, argv, "rj:aosm:")) != -1) 
     {
-	usage(argv[0]);
+	switch (opt) 
+	{
+	case 'r':
+	    recursive = 1;
+	    break;
+	case 'j':
+	    nthreads = atoi(optarg);
+	    break;
+	case 'a':
+	    if (mode == COPY_OVERWRITE)
+		usage(progname);
+	    mode = COPY_APPEND;
+	    break;
+	case 'o':
+	    if (mode == COPY_APPEND)
+		usage(progname);
+	    mode = COPY_OVERWRITE;
+	    break;
+	case 's':
+	    skip_same = 1;
+	    break;
+	case 'm':
+	    manifest = optarg;
+	    break;
+	default:
+	    usage(progname);
+	}
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    /* -a, -o and -s are only for copying one file in, and -s only
+       makes sense when overwriting */
+    if ((mode != COPY_NEW || skip_same) && (manifest != NULL || recursive))
+	usage(progname);
+    if (skip_same && mode != COPY_OVERWRITE)
+	usage(progname);
+
+    if (manifest != NULL) 
+    {
+	if (argc != 2)
+	    usage(progname);
+	image_buf = mmap_file(argv[1], &fd);
+	bpb = check_bootsector(image_buf);
+	bulk_copyin(manifest, image_buf, bpb);
+	unmmap_file(image_buf, &fd);
+	return 0;
     }
 
-    image_buf = mmap_file(argv[1], &fd);
+    if (argc < 4 || argc > 4) 
+    {
+	usage(progname);
+    }
+    if (mode != COPY_NEW && strncmp("a:", argv[2], 2) == 0)
+	usage(progname);
+
+    /* copying out only reads the image */
+    if (recursive || strncmp("a:", argv[2], 2) == 0)
+	image_buf = mmap_file_readonly(argv[1], &fd);
+    else
+	image_buf = mmap_file(argv[1], &fd);
     bpb = check_bootsector(image_buf);
 
     /* use the "a:" bit to determine whether we're copying in or out */
-    if (strncmp("a:", argv[2], 2)==0) 
+    if (recursive) 
+    {
+	if (strncmp("a:", argv[2], 2) != 0)
+	    usage(progname);
+	if (copyout_tree(argv[2], argv[3], nthreads, image_buf, bpb) != 0) 
+	{
+	    unmmap_file(image_buf, &fd);
+	    return 1;
+	}
+    }
+    else if (strncmp("a:", argv[2], 2)==0) 
     {
 	/* copy from FAT-12 disk image to external filesystem */
 	copyout(argv[2], argv[3], image_buf, bpb);
@@ -523,11 +1261,11 @@ int main(int argc, char** argv)
     else if (strncmp("a:", argv[3], 2)==0) 
     {
 	/* copy from external filesystem to FAT-12 disk image */
-	copyin(argv[2], argv[3], image_buf, bpb);
+	copyin(argv[2], argv[3], mode, skip_same, image_buf, bpb);
     } 
     else 
     {
-	usage(argv[0]);
+	usage(progname);
     }
 
     unmmap_file(image_buf, &fd);
@@ -0,0 +1,445 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "overlay.h"
+#include "stats.h"
+
+
+/* dos_defrag rearranges the data area of an (unmounted) disk image
+   so that every file and directory is one contiguous run of
+   clusters.  Files and directories that are already contiguous stay
+   where they are, and each fragmented one is moved to the first gap
+   that holds it, counting its own clusters and those of the other
+   fragmented ones as gaps.  Only when some fragmented file doesn't
+   fit anywhere is the whole data area packed from the front, in the
+   order the tree is walked.
+
+   Clusters are relocated one at a time, straight to their final
+   position.  Clusters that are already in the right place are not
+   touched, and only a cycle of clusters that need each other's
+   places needs the one cluster bounce buffer.  The FAT and the start
+   clusters in the directory entries are rewritten afterwards. */
+
+/* a file or directory, and the chain of clusters it owns */
+struct object
+{
+    struct direntry *dirent;	/* NULL for the root directory */
+    char path[MAXPATHLEN+1];
+    int is_dir;
+    uint16_t *chain;
+    uint16_t nclusters;
+    uint16_t extents;
+};
+
+struct defrag
+{
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+    uint16_t maxclust;		/* from get_cluster_count */
+    uint16_t *owner;		/* object index + 1 per cluster, 0 if none */
+    struct object *objects;
+    int nobjects;
+    int alloc;
+    int errors;
+};
+
+/* add_object records the chain starting at cluster.  Returns the
+   object's index, or -1 if the chain is damaged. */
+int add_object(struct defrag *df, struct direntry *dirent, const char *path,
+	       int is_dir, uint16_t cluster)
+{
+    struct object *obj;
+    uint16_t count = 0;
+    uint16_t prev = 0;
+    int index;
+
+    if (df->nobjects == df->alloc)
+    {
+	df->alloc = df->alloc ? df->alloc * 2 : 64;
+	df->objects = realloc(df->objects, df->alloc * sizeof(struct object));
+    }
+    index = df->nobjects++;
+    obj = &df->objects[index];
+    memset(obj, 0, sizeof(*obj));
+    obj->dirent = dirent;
+    obj->is_dir = is_dir;
+    strncpy(obj->path, path, MAXPATHLEN);
+    obj->chain = malloc(df->maxclust * sizeof(uint16_t));
+
+    while (is_valid_cluster(cluster, df->bpb) && cluster < df->maxclust)
+    {
+	if (df->owner[cluster] != 0)
+	{
+	    fprintf(stderr, "%s is cross-linked at cluster %d; "
+		    "run scandisk first\n", path, cluster);
+	    df->errors++;
+	    return -1;
+	}
+	df->owner[cluster] = index + 1;
+	obj->chain[count++] = cluster;
+	if (count == 1 || cluster != prev + 1)
+	    obj->extents++;
+	prev = cluster;
+	cluster = get_fat_entry(cluster, df->image_buf, df->bpb);
+    }
+    if (cluster != 0 && !is_end_of_file(cluster))
+    {
+	fprintf(stderr, "%s has a bad cluster chain; run scandisk first\n", path);
+	df->errors++;
+	return -1;
+    }
+
+    obj->nclusters = count;
+    obj->chain = realloc(obj->chain, (count ? count : 1) * sizeof(uint16_t));
+    return index;
+}
+
+
+/* collect_dirent records every file and directory in the tree.  A
+   directory with a damaged chain isn't looked into. */
+int collect_dirent(struct direntry *dirent, const char *path, int depth,
+		   void *arg)
+{
+    struct defrag *df = arg;
+
+    return add_object(df, dirent, path,
+		      (dirent->deAttributes & ATTR_DIRECTORY) != 0,
+		      getushort(dirent->deStartCluster)) < 0;
+}
+
+
+/* move_cluster copies one cluster's worth of data */
+void move_cluster(struct defrag *df, uint16_t from, uint16_t to)
+{
+    uint32_t clust_size = df->bpb->bpbBytesPerSec * df->bpb->bpbSecPerClust;
+
+    memcpy(cluster_to_addr(to, df->image_buf, df->bpb),
+	   cluster_to_addr(from, df->image_buf, df->bpb), clust_size);
+    STAT_ADD(bytes_copied, clust_size);
+}
+
+
+/* relocate moves every cluster c to newpos[c].  oldat is the inverse
+   mapping.  Returns the number of cluster copies made. */
+uint32_t relocate(struct defrag *df, uint16_t *newpos, uint16_t *oldat)
+{
+    uint32_t clust_size = df->bpb->bpbBytesPerSec * df->bpb->bpbSecPerClust;
+    uint8_t *bounce = malloc(clust_size);
+    uint8_t *moved = calloc(df->maxclust, 1);
+    uint32_t copies = 0;
+    uint16_t c, t, src;
+
+    /* First the chains of moves that end in a cluster nobody is
+       using: fill the free cluster, which frees up the source, which
+       can then be filled in turn. */
+    for (c = CLUST_FIRST; c < df->maxclust; c++)
+    {
+	if (newpos[c] != 0 || oldat[c] == 0)
+	    continue;
+	for (t = c; oldat[t] != 0 && !moved[oldat[t]] && oldat[t] != t; t = src)
+	{
+	    src = oldat[t];
+	    move_cluster(df, src, t);
+	    moved[src] = 1;
+	    copies++;
+	}
+    }
+
+    /* Anything left over is a cycle, which we break by parking one
+       cluster in the bounce buffer. */
+    for (c = CLUST_FIRST; c < df->maxclust; c++)
+    {
+	if (newpos[c] == 0 || newpos[c] == c || moved[c])
+	    continue;
+	memcpy(bounce, cluster_to_addr(c, df->image_buf, df->bpb), clust_size);
+	STAT_ADD(bytes_copied, clust_size);
+	copies++;
+	for (t = c; oldat[t] != c; t = src)
+	{
+	    src = oldat[t];
+	    move_cluster(df, src, t);
+	    moved[src] = 1;
+	    copies++;
+	}
+	memcpy(cluster_to_addr(t, df->image_buf, df->bpb), bounce, clust_size);
+	STAT_ADD(bytes_copied, clust_size);
+	moved[c] = 1;
+    }
+
+    free(moved);
+    free(bounce);
+    return copies;
+}
+
+
+/* place_fragments picks new places for the fragmented objects only,
+   leaving everything else where it is.  Returns the number of
+   clusters to move, or -1 if some object doesn't fit in any gap. */
+int place_fragments(struct defrag *df, uint16_t *newpos, uint16_t *oldat)
+{
+    uint8_t *avail = calloc(df->maxclust, 1);
+    struct object *obj;
+    uint16_t c, start, len;
+    int32_t misplaced = 0;
+    int i, j;
+
+    for (c = CLUST_FIRST; c < df->maxclust; c++)
+	if (df->owner[c] != 0)
+	    avail[c] = df->objects[df->owner[c] - 1].extents > 1;
+	else
+	    avail[c] = get_fat_entry(c, df->image_buf, df->bpb) == CLUST_FREE;
+
+    for (i = 0; i < df->nobjects; i++)
+    {
+	obj = &df->objects[i];
+	if (obj->extents <= 1)
+	{
+	    for (j = 0; j < obj->nclusters; j++)
+		newpos[obj->chain[j]] = oldat[obj->chain[j]] = obj->chain[j];
+	    continue;
+	}
+
+	/* first fit */
+	for (c = CLUST_FIRST, start = c, len = 0;
+	     c < df->maxclust && len < obj->nclusters; c++)
+	{
+	    if (!avail[c])
+		len = 0;
+	    else if (len++ == 0)
+		start = c;
+	}
+	if (len < obj->nclusters)
+	{
+	    free(avail);
+	    return -1;
+	}
+	for (j = 0; j < obj->nclusters; j++)
+	{
+	    c = start + j;
+	    avail[c] = 0;
+	    newpos[obj->chain[j]] = c;
+	    oldat[c] = obj->chain[j];
+	    if (obj->chain[j] != c)
+		misplaced++;
+	}
+    }
+    free(avail);
+    return misplaced;
+}
+
+/* pack_objects lays every object out from the front of the data area
+   in walk order.  Clusters that are in use but not part of any file
+   (orphans, bad clusters) stay where they are, and the layout flows
+   around them.  Returns the number of clusters to move. */
+uint32_t pack_objects(struct defrag *df, uint16_t *newpos, uint16_t *oldat)
+{
+    struct object *obj;
+    uint16_t next = CLUST_FIRST;
+    uint32_t misplaced = 0;
+    int i, j;
+
+    for (i = 0; i < df->nobjects; i++)
+    {
+	obj = &df->objects[i];
+	for (j = 0; j < obj->nclusters; j++)
+	{
+	    while (df->owner[next] == 0
+		   && get_fat_entry(next, df->image_buf, df->bpb) != CLUST_FREE)
+		next++;
+	    newpos[obj->chain[j]] = next;
+	    oldat[next] = obj->chain[j];
+	    if (obj->chain[j] != next)
+		misplaced++;
+	    next++;
+	}
+    }
+    return misplaced;
+}
+
+
+struct remap
+{
+    struct defrag *df;
+    uint16_t *newpos;
+};
+
+/* remap_dirent points a directory entry at its relocated first
+   cluster.  The directory it's in has already been moved. */
+int remap_dirent(struct direntry *dirent, void *arg)
+{
+    struct remap *r = arg;
+    uint16_t start = getushort(dirent->deStartCluster);
+    struct remap sub;
+
+    if ((dirent->deAttributes & ATTR_VOLUME) != 0)
+	return 0;
+    if (start >= r->df->maxclust || r->newpos[start] == 0)
+	return 0;
+
+    start = r->newpos[start];
+    putushort(dirent->deStartCluster, start);
+
+    if ((dirent->deAttributes & ATTR_DIRECTORY) != 0 && !is_dot_dirent(dirent))
+    {
+	sub = *r;
+	for_each_dirent(start, r->df->image_buf, r->df->bpb, remap_dirent, &sub);
+    }
+    return 0;
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [--stats] [--overlay delta [--layer delta]...] [-n] [-v] <imagename>\n", progname);
+    fprintf(stderr, "\t-n only report fragmentation, don't change the image\n");
+    fprintf(stderr, "\t-v list each file and directory\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd;
+    struct bpb33* bpb;
+    struct defrag df;
+    struct object *obj;
+    struct remap r;
+    uint16_t *newpos, *oldat, *newfat;
+    uint16_t c, value;
+    uint32_t fat_bytes, misplaced, copies;
+    int32_t placed;
+    int dry_run = 0, verbose = 0;
+    int fragmented = 0, extents = 0;
+    int opt, i, j;
+
+    stats_option(&argc, argv);
+    overlay_option(&argc, argv);
+    while ((opt = getopt(argc, argv, "nv")) != -1)
+    {
+	switch (opt)
+	{
+	case 'n':
+	    dry_run = 1;
+	    break;
+	case 'v':
+	    verbose = 1;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (argc - optind != 1)
+	usage(argv[0]);
+
+    image_buf = mmap_file(argv[optind], &fd);
+    bpb = check_bootsector(image_buf);
+
+    memset(&df, 0, sizeof(df));
+    df.image_buf = image_buf;
+    df.bpb = bpb;
+    df.maxclust = get_cluster_count(bpb);
+    df.owner = calloc(df.maxclust, sizeof(uint16_t));
+    df.errors += walk_tree(MSDOSFSROOT, "", image_buf, bpb, collect_dirent, &df);
+
+    if (df.errors)
+    {
+	fprintf(stderr, "Image not changed\n");
+	exit(1);
+    }
+
+    /* the analysis */
+    for (i = 0; i < df.nobjects; i++)
+    {
+	obj = &df.objects[i];
+	extents += obj->extents;
+	if (obj->extents > 1)
+	    fragmented++;
+	if (verbose)
+	    printf("%s%s: %d clusters in %d extents\n", obj->path,
+		   obj->is_dir ? "/" : "", obj->nclusters, obj->extents);
+    }
+    printf("%d files and directories, %d fragmented, %d extents\n",
+	   df.nobjects, fragmented, extents);
+
+    if (fragmented == 0)
+    {
+	unmmap_file(image_buf, &fd);
+	return 0;
+    }
+
+    /* Work out where everything goes */
+    newpos = calloc(df.maxclust, sizeof(uint16_t));
+    oldat = calloc(df.maxclust, sizeof(uint16_t));
+    placed = place_fragments(&df, newpos, oldat);
+    if (placed >= 0)
+	misplaced = placed;
+    else
+    {
+	if (verbose)
+	    printf("no room to move the fragments alone, packing everything\n");
+	memset(newpos, 0, df.maxclust * sizeof(uint16_t));
+	memset(oldat, 0, df.maxclust * sizeof(uint16_t));
+	misplaced = pack_objects(&df, newpos, oldat);
+    }
+
+    printf("%u clusters to move\n", misplaced);
+    if (dry_run || misplaced == 0)
+    {
+	unmmap_file(image_buf, &fd);
+	return 0;
+    }
+
+    copies = relocate(&df, newpos, oldat);
+
+    /* Build the new FAT.  Everything we moved gets a straight chain;
+       everything else keeps its entry. */
+    newfat = malloc(df.maxclust * sizeof(uint16_t));
+    for (c = CLUST_FIRST; c < df.maxclust; c++)
+	newfat[c] = df.owner[c] ? CLUST_FREE : get_fat_entry(c, image_buf, bpb);
+    for (i = 0; i < df.nobjects; i++)
+    {
+	obj = &df.objects[i];
+	for (j = 0; j < obj->nclusters; j++)
+	{
+	    c = newpos[obj->chain[j]];
+	    if (j + 1 < obj->nclusters)
+		value = newpos[obj->chain[j + 1]];
+	    else
+		value = FAT12_MASK & CLUST_EOFS;
+	    newfat[c] = value;
+	}
+    }
+    for (c = CLUST_FIRST; c < df.maxclust; c++)
+	set_fat_entry(c, newfat[c], image_buf, bpb);
+
+    /* keep any other copies of the FAT in step */
+    fat_bytes = bpb->bpbFATsecs * bpb->bpbBytesPerSec;
+    for (i = 1; i < bpb->bpbFATs; i++)
+	memcpy(image_buf + bpb->bpbResSectors * bpb->bpbBytesPerSec
+	       + i * fat_bytes,
+	       image_buf + bpb->bpbResSectors * bpb->bpbBytesPerSec,
+	       fat_bytes);
+
+    /* and point the directory entries at the new locations */
+    r.df = &df;
+    r.newpos = newpos;
+    for_each_dirent(MSDOSFSROOT, image_buf, bpb, remap_dirent, &r);
+
+    printf("%u cluster copies made\n", copies);
+
+    unmmap_file(image_buf, &fd);
+    return 0;
+}
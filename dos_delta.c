@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "overlay.h"
+#include "stats.h"
+
+
+/* dos_delta works with the delta files that tools write when run with
+   --overlay (see overlay.h).  "apply" writes deltas into an image for
+   good, in the order given, so stacked deltas go lowest first; either
+   they all apply or the image is left alone.  "info" lists what a
+   delta changes. */
+
+
+static void apply(char *image_name, char **paths, int n, int force)
+{
+    struct delta **d = malloc(n * sizeof(struct delta *));
+    uint8_t *image_buf, *copy;
+    struct stat st;
+    int fd, i;
+
+    if (stat(image_name, &st) < 0)
+    {
+	fprintf(stderr, "Cannot read disk image file %s\n", image_name);
+	exit(1);
+    }
+    for (i = 0; i < n; i++)
+	d[i] = delta_read(paths[i]);
+
+    /* check every delta, on a copy, before changing anything */
+    image_buf = mmap_file(image_name, &fd);
+    copy = malloc(st.st_size);
+    memcpy(copy, image_buf, st.st_size);
+    for (i = 0; i < n; i++)
+    {
+	if ((uint64_t)d[i]->nsectors * DELTA_SECTOR != (uint64_t)st.st_size)
+	{
+	    fprintf(stderr, "Delta %s is for a different size of image\n", paths[i]);
+	    exit(1);
+	}
+	if (!force && !delta_matches(d[i], copy, st.st_size))
+	{
+	    fprintf(stderr, "Delta %s wasn't made from this image%s\n", paths[i],
+		    i > 0 ? " and the deltas before it" : "");
+	    exit(1);
+	}
+	delta_apply(d[i], copy);
+    }
+
+    for (i = 0; i < n; i++)
+    {
+	delta_apply(d[i], image_buf);
+	delta_free(d[i]);
+    }
+    free(copy);
+    free(d);
+    unmmap_file(image_buf, &fd);
+}
+
+static void info(char *path)
+{
+    struct delta *d = delta_read(path);
+    uint32_t i, sectors = 0;
+
+    for (i = 0; i < d->nruns; i++)
+    {
+	if (d->runs[i].count == 1)
+	    printf("sector %u\n", d->runs[i].first);
+	else
+	    printf("sectors %u-%u\n", d->runs[i].first,
+		   d->runs[i].first + d->runs[i].count - 1);
+	sectors += d->runs[i].count;
+    }
+    printf("%u of %u sectors (%u bytes) in %u runs, base hash %016llx\n",
+	   sectors, d->nsectors, sectors * d->sector_size, d->nruns,
+	   (unsigned long long)d->base_hash);
+    delta_free(d);
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [--stats] apply [-f] <imagename> <delta>...\n", progname);
+    fprintf(stderr, "\twrites the deltas into the image, lowest layer first;\n");
+    fprintf(stderr, "\t-f applies them even if they weren't made from this image\n");
+    fprintf(stderr, "usage: %s info <delta>\n", progname);
+    fprintf(stderr, "\tlists the sectors a delta changes\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    int force = 0, opt;
+
+    stats_option(&argc, argv);
+    if (argc < 2)
+	usage(argv[0]);
+
+    if (strcmp(argv[1], "info") == 0 && argc == 3)
+    {
+	info(argv[2]);
+	return 0;
+    }
+    if (strcmp(argv[1], "apply") != 0)
+	usage(argv[0]);
+
+    optind = 2;
+    while ((opt = getopt(argc, argv, "f")) != -1)
+    {
+	switch (opt)
+	{
+	case 'f':
+	    force = 1;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (argc - optind < 2)
+	usage(argv[0]);
+    apply(argv[optind], &argv[optind + 1], argc - optind - 1, force);
+    return 0;
+}
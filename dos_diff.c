@@ -0,0 +1,501 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "dos_file.h"
+#include "bitmap.h"
+#include "packed.h"
+#include "stats.h"
+
+
+/* dos_diff compares two images of the same geometry, such as before
+   and after snapshots of one disk, and prints one line per difference:
+
+	boot 0			reserved sectors that differ
+	fat 12-19 40		FAT entries that differ
+	fat2 3			sectors of a FAT copy that differ
+	root 0 5		root directory slots that differ
+	data 12-19		clusters whose contents differ
+	added /NEW.TXT 1234	in the second image only
+	removed /OLD.TXT 100	in the first image only
+	type /NAME		a file in one, a directory in the other
+	modified /F.DAT 512 700 attr clusters 0-1 3
+
+   Everything up to the data clusters is compared byte for byte.  The
+   FAT copies after the first are only listed where one of them isn't
+   a copy of the first FAT, since "fat" says what changed otherwise;
+   "fat slack" means only the unused end of the first FAT differs.
+   The data clusters are compared in place, skipping clusters that are
+   free in both FATs.  A modified file gives both sizes, "attr" if its
+   attributes changed, and the clusters of the file (counting from 0)
+   whose contents differ.
+
+   The exit status is 0 if the images are the same, 1 if they differ
+   and 2 on trouble, as for cmp.  With -q nothing is printed, and we
+   stop at the first difference. */
+
+struct node
+{
+    char *path;
+    struct direntry *dirent;
+};
+
+struct image
+{
+    char *name;
+    int fd;
+    off_t size;
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+    struct node *nodes;		/* every file and directory, sorted by path */
+    int nnodes, nalloc;
+};
+
+/* a list of numbers printed as ranges, "3-7 9" */
+struct ranges
+{
+    const char *label;		/* printed before the first range */
+    uint32_t first, last;
+    uint32_t count;
+};
+
+static int quiet = 0;
+static int ndiffs = 0;
+
+
+static void differ(void)
+{
+    ndiffs++;
+    if (quiet)
+	exit(1);
+}
+
+static void range_add(struct ranges *r, uint32_t n)
+{
+    if (r->count > 0 && n == r->last + 1)
+    {
+	r->last = n;
+	return;
+    }
+    if (r->count == 0)
+	printf("%s", r->label);
+    else if (r->first == r->last)
+	printf(" %u", r->first);
+    else
+	printf(" %u-%u", r->first, r->last);
+    r->first = r->last = n;
+    r->count++;
+}
+
+/* range_end prints the last range, and returns how many there were */
+static uint32_t range_end(struct ranges *r)
+{
+    if (r->count == 0)
+	return 0;
+    if (r->first == r->last)
+	printf(" %u", r->first);
+    else
+	printf(" %u-%u", r->first, r->last);
+    return r->count;
+}
+
+
+static void map_image(struct image *img, char *name)
+{
+    struct stat st;
+
+    memset(img, 0, sizeof(*img));
+    img->name = name;
+    if (packed_file(name))
+    {
+	size_t size;
+
+	img->image_buf = packed_map(name, &img->fd, &size);
+	img->size = size;
+	img->bpb = check_bootsector(img->image_buf);
+	return;
+    }
+    STAT_ADD(syscalls, 3);
+    img->fd = open(name, O_RDONLY);
+    if (img->fd < 0 || fstat(img->fd, &st) < 0)
+    {
+	fprintf(stderr, "Cannot read disk image file %s:\n%s\n", name, strerror(errno));
+	exit(2);
+    }
+    if (st.st_size < 512)
+    {
+	fprintf(stderr, "%s is too small to be a disk image\n", name);
+	exit(2);
+    }
+    /* read only, so snapshots can be compared without write access */
+    img->size = st.st_size;
+    img->image_buf = mmap(NULL, img->size, PROT_READ, MAP_SHARED, img->fd, 0);
+    if (img->image_buf == MAP_FAILED)
+    {
+	fprintf(stderr, "Failed to memory map %s: \n%s\n", name, strerror(errno));
+	exit(2);
+    }
+    img->bpb = check_bootsector(img->image_buf);
+}
+
+static void unmap_image(struct image *img)
+{
+    int i;
+
+    for (i = 0; i < img->nnodes; i++)
+	free(img->nodes[i].path);
+    free(img->nodes);
+    free(img->bpb);
+    if (!packed_unmap(img->image_buf))
+	munmap(img->image_buf, img->size);
+    close(img->fd);
+    STAT_ADD(syscalls, 2);
+}
+
+static int same_geometry(struct image *a, struct image *b)
+{
+    struct bpb33 *x = a->bpb, *y = b->bpb;
+
+    return a->size == b->size
+	&& x->bpbBytesPerSec == y->bpbBytesPerSec
+	&& x->bpbSecPerClust == y->bpbSecPerClust
+	&& x->bpbResSectors == y->bpbResSectors
+	&& x->bpbFATs == y->bpbFATs
+	&& x->bpbRootDirEnts == y->bpbRootDirEnts
+	&& x->bpbSectors == y->bpbSectors
+	&& x->bpbFATsecs == y->bpbFATsecs;
+}
+
+
+static void add_node(struct image *img, const char *path, struct direntry *dirent)
+{
+    if (img->nnodes == img->nalloc)
+    {
+	img->nalloc = img->nalloc ? img->nalloc * 2 : 256;
+	img->nodes = realloc(img->nodes, img->nalloc * sizeof(struct node));
+	if (img->nodes == NULL)
+	{
+	    fprintf(stderr, "Out of memory\n");
+	    exit(2);
+	}
+    }
+    img->nodes[img->nnodes].path = strdup(path);
+    img->nodes[img->nnodes].dirent = dirent;
+    img->nnodes++;
+}
+
+static int collect_dirent(struct direntry *dirent, const char *path, int depth, void *arg)
+{
+    (void)depth;
+    add_node(arg, path, dirent);
+    return 0;
+}
+
+static int node_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct node*)a)->path, ((const struct node*)b)->path);
+}
+
+
+/* diff_boot compares the reserved sectors, with the boot sector */
+static void diff_boot(struct image *a, struct image *b)
+{
+    uint32_t sec = a->bpb->bpbBytesPerSec;
+    struct ranges r = { "boot", 0, 0, 0 };
+    uint32_t s;
+
+    for (s = 0; s < a->bpb->bpbResSectors; s++)
+    {
+	if (memcmp(a->image_buf + s * sec, b->image_buf + s * sec, sec) == 0)
+	    continue;
+	differ();
+	range_add(&r, s);
+    }
+    if (range_end(&r))
+	printf("\n");
+}
+
+/* diff_fat compares the first FATs entry by entry */
+static void diff_fat(struct image *a, struct image *b, uint16_t maxclust)
+{
+    uint32_t offset = a->bpb->bpbResSectors * a->bpb->bpbBytesPerSec;
+    struct ranges r = { "fat", 0, 0, 0 };
+    uint16_t c;
+
+    if (memcmp(a->image_buf + offset, b->image_buf + offset,
+	       a->bpb->bpbFATsecs * a->bpb->bpbBytesPerSec) == 0)
+	return;
+    /* entries 0 and 1 hold the media descriptor */
+    for (c = 0; c < maxclust; c++)
+    {
+	if (get_fat_entry(c, a->image_buf, a->bpb)
+	    == get_fat_entry(c, b->image_buf, b->bpb))
+	    continue;
+	differ();
+	range_add(&r, c);
+    }
+    if (range_end(&r))
+	printf("\n");
+    else
+    {
+	differ();
+	printf("fat slack\n");
+    }
+}
+
+/* diff_copies compares the other FAT copies a sector at a time.  A
+   sector that is the same as the first FAT's in both images changed
+   along with it, and diff_fat has said how already. */
+static void diff_copies(struct image *a, struct image *b)
+{
+    uint32_t sec = a->bpb->bpbBytesPerSec;
+    uint32_t fat_size = a->bpb->bpbFATsecs * sec;
+    uint8_t *fat_a = a->image_buf + a->bpb->bpbResSectors * sec;
+    uint8_t *fat_b = b->image_buf + b->bpb->bpbResSectors * sec;
+    uint32_t n, s, at;
+    char label[16];
+
+    for (n = 1; n < a->bpb->bpbFATs; n++)
+    {
+	struct ranges r = { label, 0, 0, 0 };
+
+	snprintf(label, sizeof(label), "fat%u", n + 1);
+	for (s = 0; s < a->bpb->bpbFATsecs; s++)
+	{
+	    at = n * fat_size + s * sec;
+	    if (memcmp(fat_a + at, fat_b + at, sec) == 0)
+		continue;
+	    if (memcmp(fat_a + at, fat_a + s * sec, sec) == 0
+		&& memcmp(fat_b + at, fat_b + s * sec, sec) == 0)
+		continue;
+	    differ();
+	    range_add(&r, s);
+	}
+	if (range_end(&r))
+	    printf("\n");
+    }
+}
+
+/* diff_root compares the root directory a slot at a time, so changes
+   to the root's entries that the tree doesn't show (times, the volume
+   label, deleted slots) are still found */
+static void diff_root(struct image *a, struct image *b)
+{
+    struct direntry *da = (struct direntry*)cluster_to_addr(MSDOSFSROOT, a->image_buf, a->bpb);
+    struct direntry *db = (struct direntry*)cluster_to_addr(MSDOSFSROOT, b->image_buf, b->bpb);
+    struct ranges r = { "root", 0, 0, 0 };
+    uint32_t i;
+
+    if (memcmp(da, db, a->bpb->bpbRootDirEnts * sizeof(struct direntry)) == 0)
+	return;
+    for (i = 0; i < a->bpb->bpbRootDirEnts; i++)
+    {
+	if (memcmp(da + i, db + i, sizeof(struct direntry)) == 0)
+	    continue;
+	differ();
+	range_add(&r, i);
+    }
+    if (range_end(&r))
+	printf("\n");
+}
+
+/* diff_data compares every cluster that either image has in use, and
+   marks the ones that differ in changed */
+static void diff_data(struct image *a, struct image *b, uint16_t maxclust,
+		      struct bitmap *changed)
+{
+    uint32_t clust_size = a->bpb->bpbBytesPerSec * a->bpb->bpbSecPerClust;
+    struct ranges r = { "data", 0, 0, 0 };
+    uint16_t c;
+
+    for (c = CLUST_FIRST; c < maxclust; c++)
+    {
+	if (get_fat_entry(c, a->image_buf, a->bpb) == (FAT12_MASK & CLUST_FREE)
+	    && get_fat_entry(c, b->image_buf, b->bpb) == (FAT12_MASK & CLUST_FREE))
+	    continue;
+	if (memcmp(cluster_to_addr(c, a->image_buf, a->bpb),
+		   cluster_to_addr(c, b->image_buf, b->bpb), clust_size) == 0)
+	    continue;
+	bitmap_set(changed, c);
+	differ();
+	range_add(&r, c);
+    }
+    if (range_end(&r))
+	printf("\n");
+}
+
+/* diff_file compares two versions of a file a cluster at a time.  Only
+   the bytes both versions have are compared, so a cluster is listed
+   if those differ, or if just one version reaches it; the sizes
+   already say that the file grew or shrank.  Where both use the same
+   cluster, and diff_data found it unchanged, there is nothing more to
+   compare. */
+static void diff_file(const char *path, struct image *a, struct direntry *da,
+		      struct image *b, struct direntry *db, struct bitmap *changed)
+{
+    struct dos_file *fa = dos_open_dirent(da, a->image_buf, a->bpb);
+    struct dos_file *fb = dos_open_dirent(db, b->image_buf, b->bpb);
+    uint32_t clust_size = fa->clust_size;
+    uint32_t data = cluster_to_addr(CLUST_FIRST, a->image_buf, a->bpb) - a->image_buf;
+    uint32_t size = fa->size > fb->size ? fa->size : fb->size;
+    struct ranges r = { " clusters", 0, 0, 0 };
+    const uint8_t *pa, *pb;
+    uint32_t i, la, lb, n, at;
+    int attr = da->deAttributes != db->deAttributes;
+    int head = 0;
+
+    for (i = 0; i * clust_size < size; i++)
+    {
+	la = lb = clust_size;
+	pa = dos_map(fa, i * clust_size, &la);
+	pb = dos_map(fb, i * clust_size, &lb);
+	n = la < lb ? la : lb;
+	if (n > 0)
+	{
+	    at = pa - a->image_buf;
+	    if (at == (uint32_t)(pb - b->image_buf) && at >= data
+		&& get_fat_entry((at - data) / clust_size + CLUST_FIRST,
+				 a->image_buf, a->bpb) != (FAT12_MASK & CLUST_FREE)
+		&& !bitmap_test(changed, (at - data) / clust_size + CLUST_FIRST))
+		continue;
+	    if (memcmp(pa, pb, n) == 0)
+		continue;
+	}
+	else if (la == 0 && lb == 0)
+	    continue;
+
+	if (!head)
+	{
+	    differ();
+	    printf("modified %s %u %u%s", path, fa->size, fb->size, attr ? " attr" : "");
+	    head = 1;
+	}
+	range_add(&r, i);
+    }
+    if (!head && (attr || fa->size != fb->size))
+    {
+	differ();
+	printf("modified %s %u %u%s", path, fa->size, fb->size, attr ? " attr" : "");
+	head = 1;
+    }
+    range_end(&r);
+    if (head)
+	printf("\n");
+    dos_close(fa);
+    dos_close(fb);
+}
+
+static void print_node(const char *what, struct node *n)
+{
+    differ();
+    if ((n->dirent->deAttributes & ATTR_DIRECTORY) != 0)
+	printf("%s %s/\n", what, n->path);
+    else
+	printf("%s %s %u\n", what, n->path, getulong(n->dirent->deFileSize));
+}
+
+/* diff_trees merges the two sorted lists of paths */
+static void diff_trees(struct image *a, struct image *b, struct bitmap *changed)
+{
+    int i = 0, j = 0, cmp, dir_a, dir_b;
+
+    while (i < a->nnodes || j < b->nnodes)
+    {
+	if (i == a->nnodes)
+	    cmp = 1;
+	else if (j == b->nnodes)
+	    cmp = -1;
+	else
+	    cmp = strcmp(a->nodes[i].path, b->nodes[j].path);
+
+	if (cmp < 0)
+	    print_node("removed", &a->nodes[i++]);
+	else if (cmp > 0)
+	    print_node("added", &b->nodes[j++]);
+	else
+	{
+	    dir_a = (a->nodes[i].dirent->deAttributes & ATTR_DIRECTORY) != 0;
+	    dir_b = (b->nodes[j].dirent->deAttributes & ATTR_DIRECTORY) != 0;
+	    if (dir_a != dir_b)
+	    {
+		differ();
+		printf("type %s\n", a->nodes[i].path);
+	    }
+	    else if (!dir_a)
+		diff_file(a->nodes[i].path, a, a->nodes[i].dirent,
+			  b, b->nodes[j].dirent, changed);
+	    i++;
+	    j++;
+	}
+    }
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [--stats] [-q] <image1> <image2>\n", progname);
+    fprintf(stderr, "\tlists the differences between two images of the same geometry\n");
+    fprintf(stderr, "\t-q  print nothing; just set the exit status\n");
+    exit(2);
+}
+
+
+int main(int argc, char** argv)
+{
+    struct image a, b;
+    struct bitmap *changed;
+    uint16_t maxclust;
+    int opt;
+
+    stats_option(&argc, argv);
+    while ((opt = getopt(argc, argv, "q")) != -1)
+    {
+	switch (opt)
+	{
+	case 'q':
+	    quiet = 1;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (optind != argc - 2)
+	usage(argv[0]);
+
+    map_image(&a, argv[optind]);
+    map_image(&b, argv[optind + 1]);
+    if (!same_geometry(&a, &b))
+    {
+	fprintf(stderr, "%s and %s have different geometries\n", a.name, b.name);
+	exit(2);
+    }
+    maxclust = get_cluster_count(a.bpb);
+    changed = bitmap_create(maxclust);
+
+    diff_boot(&a, &b);
+    diff_fat(&a, &b, maxclust);
+    diff_copies(&a, &b);
+    diff_root(&a, &b);
+    diff_data(&a, &b, maxclust, changed);
+
+    walk_tree(MSDOSFSROOT, "", a.image_buf, a.bpb, collect_dirent, &a);
+    walk_tree(MSDOSFSROOT, "", b.image_buf, b.bpb, collect_dirent, &b);
+    qsort(a.nodes, a.nnodes, sizeof(struct node), node_cmp);
+    qsort(b.nodes, b.nnodes, sizeof(struct node), node_cmp);
+    diff_trees(&a, &b, changed);
+
+    bitmap_free(changed);
+    unmap_image(&a);
+    unmap_image(&b);
+    return ndiffs > 0;
+}
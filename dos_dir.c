@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "dos_dir.h"
+#include "stats.h"
+
+
+static void *grow(void *array, uint32_t *nalloc, size_t size)
+{
+    *nalloc = *nalloc ? *nalloc * 2 : 16;
+    array = realloc(array, *nalloc * size);
+    if (array == NULL)
+    {
+	fprintf(stderr, "Out of memory for directory index\n");
+	exit(1);
+    }
+    return array;
+}
+
+static void add_cluster(struct dir_index *dir, uint16_t cluster)
+{
+    if (dir->nclusters == dir->nalloc)
+	dir->clusters = grow(dir->clusters, &dir->nalloc, sizeof(uint16_t));
+    dir->clusters[dir->nclusters++] = cluster;
+}
+
+static struct direntry *slot_addr(struct dir_index *dir, uint32_t slot)
+{
+    return (struct direntry*)cluster_to_addr(dir->clusters[slot / dir->per_cluster],
+					     dir->image_buf, dir->bpb)
+	+ slot % dir->per_cluster;
+}
+
+
+/* dir_index_build reads the directory that starts at cluster */
+struct dir_index *dir_index_build(uint16_t cluster, uint8_t *image_buf,
+				  struct bpb33 *bpb)
+{
+    struct dir_index *dir = calloc(1, sizeof(struct dir_index));
+    struct direntry *dirent;
+    uint32_t i, j, total, tmp;
+    uint32_t max_hops = get_cluster_count(bpb);
+
+    if (dir == NULL)
+    {
+	fprintf(stderr, "Out of memory for directory index\n");
+	exit(1);
+    }
+    dir->image_buf = image_buf;
+    dir->bpb = bpb;
+    dir->cluster = cluster;
+
+    if (cluster == MSDOSFSROOT)
+    {
+	dir->per_cluster = bpb->bpbRootDirEnts;
+	add_cluster(dir, MSDOSFSROOT);
+    }
+    else
+    {
+	dir->per_cluster = bpb->bpbBytesPerSec * bpb->bpbSecPerClust
+	    / sizeof(struct direntry);
+	/* guard against a looped chain in a damaged image */
+	while (is_valid_cluster(cluster, bpb) && dir->nclusters < max_hops)
+	{
+	    add_cluster(dir, cluster);
+	    cluster = get_fat_entry(cluster, image_buf, bpb);
+	}
+    }
+
+    /* everything after the first empty slot is unused */
+    total = dir->nclusters * dir->per_cluster;
+    for (i = 0; i < total; i++)
+    {
+	dirent = slot_addr(dir, i);
+	STAT_INC(dirents_parsed);
+	if (dirent->deName[0] == SLOT_EMPTY)
+	    break;
+	if (dirent->deName[0] == SLOT_DELETED)
+	{
+	    if (dir->ndeleted == dir->ndelalloc)
+		dir->deleted = grow(dir->deleted, &dir->ndelalloc, sizeof(uint32_t));
+	    dir->deleted[dir->ndeleted++] = i;
+	}
+    }
+    dir->end = i;
+
+    /* hand out the earliest deleted slots first */
+    for (i = 0, j = dir->ndeleted; i + 1 < j; i++, j--)
+    {
+	tmp = dir->deleted[i];
+	dir->deleted[i] = dir->deleted[j - 1];
+	dir->deleted[j - 1] = tmp;
+    }
+    return dir;
+}
+
+/* dir_index_slot returns a free slot for a new entry, which the
+   caller must fill in; NULL if the directory can't hold any more */
+struct direntry *dir_index_slot(struct dir_index *dir)
+{
+    uint32_t total = dir->nclusters * dir->per_cluster;
+    uint16_t last, cluster;
+
+    if (dir->ndeleted > 0)
+	return slot_addr(dir, dir->deleted[--dir->ndeleted]);
+
+    if (dir->end == total)
+    {
+	/* the root directory can't grow, and a directory with no
+	   clusters at all is too damaged to add to */
+	if (dir->cluster == MSDOSFSROOT || dir->nclusters == 0)
+	    return NULL;
+	last = dir->clusters[dir->nclusters - 1];
+	cluster = alloc_free_cluster(last, dir->image_buf, dir->bpb);
+	if (cluster == 0)
+	    return NULL;
+	set_fat_entry(last, cluster, dir->image_buf, dir->bpb);
+	add_cluster(dir, cluster);
+	total += dir->per_cluster;
+    }
+
+    /* make sure the slot after the new entry ends the directory */
+    if (dir->end + 1 < total)
+	memset(slot_addr(dir, dir->end + 1), 0, sizeof(struct direntry));
+    return slot_addr(dir, dir->end++);
+}
+
+void dir_index_free(struct dir_index *dir)
+{
+    if (dir == NULL)
+	return;
+    free(dir->clusters);
+    free(dir->deleted);
+    free(dir);
+}
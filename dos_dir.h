@@ -0,0 +1,35 @@
+#ifndef __DOS_DIR_H__
+#define __DOS_DIR_H__
+
+/* A free-slot index for adding entries to a directory.
+
+   dir_index_build scans the directory once, noting its deleted slots
+   and where the used part ends.  dir_index_slot then hands out a
+   free slot without scanning again: a deleted one if there is one,
+   else the next one past the end.  A full subdirectory grows by a
+   new, zeroed cluster; the root directory is a fixed size, so when it
+   is full dir_index_slot returns NULL. */
+
+#include <stdint.h>
+
+struct direntry;
+struct bpb33;
+
+struct dir_index
+{
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+    uint16_t cluster;		/* first cluster, MSDOSFSROOT for the root */
+    uint32_t per_cluster;	/* slots in a cluster (all of them, for the root) */
+    uint16_t *clusters;		/* the directory's chain */
+    uint32_t nclusters, nalloc;
+    uint32_t *deleted;		/* deleted slots, used as a stack */
+    uint32_t ndeleted, ndelalloc;
+    uint32_t end;		/* the first slot past the used part */
+};
+
+struct dir_index *dir_index_build(uint16_t cluster, uint8_t *image_buf, struct bpb33 *bpb);
+struct direntry *dir_index_slot(struct dir_index *);
+void dir_index_free(struct dir_index *);
+
+#endif // __DOS_DIR_H__
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "dos_file.h"
+
+
+/* dos_open_dirent builds the extent map of the file dirent describes.
+   Only as much of the chain as the file's size needs is mapped; a
+   chain that is too short leaves mapped < size, and reads stop there. */
+struct dos_file *dos_open_dirent(struct direntry *dirent, uint8_t *image_buf,
+				 struct bpb33 *bpb)
+{
+    struct dos_file *f;
+    uint16_t cluster, count;
+    uint32_t nalloc = 8, seen = 0;
+    uint32_t maxclust = get_cluster_count(bpb);
+
+    if (dirent->deAttributes & ATTR_DIRECTORY)
+    {
+	errno = EISDIR;
+	return NULL;
+    }
+    f = calloc(1, sizeof(struct dos_file));
+    if (f != NULL)
+	f->extents = malloc(nalloc * sizeof(struct dos_extent));
+    if (f == NULL || f->extents == NULL)
+    {
+	fprintf(stderr, "Out of memory opening file\n");
+	exit(1);
+    }
+    f->image_buf = image_buf;
+    f->bpb = bpb;
+    f->size = getulong(dirent->deFileSize);
+    f->clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+
+    /* a looped chain is cut off at the size of the disk */
+    cluster = getushort(dirent->deStartCluster);
+    while (f->mapped < f->size && is_valid_cluster(cluster, bpb) && seen < maxclust)
+    {
+	if (f->nextents == nalloc)
+	{
+	    nalloc *= 2;
+	    f->extents = realloc(f->extents, nalloc * sizeof(struct dos_extent));
+	    if (f->extents == NULL)
+	    {
+		fprintf(stderr, "Out of memory opening file\n");
+		exit(1);
+	    }
+	}
+	f->extents[f->nextents].exOffset = f->mapped;
+	f->extents[f->nextents].exCluster = cluster;
+	count = get_extent(cluster, maxclust - seen, &cluster, image_buf, bpb);
+	f->extents[f->nextents].exCount = count;
+	f->nextents++;
+	seen += count;
+	f->mapped += count * f->clust_size;
+    }
+    if (f->mapped > f->size)
+	f->mapped = f->size;
+    return f;
+}
+
+/* dos_open opens a file by its path in the image; NULL, with errno
+   set, if there's no such file or it is a directory */
+struct dos_file *dos_open(const char *path, uint8_t *image_buf, struct bpb33 *bpb)
+{
+    struct direntry *dirent = find_path(path, image_buf, bpb);
+
+    if (dirent == NULL)
+    {
+	errno = ENOENT;
+	return NULL;
+    }
+    return dos_open_dirent(dirent, image_buf, bpb);
+}
+
+void dos_close(struct dos_file *f)
+{
+    if (f == NULL)
+	return;
+    free(f->extents);
+    free(f);
+}
+
+
+/* dos_map returns a pointer to the file's data at offset, straight
+   out of the image, and sets *len to how many bytes (no more than it
+   was on entry) are contiguous there.  NULL at or past the end. */
+const uint8_t *dos_map(struct dos_file *f, uint32_t offset, uint32_t *len)
+{
+    struct dos_extent *ex;
+    uint32_t lo = 0, hi = f->nextents, mid, within, avail;
+
+    if (offset >= f->mapped)
+    {
+	*len = 0;
+	return NULL;
+    }
+    /* the last extent starting at or before offset */
+    while (hi - lo > 1)
+    {
+	mid = (lo + hi) / 2;
+	if (f->extents[mid].exOffset <= offset)
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+    ex = &f->extents[lo];
+    within = offset - ex->exOffset;
+    avail = ex->exCount * f->clust_size - within;
+    if (avail > f->mapped - offset)
+	avail = f->mapped - offset;
+    if (*len > avail)
+	*len = avail;
+    return cluster_to_addr(ex->exCluster, f->image_buf, f->bpb) + within;
+}
+
+/* dos_pread copies up to len bytes at offset, and returns how many */
+ssize_t dos_pread(struct dos_file *f, void *buf, size_t len, uint32_t offset)
+{
+    uint8_t *out = buf;
+    const uint8_t *p;
+    uint32_t n;
+    size_t done = 0;
+
+    while (done < len)
+    {
+	n = len - done > UINT32_MAX ? UINT32_MAX : len - done;
+	p = dos_map(f, offset, &n);
+	if (p == NULL)
+	    break;
+	memcpy(out + done, p, n);
+	done += n;
+	offset += n;
+    }
+    return done;
+}
+
+ssize_t dos_read(struct dos_file *f, void *buf, size_t len)
+{
+    ssize_t n = dos_pread(f, buf, len, f->pos);
+
+    f->pos += n;
+    return n;
+}
+
+off_t dos_seek(struct dos_file *f, off_t offset, int whence)
+{
+    off_t base;
+
+    switch (whence)
+    {
+    case SEEK_SET:
+	base = 0;
+	break;
+    case SEEK_CUR:
+	base = f->pos;
+	break;
+    case SEEK_END:
+	base = f->size;
+	break;
+    default:
+	errno = EINVAL;
+	return -1;
+    }
+    if (base + offset < 0 || base + offset > UINT32_MAX)
+    {
+	errno = EINVAL;
+	return -1;
+    }
+    f->pos = base + offset;
+    return f->pos;
+}
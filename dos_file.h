@@ -0,0 +1,50 @@
+#ifndef __DOS_FILE_H__
+#define __DOS_FILE_H__
+
+/* Open files inside an image, for reading at any offset.
+
+   dos_open walks the file's cluster chain once and keeps it as a
+   sorted array of extents (runs of contiguous clusters), so finding
+   the data at an offset is a binary search rather than a walk from
+   the first cluster.
+
+   A handle doesn't change after it is opened, apart from the position
+   used by dos_read and dos_seek, so any number of threads may call
+   dos_pread and dos_map on one handle at once.  A thread that wants
+   dos_read should open its own handle. */
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct direntry;
+struct bpb33;
+
+struct dos_extent
+{
+    uint32_t exOffset;		/* byte offset of the run in the file */
+    uint16_t exCluster;		/* first cluster of the run */
+    uint16_t exCount;		/* clusters in the run */
+};
+
+struct dos_file
+{
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+    uint32_t size;		/* from the directory entry */
+    uint32_t mapped;		/* bytes the chain actually covers */
+    uint32_t clust_size;
+    uint32_t nextents;
+    struct dos_extent *extents;
+    uint32_t pos;		/* for dos_read and dos_seek */
+};
+
+struct dos_file *dos_open(const char *path, uint8_t *image_buf, struct bpb33 *bpb);
+struct dos_file *dos_open_dirent(struct direntry *, uint8_t *, struct bpb33 *);
+void dos_close(struct dos_file *);
+
+const uint8_t *dos_map(struct dos_file *, uint32_t offset, uint32_t *len);
+ssize_t dos_pread(struct dos_file *, void *buf, size_t len, uint32_t offset);
+ssize_t dos_read(struct dos_file *, void *buf, size_t len);
+off_t dos_seek(struct dos_file *, off_t offset, int whence);
+
+#endif // __DOS_FILE_H__
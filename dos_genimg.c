@@ -0,0 +1,400 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <math.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "stats.h"
+
+
+/* dos_genimg generates synthetic disk images for benchmarking: a
+   tree of directories of a given depth and fanout, holding a given
+   number of files whose sizes follow a chosen distribution.  With a
+   fragmentation level of f percent, each cluster of a file has an f%
+   chance of being placed at a random free cluster instead of right
+   after the one before it.
+
+   Optionally a manifest listing every file and its size is written,
+   so that benchmarks know what to ask for. */
+
+#define BYTES_PER_SEC 512
+
+struct gen_dir
+{
+    int parent;
+    int depth;
+    char path[MAXPATHLEN+1];
+    uint16_t start_cluster;
+    uint16_t nclusters;
+    int nentries;
+    struct direntry *entries;	/* built in memory, copied at the end */
+};
+
+struct generator
+{
+    uint8_t *image_buf;
+    struct bpb33 bpb;
+    uint16_t maxclust;
+    uint32_t clust_size;
+    uint8_t *used;
+    uint16_t nfree;
+    uint16_t last;		/* last cluster handed out */
+    int frag_pct;
+    uint64_t rng;
+};
+
+
+/* xorshift64*: a fast, repeatable random number generator */
+uint64_t next_random(struct generator *gen)
+{
+    gen->rng ^= gen->rng >> 12;
+    gen->rng ^= gen->rng << 25;
+    gen->rng ^= gen->rng >> 27;
+    return gen->rng * 2685821657736338717ULL;
+}
+
+double random_unit(struct generator *gen)
+{
+    return (next_random(gen) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/* alloc_cluster hands out the next cluster for a chain.  Usually
+   that's the next free one after the last, but with probability
+   frag_pct it's a random free one. */
+uint16_t alloc_cluster(struct generator *gen)
+{
+    uint16_t c;
+
+    if (gen->nfree == 0)
+    {
+	fprintf(stderr, "No more space in filesystem\n");
+	exit(1);
+    }
+
+    if (gen->last != 0 && (int)(next_random(gen) % 100) < gen->frag_pct)
+	c = CLUST_FIRST + next_random(gen) % (gen->maxclust - CLUST_FIRST);
+    else
+	c = gen->last + 1;
+
+    while (1)
+    {
+	if (c < CLUST_FIRST || c >= gen->maxclust)
+	    c = CLUST_FIRST;
+	if (!gen->used[c])
+	    break;
+	c++;
+    }
+    gen->used[c] = 1;
+    gen->nfree--;
+    gen->last = c;
+    return c;
+}
+
+/* alloc_chain allocates and links a chain of n clusters */
+uint16_t alloc_chain(struct generator *gen, uint32_t n)
+{
+    uint16_t start = 0, prev = 0, c;
+
+    while (n-- > 0)
+    {
+	c = alloc_cluster(gen);
+	if (prev)
+	    set_fat_entry(prev, c, gen->image_buf, &gen->bpb);
+	else
+	    start = c;
+	set_fat_entry(c, FAT12_MASK & CLUST_EOFS, gen->image_buf, &gen->bpb);
+	prev = c;
+    }
+    return start;
+}
+
+
+void fill_dirent(struct direntry *dirent, const char *name, const char *ext,
+		 uint8_t attr, uint16_t start_cluster, uint32_t size)
+{
+    uint16_t date = (40 << DD_YEAR_SHIFT) | (1 << DD_MONTH_SHIFT) | 1;
+
+    memset(dirent->deName, ' ', 8);
+    memset(dirent->deExtension, ' ', 3);
+    memcpy(dirent->deName, name, strlen(name));
+    memcpy(dirent->deExtension, ext, strlen(ext));
+    dirent->deAttributes = attr;
+    putushort(dirent->deStartCluster, start_cluster);
+    putulong(dirent->deFileSize, size);
+
+    /* everything is dated 1 Jan 2020, midnight */
+    putushort(dirent->deMDate, date);
+}
+
+
+/* pick_size draws a file size from the distribution given by spec:
+   "fixed:N", "uniform:MIN:MAX" or "exp:MEAN" */
+uint32_t pick_size(struct generator *gen, const char *spec)
+{
+    double a = 0, b = 0;
+
+    if (sscanf(spec, "fixed:%lf", &a) == 1)
+	return a;
+    if (sscanf(spec, "uniform:%lf:%lf", &a, &b) == 2 && b >= a)
+	return a + random_unit(gen) * (b - a + 1);
+    if (sscanf(spec, "exp:%lf", &a) == 1)
+	return -a * log(1.0 - random_unit(gen));
+
+    fprintf(stderr, "Bad size distribution %s\n", spec);
+    exit(1);
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [options] <imagename>\n", progname);
+    fprintf(stderr, "\t-s sectors      image size in 512 byte sectors (2880)\n");
+    fprintf(stderr, "\t-c spc          sectors per cluster (1)\n");
+    fprintf(stderr, "\t-t fattype      FAT type; only 12 is supported (12)\n");
+    fprintf(stderr, "\t-n files        number of files (100)\n");
+    fprintf(stderr, "\t-d depth        directory depth (2)\n");
+    fprintf(stderr, "\t-b fanout       subdirectories per directory (2)\n");
+    fprintf(stderr, "\t-z dist         file sizes: fixed:N, uniform:MIN:MAX or exp:MEAN (exp:4096)\n");
+    fprintf(stderr, "\t-f percent      fragmentation level, 0-100 (0)\n");
+    fprintf(stderr, "\t-S seed         random seed (1)\n");
+    fprintf(stderr, "\t-m manifest     write a list of files and sizes\n");
+    fprintf(stderr, "\t--stats         print operation counters on exit\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    struct generator gen;
+    struct gen_dir *dirs;
+    uint32_t size, nclust, total_bytes = 0;
+    uint16_t start;
+    uint8_t *p;
+    char *dist = "exp:4096";
+    char *manifest = NULL;
+    char name[16], ext[4];
+    FILE *mf = NULL;
+    int fattype = 12, nfiles = 100, depth = 2, fanout = 2;
+    int ndirs, maxdirs, d, i, j, opt, fd;
+    int spc = 1, sectors = 2880;
+    uint64_t seed = 1;
+
+    memset(&gen, 0, sizeof(gen));
+    stats_option(&argc, argv);
+    while ((opt = getopt(argc, argv, "s:c:t:n:d:b:z:f:S:m:")) != -1)
+    {
+	switch (opt)
+	{
+	case 's': sectors = atoi(optarg); break;
+	case 'c': spc = atoi(optarg); break;
+	case 't': fattype = atoi(optarg); break;
+	case 'n': nfiles = atoi(optarg); break;
+	case 'd': depth = atoi(optarg); break;
+	case 'b': fanout = atoi(optarg); break;
+	case 'z': dist = optarg; break;
+	case 'f': gen.frag_pct = atoi(optarg); break;
+	case 'S': seed = strtoull(optarg, NULL, 0); break;
+	case 'm': manifest = optarg; break;
+	default: usage(argv[0]);
+	}
+    }
+    if (argc - optind != 1 || depth < 0 || fanout < 1 || fanout > 999
+	|| nfiles < 0 || nfiles > 9999999)
+	usage(argv[0]);
+
+    if (fattype != 12)
+    {
+	fprintf(stderr, "Only FAT-12 images are supported\n");
+	exit(1);
+    }
+
+    gen.bpb.bpbBytesPerSec = BYTES_PER_SEC;
+    gen.bpb.bpbSecPerClust = spc;
+    gen.bpb.bpbResSectors = 1;
+    gen.bpb.bpbFATs = 2;
+    gen.bpb.bpbRootDirEnts = 224;
+    gen.bpb.bpbSectors = sectors;
+    gen.bpb.bpbMedia = 0xf0;
+    gen.bpb.bpbSecPerTrack = 18;
+    gen.bpb.bpbHeads = 2;
+    if (sectors > 0xffff || plan_fat12(&gen.bpb) < 0)
+    {
+	fprintf(stderr, "Bad geometry, or too many clusters for FAT-12\n");
+	exit(1);
+    }
+
+    gen.image_buf = calloc(sectors, BYTES_PER_SEC);
+    gen.maxclust = get_cluster_count(&gen.bpb);
+    gen.clust_size = BYTES_PER_SEC * spc;
+    gen.used = calloc(gen.maxclust, 1);
+    gen.nfree = gen.maxclust - CLUST_FIRST;
+    gen.rng = seed ? seed : 1;
+
+    write_bootsector(gen.image_buf, &gen.bpb);
+    set_fat_entry(0, 0xf00 | gen.bpb.bpbMedia, gen.image_buf, &gen.bpb);
+    set_fat_entry(1, FAT12_MASK & CLUST_EOFE, gen.image_buf, &gen.bpb);
+
+    /* the directory tree, breadth first; dirs[0] is the root */
+    for (maxdirs = 1, i = 0, j = 1; i < depth; i++)
+    {
+	j *= fanout;
+	maxdirs += j;
+	if (maxdirs > 4096)
+	{
+	    fprintf(stderr, "Too many directories\n");
+	    exit(1);
+	}
+    }
+    dirs = calloc(maxdirs, sizeof(struct gen_dir));
+    dirs[0].parent = -1;
+    for (ndirs = 1, d = 0; d < ndirs; d++)
+    {
+	if (dirs[d].depth == depth)
+	    continue;
+	for (i = 0; i < fanout; i++, ndirs++)
+	{
+	    dirs[ndirs].parent = d;
+	    dirs[ndirs].depth = dirs[d].depth + 1;
+	    snprintf(name, sizeof(name), "/D%03d", i);
+	    if (strlen(dirs[d].path) + strlen(name) > MAXPATHLEN)
+	    {
+		fprintf(stderr, "Directory tree too deep\n");
+		exit(1);
+	    }
+	    strcpy(dirs[ndirs].path, dirs[d].path);
+	    strcat(dirs[ndirs].path, name);
+	    dirs[d].nentries++;
+	}
+    }
+
+    /* spread the files evenly over the directories */
+    for (i = 0; i < nfiles; i++)
+	dirs[i % ndirs].nentries++;
+
+    if (dirs[0].nentries > gen.bpb.bpbRootDirEnts)
+    {
+	fprintf(stderr, "Too many entries for the root directory\n");
+	exit(1);
+    }
+
+    /* directories get their clusters first, then the files */
+    dirs[0].entries = (struct direntry*)root_dir_addr(gen.image_buf, &gen.bpb);
+    for (d = 1; d < ndirs; d++)
+    {
+	nclust = ((dirs[d].nentries + 3) * sizeof(struct direntry)
+		  + gen.clust_size - 1) / gen.clust_size;
+	dirs[d].nclusters = nclust;
+	dirs[d].start_cluster = alloc_chain(&gen, nclust);
+	dirs[d].entries = calloc(nclust, gen.clust_size);
+	fill_dirent(&dirs[d].entries[0], ".", "", ATTR_DIRECTORY,
+		    dirs[d].start_cluster, 0);
+	fill_dirent(&dirs[d].entries[1], "..", "", ATTR_DIRECTORY,
+		    dirs[dirs[d].parent].start_cluster, 0);
+	dirs[d].nentries = 2;
+    }
+    dirs[0].nentries = 0;
+    for (d = 1; d < ndirs; d++)
+    {
+	struct gen_dir *parent = &dirs[dirs[d].parent];
+	snprintf(name, sizeof(name), "D%03d", (d - 1) % fanout);
+	fill_dirent(&parent->entries[parent->nentries++], name, "",
+		    ATTR_DIRECTORY, dirs[d].start_cluster, 0);
+    }
+
+    if (manifest != NULL && (mf = fopen(manifest, "w")) == NULL)
+    {
+	fprintf(stderr, "Can't open manifest %s\n", manifest);
+	exit(1);
+    }
+
+    for (i = 0; i < nfiles; i++)
+    {
+	struct gen_dir *dir = &dirs[i % ndirs];
+
+	size = pick_size(&gen, dist);
+	nclust = (size + gen.clust_size - 1) / gen.clust_size;
+	if (nclust > gen.nfree)
+	{
+	    fprintf(stderr, "No more space in filesystem after %d files\n", i);
+	    exit(1);
+	}
+	start = alloc_chain(&gen, nclust);
+
+	snprintf(name, sizeof(name), "F%07d", i);
+	snprintf(ext, sizeof(ext), "DAT");
+	fill_dirent(&dir->entries[dir->nentries++], name, ext,
+		    ATTR_ARCHIVE, start, size);
+	total_bytes += size;
+
+	/* fill the clusters with repeatable junk */
+	for (j = 0; start != 0 && is_valid_cluster(start, &gen.bpb); j++)
+	{
+	    uint64_t *w = (uint64_t*)cluster_to_addr(start, gen.image_buf, &gen.bpb);
+	    uint32_t k;
+	    for (k = 0; k < gen.clust_size / sizeof(uint64_t); k++)
+		w[k] = next_random(&gen);
+	    start = get_fat_entry(start, gen.image_buf, &gen.bpb);
+	}
+	/* the slack after the end of the file stays zero */
+	if (size % gen.clust_size)
+	{
+	    start = getushort(dir->entries[dir->nentries - 1].deStartCluster);
+	    for (j = 1; j < (int)nclust; j++)
+		start = get_fat_entry(start, gen.image_buf, &gen.bpb);
+	    p = cluster_to_addr(start, gen.image_buf, &gen.bpb);
+	    memset(p + size % gen.clust_size, 0,
+		   gen.clust_size - size % gen.clust_size);
+	}
+
+	if (mf)
+	    fprintf(mf, "%s/%s.%s %u\n", dir->path, name, ext, size);
+    }
+    if (mf)
+	fclose(mf);
+
+    /* copy the subdirectories into their clusters */
+    for (d = 1; d < ndirs; d++)
+    {
+	start = dirs[d].start_cluster;
+	for (j = 0; j < dirs[d].nclusters; j++)
+	{
+	    memcpy(cluster_to_addr(start, gen.image_buf, &gen.bpb),
+		   (uint8_t*)dirs[d].entries + j * gen.clust_size,
+		   gen.clust_size);
+	    start = get_fat_entry(start, gen.image_buf, &gen.bpb);
+	}
+    }
+
+    /* mirror the FAT */
+    for (i = 1; i < gen.bpb.bpbFATs; i++)
+	memcpy(gen.image_buf + (gen.bpb.bpbResSectors + i * gen.bpb.bpbFATsecs)
+	       * BYTES_PER_SEC,
+	       gen.image_buf + gen.bpb.bpbResSectors * BYTES_PER_SEC,
+	       gen.bpb.bpbFATsecs * BYTES_PER_SEC);
+
+    fd = open(argv[optind], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, gen.image_buf, sectors * BYTES_PER_SEC)
+	!= sectors * BYTES_PER_SEC)
+    {
+	fprintf(stderr, "Can't write disk image file %s:\n%s\n",
+		argv[optind], strerror(errno));
+	exit(1);
+    }
+    close(fd);
+
+    printf("%d directories, %d files, %u bytes, %u of %u clusters used\n",
+	   ndirs - 1, nfiles, total_bytes,
+	   gen.maxclust - CLUST_FIRST - gen.nfree, gen.maxclust - CLUST_FIRST);
+    return 0;
+}
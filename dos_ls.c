@@ -13,14 +13,8 @@
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
-
-
-void print_indent(int indent)
-{
-    int i;
-    for (i = 0; i < indent*4; i++)
-	printf(" ");
-}
+#include "stats.h"
+#include "report.h"
 
 
 uint16_t print_dirent(struct direntry *dirent, int indent)
@@ -36,6 +30,7 @@ uint16_t print_dirent(struct direntry *dirent, int indent)
     extension[3] = ' ';
     memcpy(name, &(dirent->deName[0]), 8);
     memcpy(extension, dirent->deExtension, 3);
+    STAT_INC(dirents_parsed);
     if (name[0] == SLOT_EMPTY)
     {
 	return followclust;
@@ -80,7 +75,7 @@ uint16_t print_dirent(struct direntry *dirent, int indent)
     }
     else if ((dirent->deAttributes & ATTR_VOLUME) != 0) 
     {
-	printf("Volume: %s\n", name);
+	report_volume(name);
     } 
     else if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) 
     {
@@ -88,9 +83,8 @@ uint16_t print_dirent(struct direntry *dirent, int indent)
         // for trash directories and such; just ignore them.
 	if ((dirent->deAttributes & ATTR_HIDDEN) != ATTR_HIDDEN)
         {
-	    print_indent(indent);
-    	    printf("%s/ (directory)\n", name);
             file_cluster = getushort(dirent->deStartCluster);
+	    report_dir(indent, name, file_cluster);
             followclust = file_cluster;
         }
     }
@@ -100,19 +94,9 @@ uint16_t print_dirent(struct direntry *dirent, int indent)
          * a "regular" file entry
          * print attributes, size, starting cluster, etc.
          */
-	int ro = (dirent->deAttributes & ATTR_READONLY) == ATTR_READONLY;
-	int hidden = (dirent->deAttributes & ATTR_HIDDEN) == ATTR_HIDDEN;
-	int sys = (dirent->deAttributes & ATTR_SYSTEM) == ATTR_SYSTEM;
-	int arch = (dirent->deAttributes & ATTR_ARCHIVE) == ATTR_ARCHIVE;
-
 	size = getulong(dirent->deFileSize);
-	print_indent(indent);
-	printf("%s.%s (%u bytes) (starting cluster %d) %c%c%c%c\n", 
-	       name, extension, size, getushort(dirent->deStartCluster),
-	       ro?'r':' ', 
-               hidden?'h':' ', 
-               sys?'s':' ', 
-               arch?'a':' ');
+	report_file(indent, name, extension, size, 
+		    getushort(dirent->deStartCluster), dirent->deAttributes);
     }
 
     return followclust;
@@ -160,9 +144,195 @@ void traverse_root(uint8_t *image_buf, struct bpb33* bpb)
 }
 
 
+/* Disk usage (-u).  One walk of the tree totals, for every directory,
+   the logical bytes, allocated clusters and files beneath it; each
+   directory's totals are added into its parent's on the way back up.
+   With -n N only the N largest subtrees are kept, in a min-heap
+   ordered by bytes, and printed largest first. */
+
+struct usage 
+{
+    char path[MAXPATHLEN];
+    int depth;
+    uint64_t bytes;		/* sum of file sizes */
+    uint32_t clusters;		/* clusters allocated, directories included */
+    uint32_t files;
+};
+
+struct du 
+{
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+    int top;			/* 0 to report every directory */
+    int nheap;
+    struct usage *heap;
+};
+
+struct du_walk 
+{
+    struct du *du;
+    struct usage *total;
+};
+
+void du_dir(struct du *du, uint16_t cluster, struct usage *total);
+
+/* heap_add offers a directory's totals to the top-N heap */
+void heap_add(struct du *du, struct usage *u)
+{
+    struct usage *heap = du->heap;
+    struct usage tmp;
+    int i, child;
+
+    if (du->nheap < du->top) 
+    {
+	/* sift the new entry up */
+	i = du->nheap++;
+	heap[i] = *u;
+	while (i > 0 && heap[(i - 1) / 2].bytes > heap[i].bytes) 
+	{
+	    tmp = heap[i];
+	    heap[i] = heap[(i - 1) / 2];
+	    heap[(i - 1) / 2] = tmp;
+	    i = (i - 1) / 2;
+	}
+	return;
+    }
+    if (u->bytes <= heap[0].bytes)
+	return;
+
+    /* replace the smallest and sift it down */
+    heap[0] = *u;
+    for (i = 0; (child = 2 * i + 1) < du->nheap; i = child) 
+    {
+	if (child + 1 < du->nheap && heap[child + 1].bytes < heap[child].bytes)
+	    child++;
+	if (heap[i].bytes <= heap[child].bytes)
+	    break;
+	tmp = heap[i];
+	heap[i] = heap[child];
+	heap[child] = tmp;
+    }
+}
+
+int du_dirent(struct direntry *dirent, void *arg)
+{
+    struct du_walk *d = arg;
+    struct du *du = d->du;
+    struct usage sub;
+    char name[MAXFILENAME];
+    uint16_t cluster = getushort(dirent->deStartCluster);
+
+    if (is_dot_dirent(dirent) || (dirent->deAttributes & ATTR_VOLUME))
+	return 0;
+
+    if (dirent->deAttributes & ATTR_DIRECTORY) 
+    {
+	get_dirent_name(dirent, name);
+	memset(&sub, 0, sizeof(sub));
+	sub.depth = d->total->depth + 1;
+	if (strlen(d->total->path) + strlen(name) + 2 > sizeof(sub.path)) 
+	{
+	    fprintf(stderr, "Path too long under %s\n", d->total->path);
+	    return 0;
+	}
+	strcpy(sub.path, d->total->path);
+	strcat(sub.path, name);
+	strcat(sub.path, "/");
+	du_dir(du, cluster, &sub);
+
+	d->total->bytes += sub.bytes;
+	d->total->clusters += sub.clusters;
+	d->total->files += sub.files;
+	return 0;
+    }
+
+    d->total->bytes += getulong(dirent->deFileSize);
+    d->total->clusters += chain_length(cluster, du->image_buf, du->bpb);
+    d->total->files++;
+    return 0;
+}
+
+/* du_dir totals up one directory, then reports it */
+void du_dir(struct du *du, uint16_t cluster, struct usage *total)
+{
+    struct du_walk d;
+
+    if (total->depth > MAXPATHLEN / 2) 
+    {
+	fprintf(stderr, "Directories nested too deep at %s\n", total->path);
+	return;
+    }
+    if (cluster != MSDOSFSROOT)
+	total->clusters += chain_length(cluster, du->image_buf, du->bpb);
+
+    d.du = du;
+    d.total = total;
+    for_each_dirent(cluster, du->image_buf, du->bpb, du_dirent, &d);
+
+    if (du->top > 0)
+	heap_add(du, total);
+    else
+	report_usage(total->depth, total->path, total->bytes, total->clusters,
+		     du->bpb->bpbBytesPerSec * du->bpb->bpbSecPerClust, total->files);
+}
+
+void disk_usage(int top, uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct du du;
+    struct usage root, tmp;
+    int i, child, n;
+
+    memset(&du, 0, sizeof(du));
+    du.image_buf = image_buf;
+    du.bpb = bpb;
+    du.top = top;
+    if (top > 0) 
+    {
+	du.heap = malloc(top * sizeof(struct usage));
+	if (du.heap == NULL) 
+	{
+	    fprintf(stderr, "Out of memory\n");
+	    exit(1);
+	}
+    }
+
+    memset(&root, 0, sizeof(root));
+    strcpy(root.path, "/");
+    du_dir(&du, MSDOSFSROOT, &root);
+    n = du.nheap;
+
+    /* heapsort what's left: repeatedly move the smallest to the end,
+       leaving the array largest first */
+    while (du.nheap > 1) 
+    {
+	du.nheap--;
+	tmp = du.heap[0];
+	du.heap[0] = du.heap[du.nheap];
+	du.heap[du.nheap] = tmp;
+	for (i = 0; (child = 2 * i + 1) < du.nheap; i = child) 
+	{
+	    if (child + 1 < du.nheap && du.heap[child + 1].bytes < du.heap[child].bytes)
+		child++;
+	    if (du.heap[i].bytes <= du.heap[child].bytes)
+		break;
+	    tmp = du.heap[i];
+	    du.heap[i] = du.heap[child];
+	    du.heap[child] = tmp;
+	}
+    }
+    /* there may be fewer directories than top */
+    for (i = 0; i < n; i++)
+	report_usage(du.heap[i].depth, du.heap[i].path, du.heap[i].bytes, du.heap[i].clusters,
+		     bpb->bpbBytesPerSec * bpb->bpbSecPerClust, du.heap[i].files);
+    free(du.heap);
+}
+
+
 void usage(char *progname)
 {
-    fprintf(stderr, "usage: %s <imagename>\n", progname);
+    fprintf(stderr, "usage: %s [--stats] [--format human|jsonl|binary] [--quiet] [--verbose] [-u [-n N]] <imagename>\n", progname);
+    fprintf(stderr, "\t-u    report disk usage of each directory: bytes, allocated bytes, files\n");
+    fprintf(stderr, "\t-n N  only the N largest directories, largest first\n");
     exit(1);
 }
 
@@ -172,14 +342,36 @@ int main(int argc, char** argv)
     uint8_t *image_buf;
     int fd;
     struct bpb33* bpb;
-    if (argc != 2)
+    int du_mode = 0, top = 0;
+    int opt;
+
+    stats_option(&argc, argv);
+    report_option(&argc, argv);
+    while ((opt = getopt(argc, argv, "un:")) != -1)
+    {
+	switch (opt)
+	{
+	case 'u':
+	    du_mode = 1;
+	    break;
+	case 'n':
+	    top = atoi(optarg);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (argc - optind != 1 || top < 0 || (top > 0 && !du_mode))
     {
 	usage(argv[0]);
     }
 
-    image_buf = mmap_file(argv[1], &fd);
+    image_buf = mmap_file(argv[optind], &fd);
     bpb = check_bootsector(image_buf);
-    traverse_root(image_buf, bpb);
+    if (du_mode)
+	disk_usage(top, image_buf, bpb);
+    else
+	traverse_root(image_buf, bpb);
 
     unmmap_file(image_buf, &fd);
 
@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+/* dos_microbench times the primitives in dos.c in isolation, on a
+   synthetic image built in memory.  Each benchmark is run several
+   times; we report the mean, standard deviation and minimum cost of
+   one operation in nanoseconds.
+
+   Access patterns are sequential (cluster order), random (a shuffled
+   order), and pathological (alternating between the two ends of the
+   FAT, values that are mostly out of range, or a directory that is
+   mostly deleted and long filename slots). */
+
+#define BYTES_PER_SEC 512
+#define DIR_CLUSTERS 64		/* size of the directory benchmarks walk */
+
+struct bench
+{
+    uint8_t *image_buf;
+    struct bpb33 bpb;
+    uint16_t maxclust;
+    uint16_t *seq;		/* clusters in order */
+    uint16_t *rnd;		/* the same, shuffled */
+    uint16_t *far;		/* alternating low and high */
+    uint16_t *junk;		/* mostly invalid cluster numbers */
+    uint16_t nclust;
+    int runs;
+    int json;
+};
+
+/* results go here so the compiler can't throw the work away */
+volatile uintptr_t sink;
+
+static uint64_t rng = 88172645463325252ULL;
+
+uint64_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/* link_chain links the clusters in order[] into one chain, and
+   returns its first cluster */
+uint16_t link_chain(struct bench *b, uint16_t *order, uint16_t n)
+{
+    uint16_t i;
+
+    for (i = 0; i + 1 < n; i++)
+	set_fat_entry(order[i], order[i + 1], b->image_buf, &b->bpb);
+    set_fat_entry(order[n - 1], FAT12_MASK & CLUST_EOFS, b->image_buf, &b->bpb);
+    return order[0];
+}
+
+
+void setup(struct bench *b)
+{
+    uint16_t i, j, t;
+
+    memset(&b->bpb, 0, sizeof(b->bpb));
+    b->bpb.bpbBytesPerSec = BYTES_PER_SEC;
+    b->bpb.bpbSecPerClust = 4;
+    b->bpb.bpbResSectors = 1;
+    b->bpb.bpbFATs = 2;
+    b->bpb.bpbRootDirEnts = 224;
+    b->bpb.bpbSectors = 16000;
+    b->bpb.bpbMedia = 0xf0;
+    plan_fat12(&b->bpb);
+
+    b->image_buf = calloc(b->bpb.bpbSectors, BYTES_PER_SEC);
+    write_bootsector(b->image_buf, &b->bpb);
+    b->maxclust = get_cluster_count(&b->bpb);
+    b->nclust = b->maxclust - CLUST_FIRST;
+
+    b->seq = malloc(b->nclust * sizeof(uint16_t));
+    b->rnd = malloc(b->nclust * sizeof(uint16_t));
+    b->far = malloc(b->nclust * sizeof(uint16_t));
+    b->junk = malloc(b->nclust * sizeof(uint16_t));
+    for (i = 0; i < b->nclust; i++)
+    {
+	b->seq[i] = CLUST_FIRST + i;
+	b->rnd[i] = CLUST_FIRST + i;
+	b->far[i] = (i % 2) ? b->maxclust - 1 - i / 2 : CLUST_FIRST + i / 2;
+	b->junk[i] = next_random() & 0xffff;
+    }
+    for (i = b->nclust - 1; i > 0; i--)
+    {
+	j = next_random() % (i + 1);
+	t = b->rnd[i];
+	b->rnd[i] = b->rnd[j];
+	b->rnd[j] = t;
+    }
+}
+
+/* make_dir builds a directory out of the first DIR_CLUSTERS clusters
+   of order, linked in that order, with every slot in use.  A normal
+   directory has a few deleted entries, like any real one; a sparse
+   one has one file in 16 slots, and the rest are deleted entries and
+   long filename slots.  Returns its first cluster. */
+uint16_t make_dir(struct bench *b, uint16_t *order, int sparse)
+{
+    struct direntry *dirent;
+    int entries, i, k;
+    char name[16];
+
+    entries = b->bpb.bpbBytesPerSec * b->bpb.bpbSecPerClust / sizeof(struct direntry);
+    for (i = 0; i < DIR_CLUSTERS; i++)
+    {
+	dirent = (struct direntry*)cluster_to_addr(order[i], b->image_buf, &b->bpb);
+	for (k = 0; k < entries; k++, dirent++)
+	{
+	    memset(dirent, 0, sizeof(*dirent));
+	    snprintf(name, sizeof(name), "FILE%04d", (i * entries + k) % 10000);
+	    memcpy(dirent->deName, name, 8);
+	    memcpy(dirent->deExtension, "TXT", 3);
+	    dirent->deAttributes = ATTR_ARCHIVE;
+	    if (sparse && k % 2 == 1)
+		dirent->deAttributes = ATTR_WIN95LFN;
+	    else if (sparse ? k % 16 != 0 : k % 7 == 3)
+		dirent->deName[0] = SLOT_DELETED;
+	}
+    }
+    return link_chain(b, order, DIR_CLUSTERS);
+}
+
+
+typedef double (*bench_fn)(struct bench *, uint16_t *, long *);
+
+double bench_get_fat(struct bench *b, uint16_t *order, long *ops)
+{
+    uintptr_t acc = 0;
+    double start = now_ns();
+    uint16_t i;
+
+    for (i = 0; i < b->nclust; i++)
+	acc += get_fat_entry(order[i], b->image_buf, &b->bpb);
+    sink = acc;
+    *ops = b->nclust;
+    return now_ns() - start;
+}
+
+double bench_set_fat(struct bench *b, uint16_t *order, long *ops)
+{
+    double start = now_ns();
+    uint16_t i;
+
+    for (i = 0; i < b->nclust; i++)
+	set_fat_entry(order[i], i & FAT12_MASK, b->image_buf, &b->bpb);
+    *ops = b->nclust;
+    return now_ns() - start;
+}
+
+double bench_cluster_to_addr(struct bench *b, uint16_t *order, long *ops)
+{
+    uintptr_t acc = 0;
+    double start = now_ns();
+    uint16_t i;
+
+    for (i = 0; i < b->nclust; i++)
+	acc += (uintptr_t)cluster_to_addr(order[i], b->image_buf, &b->bpb);
+    sink = acc;
+    *ops = b->nclust;
+    return now_ns() - start;
+}
+
+double bench_is_valid(struct bench *b, uint16_t *order, long *ops)
+{
+    uintptr_t acc = 0;
+    double start = now_ns();
+    uint16_t i;
+
+    for (i = 0; i < b->nclust; i++)
+	acc += is_valid_cluster(order[i], &b->bpb);
+    sink = acc;
+    *ops = b->nclust;
+    return now_ns() - start;
+}
+
+/* walk a whole chain, as every reader of a file does */
+double bench_chain(struct bench *b, uint16_t *order, long *ops)
+{
+    uint16_t cluster = link_chain(b, order, b->nclust);
+    uintptr_t acc = 0;
+    long n = 0;
+    double start = now_ns();
+
+    while (is_valid_cluster(cluster, &b->bpb))
+    {
+	acc += (uintptr_t)cluster_to_addr(cluster, b->image_buf, &b->bpb);
+	cluster = get_fat_entry(cluster, b->image_buf, &b->bpb);
+	n++;
+    }
+    sink = acc;
+    *ops = n;
+    return now_ns() - start;
+}
+
+/* parse every live entry of a directory into a name */
+static int count_dirent(struct direntry *dirent, void *arg)
+{
+    char name[MAXFILENAME];
+
+    get_dirent_name(dirent, name);
+    sink += name[0];
+    return 0;
+}
+
+/* walk_dir times for_each_dirent over a directory from make_dir.  The
+   cost is per slot, live or not, so sparse directories compare. */
+double walk_dir(struct bench *b, uint16_t cluster, long *ops)
+{
+    double start = now_ns();
+    int i;
+
+    for (i = 0; i < 4; i++)
+	for_each_dirent(cluster, b->image_buf, &b->bpb, count_dirent, NULL);
+    *ops = 4L * DIR_CLUSTERS * b->bpb.bpbBytesPerSec * b->bpb.bpbSecPerClust
+	/ sizeof(struct direntry);
+    return now_ns() - start;
+}
+
+double bench_dirent(struct bench *b, uint16_t *order, long *ops)
+{
+    return walk_dir(b, make_dir(b, order, 0), ops);
+}
+
+double bench_dirent_sparse(struct bench *b, uint16_t *order, long *ops)
+{
+    return walk_dir(b, make_dir(b, order, 1), ops);
+}
+
+
+void run(struct bench *b, const char *name, const char *pattern,
+	 bench_fn fn, uint16_t *order)
+{
+    double sum = 0, sumsq = 0, min = 0, mean, var, ns;
+    long ops;
+    int i;
+
+    /* one untimed run to warm the caches */
+    fn(b, order, &ops);
+
+    for (i = 0; i < b->runs; i++)
+    {
+	ns = fn(b, order, &ops) / ops;
+	sum += ns;
+	sumsq += ns * ns;
+	if (i == 0 || ns < min)
+	    min = ns;
+    }
+    mean = sum / b->runs;
+    var = sumsq / b->runs - mean * mean;
+    if (var < 0)
+	var = 0;
+
+    if (b->json)
+	printf("{\"bench\":\"%s\",\"pattern\":\"%s\",\"ops\":%ld,\"runs\":%d,"
+	       "\"mean_ns\":%.3f,\"stddev_ns\":%.3f,\"min_ns\":%.3f}\n",
+	       name, pattern, ops, b->runs, mean, sqrt(var), min);
+    else
+	printf("%-16s %-14s %10.3f ns/op  +/- %8.3f  (min %.3f)\n",
+	       name, pattern, mean, sqrt(var), min);
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-r runs] [-j]\n", progname);
+    fprintf(stderr, "\t-j report in JSON lines\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    struct bench b;
+    int opt;
+
+    memset(&b, 0, sizeof(b));
+    b.runs = 20;
+    while ((opt = getopt(argc, argv, "r:j")) != -1)
+    {
+	switch (opt)
+	{
+	case 'r':
+	    b.runs = atoi(optarg);
+	    break;
+	case 'j':
+	    b.json = 1;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (b.runs < 1)
+	usage(argv[0]);
+
+    setup(&b);
+
+    /* set_fat_entry scribbles over the FAT, so it goes last, and
+       the chain benchmarks build their own chains */
+    run(&b, "get_fat_entry", "sequential", bench_get_fat, b.seq);
+    run(&b, "get_fat_entry", "random", bench_get_fat, b.rnd);
+    run(&b, "get_fat_entry", "pathological", bench_get_fat, b.far);
+    run(&b, "cluster_to_addr", "sequential", bench_cluster_to_addr, b.seq);
+    run(&b, "cluster_to_addr", "random", bench_cluster_to_addr, b.rnd);
+    run(&b, "cluster_to_addr", "pathological", bench_cluster_to_addr, b.far);
+    run(&b, "is_valid_cluster", "sequential", bench_is_valid, b.seq);
+    run(&b, "is_valid_cluster", "random", bench_is_valid, b.rnd);
+    run(&b, "is_valid_cluster", "pathological", bench_is_valid, b.junk);
+    run(&b, "chain_walk", "sequential", bench_chain, b.seq);
+    run(&b, "chain_walk", "random", bench_chain, b.rnd);
+    run(&b, "chain_walk", "pathological", bench_chain, b.far);
+    run(&b, "dirent_parse", "sequential", bench_dirent, b.seq);
+    run(&b, "dirent_parse", "random", bench_dirent, b.rnd);
+    run(&b, "dirent_parse", "pathological", bench_dirent_sparse, b.seq);
+    run(&b, "set_fat_entry", "sequential", bench_set_fat, b.seq);
+    run(&b, "set_fat_entry", "random", bench_set_fat, b.rnd);
+    run(&b, "set_fat_entry", "pathological", bench_set_fat, b.far);
+
+    return 0;
+}
@@ -0,0 +1,564 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <time.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "stats.h"
+
+
+/* dos_mkimg builds a new FAT-12 disk image from a directory on the
+   host.  The whole layout is planned up front -- every directory and
+   file gets one contiguous run of clusters, in the order they are
+   written -- and then the image is written front to back in one
+   sequential pass. */
+
+#define BYTES_PER_SEC 512
+#define MAX_FAT12_CLUSTERS 4084
+#define WRITE_BUFSIZE (4*1024*1024)
+
+/* a file or directory from the host tree */
+struct node
+{
+    char *hostpath;
+    char name[11];		/* 8.3 name, blank filled */
+    int is_dir;
+    uint32_t size;
+    time_t mtime;
+    uint16_t start_cluster;
+    uint16_t nclusters;
+    struct node *parent;
+    struct node *children;	/* first child, for directories */
+    struct node *next;		/* next sibling */
+    struct node *next_alloc;	/* next node in cluster order */
+};
+
+struct geometry
+{
+    uint16_t sectors;
+    uint8_t sec_per_clust;
+    uint16_t root_ents;
+    uint8_t fats;
+    uint16_t fat_secs;
+    uint16_t clusters;
+    uint32_t clust_size;
+};
+
+
+/* make_name converts a host filename to a blank filled, upper case
+   8.3 name.  Characters DOS won't accept are replaced by '_'. */
+void make_name(const char *hostname, char *name)
+{
+    const char *dot = strrchr(hostname, '.');
+    const char *p;
+    int i;
+
+    if (dot == hostname)
+	dot = NULL;
+
+    memset(name, ' ', 11);
+    for (i = 0, p = hostname; *p != '\0' && p != dot && i < 8; p++)
+	name[i++] = isalnum((uint8_t)*p) || strchr("$%'-_@~`!(){}^#&", *p)
+	    ? toupper((uint8_t)*p) : '_';
+    if (dot != NULL)
+    {
+	for (i = 8, p = dot + 1; *p != '\0' && i < 11; p++)
+	    name[i++] = isalnum((uint8_t)*p) ? toupper((uint8_t)*p) : '_';
+    }
+
+    /* 0xe5 in the first byte would mark the slot deleted */
+    if ((uint8_t)name[0] == SLOT_DELETED)
+	name[0] = SLOT_E5;
+}
+
+
+/* make_unique mangles name to NAME~N until no sibling has it */
+void make_unique(struct node *dir, char *name)
+{
+    struct node *sib;
+    char tail[8];
+    int n, len, base;
+
+    for (n = 1; ; n++)
+    {
+	for (sib = dir->children; sib != NULL; sib = sib->next)
+	{
+	    if (memcmp(sib->name, name, 11) == 0)
+		break;
+	}
+	if (sib == NULL)
+	    return;
+
+	len = snprintf(tail, sizeof(tail), "~%d", n);
+	for (base = 0; base < 8 && name[base] != ' ' && name[base] != '~'; base++)
+	    ;
+	if (base > 8 - len)
+	    base = 8 - len;
+	memset(name + base, ' ', 8 - base);
+	memcpy(name + base, tail, len);
+    }
+}
+
+
+/* scan_tree reads a host directory into the node tree.  Anything
+   that isn't a regular file or a directory is skipped. */
+void scan_tree(struct node *dir, int *errors)
+{
+    DIR *d;
+    struct dirent *de;
+    struct stat st;
+    struct node *child, **tail = &dir->children;
+
+    d = opendir(dir->hostpath);
+    if (d == NULL)
+    {
+	fprintf(stderr, "Can't read directory %s: %s\n",
+		dir->hostpath, strerror(errno));
+	(*errors)++;
+	return;
+    }
+
+    while ((de = readdir(d)) != NULL)
+    {
+	if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+	    continue;
+
+	child = calloc(1, sizeof(struct node));
+	child->hostpath = malloc(strlen(dir->hostpath) + strlen(de->d_name) + 2);
+	sprintf(child->hostpath, "%s/%s", dir->hostpath, de->d_name);
+
+	if (lstat(child->hostpath, &st) < 0
+	    || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)))
+	{
+	    fprintf(stderr, "Skipping %s\n", child->hostpath);
+	    free(child->hostpath);
+	    free(child);
+	    continue;
+	}
+	if (S_ISREG(st.st_mode) && st.st_size > 0xffffffffLL)
+	{
+	    fprintf(stderr, "File %s is too big for a FAT file system\n",
+		    child->hostpath);
+	    (*errors)++;
+	    free(child->hostpath);
+	    free(child);
+	    continue;
+	}
+
+	child->is_dir = S_ISDIR(st.st_mode);
+	child->size = child->is_dir ? 0 : st.st_size;
+	child->mtime = st.st_mtime;
+	child->parent = dir;
+	make_name(de->d_name, child->name);
+	make_unique(dir, child->name);
+
+	*tail = child;
+	tail = &child->next;
+    }
+    closedir(d);
+
+    for (child = dir->children; child != NULL; child = child->next)
+    {
+	if (child->is_dir)
+	    scan_tree(child, errors);
+    }
+}
+
+
+int count_children(struct node *dir)
+{
+    struct node *child;
+    int n = 0;
+
+    for (child = dir->children; child != NULL; child = child->next)
+	n++;
+    return n;
+}
+
+
+/* plan_dir hands out clusters for the contents of a directory: each
+   file immediately after its directory, and then each subdirectory
+   in turn.  Returns the next free cluster, or 0 if we ran out. */
+uint16_t plan_dir(struct node *dir, uint16_t next, struct node ***alloc_tail,
+		  struct geometry *geo)
+{
+    struct node *child;
+    uint32_t need;
+
+    for (child = dir->children; child != NULL; child = child->next)
+    {
+	if (child->is_dir)
+	{
+	    /* room for ".", ".." and the terminating empty slot */
+	    need = (count_children(child) + 3) * sizeof(struct direntry);
+	}
+	else
+	{
+	    need = child->size;
+	}
+	child->nclusters = (need + geo->clust_size - 1) / geo->clust_size;
+	if (child->nclusters == 0)
+	    continue;
+
+	if ((uint32_t)next + child->nclusters > (uint32_t)geo->clusters + CLUST_FIRST)
+	    return 0;
+	child->start_cluster = next;
+	next += child->nclusters;
+
+	**alloc_tail = child;
+	*alloc_tail = &child->next_alloc;
+    }
+
+    for (child = dir->children; child != NULL; child = child->next)
+    {
+	if (child->is_dir)
+	{
+	    next = plan_dir(child, next, alloc_tail, geo);
+	    if (next == 0)
+		return 0;
+	}
+    }
+    return next;
+}
+
+
+/* compute_geometry works out the FAT size and the number of
+   clusters for the requested geometry */
+int compute_geometry(struct geometry *geo, struct bpb33 *bpb)
+{
+    memset(bpb, 0, sizeof(*bpb));
+    bpb->bpbBytesPerSec = BYTES_PER_SEC;
+    bpb->bpbSecPerClust = geo->sec_per_clust;
+    bpb->bpbResSectors = 1;
+    bpb->bpbFATs = geo->fats;
+    bpb->bpbRootDirEnts = geo->root_ents;
+    bpb->bpbSectors = geo->sectors;
+    bpb->bpbMedia = 0xf0;
+    bpb->bpbSecPerTrack = 18;
+    bpb->bpbHeads = 2;
+    if (plan_fat12(bpb) < 0)
+	return -1;
+
+    geo->clust_size = BYTES_PER_SEC * geo->sec_per_clust;
+    geo->fat_secs = bpb->bpbFATsecs;
+    geo->clusters = get_cluster_count(bpb) - CLUST_FIRST;
+    return 0;
+}
+
+
+/* a large buffer in front of the output file, so that the image goes
+   out in big sequential writes */
+struct out_buf
+{
+    int fd;
+    uint8_t *buf;
+    uint32_t used;
+};
+
+void out_flush(struct out_buf *out)
+{
+    uint8_t *p = out->buf;
+    ssize_t n;
+
+    while (out->used > 0)
+    {
+	STAT_INC(syscalls);
+	n = write(out->fd, p, out->used);
+	if (n < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    fprintf(stderr, "Write failed: %s\n", strerror(errno));
+	    exit(1);
+	}
+	p += n;
+	out->used -= n;
+    }
+}
+
+/* out_space returns a pointer to len zeroed bytes in the buffer */
+uint8_t *out_space(struct out_buf *out, uint32_t len)
+{
+    uint8_t *p;
+
+    if (out->used + len > WRITE_BUFSIZE)
+	out_flush(out);
+    p = out->buf + out->used;
+    memset(p, 0, len);
+    out->used += len;
+    return p;
+}
+
+
+void set_dos_time(struct direntry *dirent, time_t mtime)
+{
+    struct tm *tm = localtime(&mtime);
+    uint16_t dtime, ddate;
+
+    if (tm == NULL || tm->tm_year < 80)
+	return;
+    dtime = (tm->tm_sec / 2) << DT_2SECONDS_SHIFT
+	| tm->tm_min << DT_MINUTES_SHIFT
+	| tm->tm_hour << DT_HOURS_SHIFT;
+    ddate = tm->tm_mday << DD_DAY_SHIFT
+	| (tm->tm_mon + 1) << DD_MONTH_SHIFT
+	| (tm->tm_year - 80) << DD_YEAR_SHIFT;
+    putushort(dirent->deMTime, dtime);
+    putushort(dirent->deMDate, ddate);
+    putushort(dirent->deCTime, dtime);
+    putushort(dirent->deCDate, ddate);
+    putushort(dirent->deADate, ddate);
+}
+
+void fill_dirent(struct direntry *dirent, const char *name, uint8_t attr,
+		 uint16_t start_cluster, uint32_t size, time_t mtime)
+{
+    memcpy(dirent->deName, name, 8);
+    memcpy(dirent->deExtension, name + 8, 3);
+    dirent->deAttributes = attr;
+    putushort(dirent->deStartCluster, start_cluster);
+    putulong(dirent->deFileSize, size);
+    set_dos_time(dirent, mtime);
+}
+
+/* write_entries lays out the entries for the children of dir */
+void write_entries(struct direntry *dirent, struct node *dir)
+{
+    struct node *child;
+
+    for (child = dir->children; child != NULL; child = child->next, dirent++)
+    {
+	if (child->is_dir)
+	    fill_dirent(dirent, child->name, ATTR_DIRECTORY,
+			child->start_cluster, 0, child->mtime);
+	else
+	    fill_dirent(dirent, child->name, ATTR_ARCHIVE,
+			child->start_cluster, child->size, child->mtime);
+    }
+}
+
+
+/* copy_file_data copies a host file into its clusters.  If the file
+   shrank since we looked at it, the rest is left zeroed. */
+void copy_file_data(struct out_buf *out, struct node *file,
+		    struct geometry *geo, int *errors)
+{
+    uint32_t remaining = file->nclusters * geo->clust_size;
+    uint32_t want, got;
+    uint8_t *p;
+    ssize_t n;
+    int fd;
+
+    STAT_INC(syscalls);
+    fd = open(file->hostpath, O_RDONLY);
+    if (fd < 0)
+    {
+	fprintf(stderr, "Can't open file %s to copy data in\n", file->hostpath);
+	(*errors)++;
+    }
+
+    while (remaining > 0)
+    {
+	want = remaining > WRITE_BUFSIZE / 2 ? WRITE_BUFSIZE / 2 : remaining;
+	p = out_space(out, want);
+	for (got = 0; fd >= 0 && got < want; got += n)
+	{
+	    STAT_INC(syscalls);
+	    n = read(fd, p + got, want - got);
+	    if (n <= 0)
+		break;
+	    STAT_ADD(bytes_copied, n);
+	}
+	remaining -= want;
+    }
+
+    if (fd >= 0)
+    {
+	close(fd);
+	STAT_INC(syscalls);
+    }
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [--stats] [-s sectors] [-c sectors_per_cluster] [-r root_entries] [-f fats] [-L label] <imagename> <hostdir>\n", progname);
+    fprintf(stderr, "\tcreates a new FAT-12 disk image holding the contents of hostdir\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    struct geometry geo;
+    struct node root;
+    struct node *alloc_list = NULL, **alloc_tail = &alloc_list;
+    struct node *n;
+    struct bpb33 disk_bpb;
+    struct bpb33 fat_bpb;
+    struct out_buf out;
+    struct direntry *dirent;
+    struct stat st;
+    uint8_t *fatbuf;
+    uint32_t fat_bytes;
+    uint16_t next, c;
+    char *label = NULL;
+    char labelname[11];
+    int root_used;
+    int errors = 0;
+    int opt, i;
+
+    geo.sectors = 2880;
+    geo.sec_per_clust = 1;
+    geo.root_ents = 224;
+    geo.fats = 2;
+
+    stats_option(&argc, argv);
+    while ((opt = getopt(argc, argv, "s:c:r:f:L:")) != -1)
+    {
+	switch (opt)
+	{
+	case 's':
+	    geo.sectors = atoi(optarg);
+	    break;
+	case 'c':
+	    geo.sec_per_clust = atoi(optarg);
+	    break;
+	case 'r':
+	    geo.root_ents = atoi(optarg);
+	    break;
+	case 'f':
+	    geo.fats = atoi(optarg);
+	    break;
+	case 'L':
+	    label = optarg;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (argc - optind != 2)
+	usage(argv[0]);
+
+    if (compute_geometry(&geo, &disk_bpb) < 0)
+    {
+	fprintf(stderr, "Bad geometry, or too many clusters for FAT-12\n");
+	exit(1);
+    }
+
+    /* read the host tree, and plan where everything goes */
+    memset(&root, 0, sizeof(root));
+    root.hostpath = argv[optind + 1];
+    root.is_dir = 1;
+    if (stat(root.hostpath, &st) < 0 || !S_ISDIR(st.st_mode))
+    {
+	fprintf(stderr, "%s is not a directory\n", root.hostpath);
+	exit(1);
+    }
+    scan_tree(&root, &errors);
+
+    root_used = count_children(&root) + (label != NULL);
+    if (root_used > geo.root_ents)
+    {
+	fprintf(stderr, "Too many entries (%d) for the root directory (%d)\n",
+		root_used, geo.root_ents);
+	exit(1);
+    }
+
+    next = plan_dir(&root, CLUST_FIRST, &alloc_tail, &geo);
+    if (next == 0)
+    {
+	fprintf(stderr, "No more space in filesystem\n");
+	exit(1);
+    }
+
+    /* build the FAT in memory, with the same layout as on disk so
+       that set_fat_entry can do the packing for us */
+    memset(&fat_bpb, 0, sizeof(fat_bpb));
+    fat_bpb.bpbBytesPerSec = BYTES_PER_SEC;
+    fat_bpb.bpbSecPerClust = geo.sec_per_clust;
+    fat_bpb.bpbResSectors = 0;
+    fat_bytes = geo.fat_secs * BYTES_PER_SEC;
+    fatbuf = calloc(1, fat_bytes);
+    set_fat_entry(0, 0xf00 | 0xf0, fatbuf, &fat_bpb);
+    set_fat_entry(1, FAT12_MASK & CLUST_EOFE, fatbuf, &fat_bpb);
+    for (n = alloc_list; n != NULL; n = n->next_alloc)
+    {
+	for (c = n->start_cluster; c < n->start_cluster + n->nclusters - 1; c++)
+	    set_fat_entry(c, c + 1, fatbuf, &fat_bpb);
+	set_fat_entry(c, FAT12_MASK & CLUST_EOFS, fatbuf, &fat_bpb);
+    }
+
+    out.fd = open(argv[optind], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out.fd < 0)
+    {
+	fprintf(stderr, "Can't create disk image file %s:\n%s\n",
+		argv[optind], strerror(errno));
+	exit(1);
+    }
+    out.buf = malloc(WRITE_BUFSIZE);
+    out.used = 0;
+
+    /* boot sector */
+    write_bootsector(out_space(&out, BYTES_PER_SEC), &disk_bpb);
+
+    /* the FATs */
+    for (i = 0; i < geo.fats; i++)
+	memcpy(out_space(&out, fat_bytes), fatbuf, fat_bytes);
+
+    /* the root directory */
+    dirent = (struct direntry*)out_space(&out,
+					 geo.root_ents * sizeof(struct direntry));
+    if (label != NULL)
+    {
+	memset(labelname, ' ', 11);
+	for (i = 0; i < 11 && label[i] != '\0'; i++)
+	    labelname[i] = toupper((uint8_t)label[i]);
+	fill_dirent(dirent, labelname, ATTR_VOLUME, 0, 0, time(NULL));
+	dirent++;
+    }
+    write_entries(dirent, &root);
+
+    /* and the data area, in cluster order */
+    for (n = alloc_list; n != NULL; n = n->next_alloc)
+    {
+	if (n->is_dir)
+	{
+	    dirent = (struct direntry*)out_space(&out,
+						 n->nclusters * geo.clust_size);
+	    fill_dirent(dirent, ".          ", ATTR_DIRECTORY,
+			n->start_cluster, 0, n->mtime);
+	    fill_dirent(dirent + 1, "..         ", ATTR_DIRECTORY,
+			n->parent->start_cluster, 0, n->parent->mtime);
+	    write_entries(dirent + 2, n);
+	}
+	else
+	{
+	    copy_file_data(&out, n, &geo, &errors);
+	}
+    }
+    out_flush(&out);
+
+    /* the free clusters at the end are left as a hole */
+    if (ftruncate(out.fd, (off_t)geo.sectors * BYTES_PER_SEC) < 0)
+    {
+	fprintf(stderr, "Can't size disk image file: %s\n", strerror(errno));
+	exit(1);
+    }
+    close(out.fd);
+
+    printf("%u of %u clusters used\n", next - CLUST_FIRST, geo.clusters);
+    return errors ? 1 : 0;
+}
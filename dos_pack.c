@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "packed.h"
+#include "stats.h"
+
+
+/* dos_pack packs an image into the chunked, compressed form described
+   in packed.h, which every tool can read as it is, decompressing only
+   the chunks it needs.  With -d it unpacks one again. */
+
+
+static int is_zero(const uint8_t *p, size_t len)
+{
+    return len == 0 || (p[0] == 0 && memcmp(p, p + 1, len - 1) == 0);
+}
+
+static void write_all(int fd, const void *buf, size_t len, off_t offset, char *name)
+{
+    const uint8_t *p = buf;
+    ssize_t n;
+
+    while (len > 0)
+    {
+	STAT_INC(syscalls);
+	n = pwrite(fd, p, len, offset);
+	if (n <= 0)
+	{
+	    fprintf(stderr, "Can't write %s:\n%s\n", name, strerror(errno));
+	    exit(1);
+	}
+	p += n;
+	len -= n;
+	offset += n;
+    }
+}
+
+static void pack(char *in, char *out, uint32_t chunk_size)
+{
+    uint8_t *image_buf, *cbuf, *index, head[PACK_HEADER];
+    uint32_t nchunks, i, counts[3] = { 0, 0, 0 };
+    uint64_t size, offset;
+    size_t want, len;
+    struct stat st;
+    int fd, ofd;
+
+    if (packed_file(in))
+    {
+	fprintf(stderr, "%s is packed already\n", in);
+	exit(1);
+    }
+    if (is_same_file(in, out))
+    {
+	fprintf(stderr, "%s is the image itself\n", out);
+	exit(1);
+    }
+    STAT_INC(syscalls);
+    if (stat(in, &st) < 0)
+    {
+	fprintf(stderr, "Cannot read disk image file %s:\n%s\n", in, strerror(errno));
+	exit(1);
+    }
+    image_buf = mmap_file_readonly(in, &fd);
+    size = st.st_size;
+    nchunks = (size + chunk_size - 1) / chunk_size;
+
+    STAT_INC(syscalls);
+    ofd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (ofd < 0)
+    {
+	fprintf(stderr, "Can't create %s:\n%s\n", out, strerror(errno));
+	exit(1);
+    }
+    cbuf = malloc(chunk_size);
+    index = calloc(nchunks + 1, PACK_ENTRY);
+
+    /* the chunks follow the index, which is written last */
+    offset = PACK_HEADER + (uint64_t)nchunks * PACK_ENTRY;
+    for (i = 0; i < nchunks; i++)
+    {
+	uint8_t *p = image_buf + (size_t)i * chunk_size;
+	uint8_t *e = index + (size_t)i * PACK_ENTRY;
+	uint32_t method;
+
+	want = size - (uint64_t)i * chunk_size < chunk_size
+	    ? size - (uint64_t)i * chunk_size : chunk_size;
+	if (is_zero(p, want))
+	{
+	    method = PACK_ZERO;
+	    len = 0;
+	}
+	else if ((len = lz_compress(p, want, cbuf, want - 1)) > 0)
+	{
+	    method = PACK_LZ;
+	    write_all(ofd, cbuf, len, offset, out);
+	}
+	else
+	{
+	    method = PACK_RAW;
+	    len = want;
+	    write_all(ofd, p, len, offset, out);
+	}
+	putulong(e, (uint32_t)offset);
+	putulong(e + 4, (uint32_t)(offset >> 32));
+	putulong(e + 8, (uint32_t)len);
+	putulong(e + 12, method);
+	counts[method]++;
+	offset += len;
+	STAT_ADD(bytes_copied, want);
+    }
+
+    memcpy(head, PACK_MAGIC, 8);
+    putulong(head + 8, chunk_size);
+    putulong(head + 12, nchunks);
+    putulong(head + 16, (uint32_t)size);
+    putulong(head + 20, (uint32_t)(size >> 32));
+    write_all(ofd, head, PACK_HEADER, 0, out);
+    write_all(ofd, index, (size_t)nchunks * PACK_ENTRY, PACK_HEADER, out);
+    STAT_INC(syscalls);
+    if (close(ofd) < 0)
+    {
+	fprintf(stderr, "Can't write %s:\n%s\n", out, strerror(errno));
+	exit(1);
+    }
+    printf("%u chunks: %u zero, %u compressed, %u stored; %llu -> %llu bytes\n",
+	   nchunks, counts[PACK_ZERO], counts[PACK_LZ], counts[PACK_RAW],
+	   (unsigned long long)size, (unsigned long long)offset);
+
+    free(cbuf);
+    free(index);
+    unmmap_file(image_buf, &fd);
+}
+
+/* unpack reads the packed image through the demand loading, so it is
+   decompressed a chunk at a time */
+static void unpack(char *in, char *out)
+{
+    uint8_t *image_buf;
+    size_t size, done, n;
+    int fd, ofd;
+
+    if (!packed_file(in))
+    {
+	fprintf(stderr, "%s isn't a packed image\n", in);
+	exit(1);
+    }
+    if (is_same_file(in, out))
+    {
+	fprintf(stderr, "%s is the packed image itself\n", out);
+	exit(1);
+    }
+    image_buf = packed_map(in, &fd, &size);
+    STAT_INC(syscalls);
+    ofd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (ofd < 0)
+    {
+	fprintf(stderr, "Can't create %s:\n%s\n", out, strerror(errno));
+	exit(1);
+    }
+    for (done = 0; done < size; done += n)
+    {
+	n = packed_fault_in(image_buf + done, size - done);
+	write_all(ofd, image_buf + done, n, done, out);
+	packed_release(image_buf + done, n);
+	STAT_ADD(bytes_copied, n);
+    }
+    STAT_ADD(syscalls, 2);
+    if (close(ofd) < 0)
+    {
+	fprintf(stderr, "Can't write %s:\n%s\n", out, strerror(errno));
+	exit(1);
+    }
+    packed_unmap(image_buf);
+    close(fd);
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [--stats] [-c chunk_kb] <imagename> <packedname>\n", progname);
+    fprintf(stderr, "\tpacks the image into compressed chunks (%d KB by default)\n",
+	    PACK_CHUNK / 1024);
+    fprintf(stderr, "usage: %s [--stats] -d <packedname> <imagename>\n", progname);
+    fprintf(stderr, "\tunpacks it again\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    uint32_t chunk_size = PACK_CHUNK;
+    long page = sysconf(_SC_PAGESIZE);
+    int unpacking = 0;
+    int opt;
+
+    stats_option(&argc, argv);
+    while ((opt = getopt(argc, argv, "c:d")) != -1)
+    {
+	switch (opt)
+	{
+	case 'c':
+	    chunk_size = atoi(optarg) * 1024;
+	    if (chunk_size == 0 || chunk_size % page != 0 || chunk_size > PACK_MAXCHUNK)
+	    {
+		fprintf(stderr, "The chunk size must be a multiple of %ld KB, "
+			"up to %d KB\n", page / 1024, PACK_MAXCHUNK / 1024);
+		exit(1);
+	    }
+	    break;
+	case 'd':
+	    unpacking = 1;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (argc - optind != 2)
+	usage(argv[0]);
+
+    if (unpacking)
+	unpack(argv[optind], argv[optind + 1]);
+    else
+	pack(argv[optind], argv[optind + 1], chunk_size);
+    return 0;
+}
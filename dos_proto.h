@@ -0,0 +1,71 @@
+#ifndef __DOS_PROTO_H__
+#define __DOS_PROTO_H__
+
+/* The protocol spoken between dos_server and dos_client over a Unix
+   domain socket.
+
+   A client sends a request header followed by reqNameLen bytes
+   holding the image name, the path inside the image and, for
+   DSRV_COPYOUT, the host file to write, each NUL terminated.  The
+   server answers each request with a response header followed by
+   respLength bytes of payload.  A connection may carry any number of
+   requests, one after the other.
+
+   All numbers are in host byte order; both ends are on one machine. */
+
+#include <stdint.h>
+
+#define DSRV_SOCKET "/tmp/dos_server.sock"
+#define DSRV_MAGIC 0x44535256	/* "DSRV" */
+#define DSRV_MAXNAMES 1024	/* longest reqNameLen the server accepts */
+#define DSRV_MAXREAD (1 << 20)	/* longest read served in one response */
+
+enum dsrv_op
+{
+    DSRV_LIST = 1,		/* payload: a dsrv_stat per directory entry */
+    DSRV_STAT,			/* payload: one dsrv_stat */
+    DSRV_READ,			/* payload: the bytes at reqOffset */
+    DSRV_COPYOUT,		/* copy to a host file; payload: none */
+    DSRV_CHECK			/* payload: dsrv_finding records */
+};
+
+struct dsrv_req
+{
+    uint32_t reqMagic;
+    uint8_t reqOp;
+    uint8_t reqPad;
+    uint16_t reqNameLen;
+    uint64_t reqOffset;		/* DSRV_READ only */
+    uint64_t reqLength;
+};
+
+struct dsrv_resp
+{
+    uint32_t respMagic;
+    int32_t respStatus;		/* 0, or an errno value */
+    uint64_t respLength;	/* bytes of payload that follow */
+};
+
+struct dsrv_stat
+{
+    uint32_t stSize;
+    uint32_t stClusters;	/* length of the cluster chain */
+    uint16_t stCluster;		/* first cluster */
+    uint16_t stMTime;		/* DOS format time and date */
+    uint16_t stMDate;
+    uint8_t stAttr;
+    uint8_t stPad;
+    char stName[16];		/* NUL terminated 8.3 name */
+};
+
+/* a check finding: kind is an enum finding_kind from report.h, and
+   fiPathLen bytes of path (no NUL) follow the record */
+struct dsrv_finding
+{
+    uint16_t fiKind;
+    uint16_t fiCluster;
+    uint16_t fiPathLen;
+    uint16_t fiPad;
+};
+
+#endif // __DOS_PROTO_H__
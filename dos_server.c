@@ -0,0 +1,784 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "stats.h"
+#include "bitmap.h"
+#include "report.h"
+#include "dos_proto.h"
+
+
+/* dos_server keeps a set of images open and answers queries about
+   them over a Unix domain socket (see dos_proto.h), so that a client
+   doesn't pay for opening, mapping and parsing an image every time.
+
+   For each image we keep the FAT decoded into an array, and an index
+   of every file and directory sorted by (directory, name), so the
+   entries of one directory sit next to each other and any path can
+   be found with a binary search.  If the image file changes on disk
+   it is re-mapped and re-indexed before the next request. */
+
+struct node
+{
+    const char *dir;		/* parent's path, "" for the root; shared
+				   by all the entries of a directory */
+    struct dsrv_stat st;
+};
+
+struct image
+{
+    char *path;
+    const char *name;		/* the last component of path */
+    int fd;
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+    off_t size;
+    struct timespec mtime;
+    uint32_t clust_size;
+    uint16_t maxclust;
+    uint16_t *fat;		/* decoded FAT, maxclust entries */
+    struct node *nodes;
+    uint32_t nnodes, nalloc;
+    char **dirs;		/* the strings the nodes' dir point to */
+    uint32_t ndirs, dirs_alloc;
+    pthread_rwlock_t lock;
+};
+
+struct server
+{
+    struct image *images;
+    int nimages;
+    const char *socket_path;
+};
+
+static const char *socket_to_remove;
+
+
+/* compare nodes by directory first, then name */
+static int node_cmp(const void *a, const void *b)
+{
+    const struct node *na = a, *nb = b;
+    int rv = strcmp(na->dir, nb->dir);
+
+    return rv ? rv : strcmp(na->st.stName, nb->st.stName);
+}
+
+/* chain_clusters counts a chain in the decoded FAT */
+static uint32_t chain_clusters(struct image *img, uint16_t cluster)
+{
+    uint32_t n = 0;
+
+    while (cluster >= CLUST_FIRST && cluster < img->maxclust && n < img->maxclust)
+    {
+	n++;
+	cluster = img->fat[cluster];
+    }
+    return n;
+}
+
+
+/* the paths of the directories above the entry being indexed, by
+   depth; each is the one copy its entries' nodes point to */
+struct index_walk
+{
+    struct image *img;
+    const char *dirs[WALK_MAXDEPTH + 1];
+};
+
+static int index_dirent(struct direntry *dirent, const char *path, int depth, void *arg)
+{
+    struct index_walk *w = arg;
+    struct image *img = w->img;
+    struct node *n;
+    char *dir;
+
+    if (img->nnodes == img->nalloc)
+    {
+	img->nalloc = img->nalloc ? img->nalloc * 2 : 256;
+	img->nodes = realloc(img->nodes, img->nalloc * sizeof(struct node));
+	if (img->nodes == NULL)
+	{
+	    fprintf(stderr, "Out of memory indexing %s\n", img->path);
+	    exit(1);
+	}
+    }
+    n = &img->nodes[img->nnodes++];
+    memset(n, 0, sizeof(*n));
+    n->dir = w->dirs[depth];
+    get_dirent_name(dirent, n->st.stName);
+    n->st.stSize = getulong(dirent->deFileSize);
+    n->st.stCluster = getushort(dirent->deStartCluster);
+    n->st.stClusters = chain_clusters(img, n->st.stCluster);
+    n->st.stMTime = getushort(dirent->deMTime);
+    n->st.stMDate = getushort(dirent->deMDate);
+    n->st.stAttr = dirent->deAttributes;
+
+    /* one copy of a directory's path for all the entries in it */
+    if (dirent->deAttributes & ATTR_DIRECTORY)
+    {
+	if (img->ndirs == img->dirs_alloc)
+	{
+	    img->dirs_alloc = img->dirs_alloc ? img->dirs_alloc * 2 : 64;
+	    img->dirs = realloc(img->dirs, img->dirs_alloc * sizeof(char *));
+	}
+	if (img->dirs == NULL || (dir = strdup(path)) == NULL)
+	{
+	    fprintf(stderr, "Out of memory indexing %s\n", img->path);
+	    exit(1);
+	}
+	img->dirs[img->ndirs++] = dir;
+	w->dirs[depth + 1] = dir;
+    }
+    return 0;
+}
+
+
+static void unload_image(struct image *img);
+
+/* load_image maps the image and builds the FAT array and index */
+static int load_image(struct image *img)
+{
+    struct stat st;
+    struct index_walk w;
+    uint16_t c;
+
+    if (fstat(img->fd, &st) < 0 || st.st_size < 512)
+    {
+	fprintf(stderr, "Can't use image %s\n", img->path);
+	return -1;
+    }
+    img->image_buf = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, img->fd, 0);
+    if (img->image_buf == MAP_FAILED)
+    {
+	fprintf(stderr, "Failed to memory map %s: %s\n", img->path, strerror(errno));
+	img->image_buf = NULL;
+	return -1;
+    }
+    img->size = st.st_size;
+    img->mtime = st.st_mtim;
+    img->bpb = check_bootsector(img->image_buf);
+
+    /* Everything below only looks at clusters under maxclust, so if
+       the file holds all the sectors the boot sector claims and the
+       metadata ahead of them, no request can read past the map. */
+    if (img->bpb->bpbBytesPerSec == 0 || img->bpb->bpbSecPerClust == 0
+	|| (uint64_t)img->bpb->bpbSectors * img->bpb->bpbBytesPerSec > (uint64_t)st.st_size
+	|| root_dir_addr(img->image_buf, img->bpb) - img->image_buf
+	   + img->bpb->bpbRootDirEnts * sizeof(struct direntry) > (uint64_t)st.st_size)
+    {
+	fprintf(stderr, "Image %s is shorter than its boot sector says\n", img->path);
+	unload_image(img);
+	return -1;
+    }
+    img->clust_size = img->bpb->bpbBytesPerSec * img->bpb->bpbSecPerClust;
+    img->maxclust = get_cluster_count(img->bpb);
+
+    img->fat = malloc(img->maxclust * sizeof(uint16_t));
+    if (img->fat == NULL)
+    {
+	fprintf(stderr, "Out of memory loading %s\n", img->path);
+	exit(1);
+    }
+    for (c = 0; c < img->maxclust; c++)
+	img->fat[c] = get_fat_entry(c, img->image_buf, img->bpb);
+
+    img->nnodes = 0;
+    w.img = img;
+    w.dirs[0] = "";
+    walk_tree(MSDOSFSROOT, "", img->image_buf, img->bpb, index_dirent, &w);
+    qsort(img->nodes, img->nnodes, sizeof(struct node), node_cmp);
+    dos_debug(1, "%s: %u entries indexed\n", img->path, img->nnodes);
+    return 0;
+}
+
+static void unload_image(struct image *img)
+{
+    if (img->image_buf != NULL)
+	munmap(img->image_buf, img->size);
+    img->image_buf = NULL;
+    free(img->bpb);
+    img->bpb = NULL;
+    free(img->fat);
+    img->fat = NULL;
+    while (img->ndirs > 0)
+	free(img->dirs[--img->ndirs]);
+}
+
+/* refresh_image re-loads an image that changed on disk.  Called with
+   the read lock held, and returns with it held. */
+static int refresh_image(struct image *img)
+{
+    struct stat st;
+    int rv = 0;
+
+    if (fstat(img->fd, &st) == 0 && img->image_buf != NULL
+	&& st.st_size == img->size
+	&& st.st_mtim.tv_sec == img->mtime.tv_sec
+	&& st.st_mtim.tv_nsec == img->mtime.tv_nsec)
+	return 0;
+
+    pthread_rwlock_unlock(&img->lock);
+    pthread_rwlock_wrlock(&img->lock);
+    /* someone else may have got here first */
+    if (fstat(img->fd, &st) < 0 || img->image_buf == NULL
+	|| st.st_size != img->size
+	|| st.st_mtim.tv_sec != img->mtime.tv_sec
+	|| st.st_mtim.tv_nsec != img->mtime.tv_nsec)
+    {
+	unload_image(img);
+	rv = load_image(img);
+    }
+    pthread_rwlock_unlock(&img->lock);
+    pthread_rwlock_rdlock(&img->lock);
+    return img->image_buf ? 0 : rv;
+}
+
+
+/* find_node looks a path up in the index.  The path is upper-cased
+   and split into directory and name in place.  Returns NULL for the
+   root directory, with *err set to 0, or for a missing path with
+   *err set to ENOENT. */
+static struct node *find_node(struct image *img, char *path, int *err)
+{
+    struct node key, *n;
+    char dir[MAXPATHLEN], *p, *slash;
+
+    for (p = path; *p; p++)
+	*p = toupper((unsigned char)*p);
+    /* drop trailing slashes, and make sure there's a leading one */
+    while (p > path && p[-1] == '/')
+	*--p = '\0';
+    *err = 0;
+    if (path[0] == '\0')
+	return NULL;
+
+    slash = strrchr(path, '/');
+    memset(&key, 0, sizeof(key));
+    key.dir = "";
+    if (slash == NULL)
+    {
+	snprintf(key.st.stName, sizeof(key.st.stName), "%s", path);
+    }
+    else
+    {
+	*slash = '\0';
+	if (path[0] != '\0' && path[0] != '/')
+	    snprintf(dir, sizeof(dir), "/%s", path);
+	else
+	    snprintf(dir, sizeof(dir), "%s", path);
+	key.dir = dir;
+	snprintf(key.st.stName, sizeof(key.st.stName), "%s", slash + 1);
+    }
+    n = bsearch(&key, img->nodes, img->nnodes, sizeof(struct node), node_cmp);
+    if (n == NULL)
+	*err = ENOENT;
+    return n;
+}
+
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    ssize_t n;
+
+    while (len > 0)
+    {
+	n = write(fd, p, len);
+	if (n < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	STAT_INC(syscalls);
+	p += n;
+	len -= n;
+    }
+    return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    ssize_t n;
+
+    while (len > 0)
+    {
+	n = read(fd, p, len);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return -1;
+	STAT_INC(syscalls);
+	p += n;
+	len -= n;
+    }
+    return 0;
+}
+
+static int send_resp(int fd, int status, const void *payload, uint64_t len)
+{
+    struct dsrv_resp resp;
+
+    resp.respMagic = DSRV_MAGIC;
+    resp.respStatus = status;
+    resp.respLength = status ? 0 : len;
+    if (write_full(fd, &resp, sizeof(resp)) < 0)
+	return -1;
+    if (status == 0 && len > 0)
+	return write_full(fd, payload, len);
+    return 0;
+}
+
+
+/* copy_range writes len bytes of a file starting at offset to fd,
+   a run of contiguous clusters at a time, straight out of the map.
+   A chain that ends early or leaves the image fails with EIO. */
+static int copy_range(struct image *img, struct node *n,
+		      uint32_t offset, uint32_t len, int fd)
+{
+    uint16_t cluster = n->st.stCluster;
+    uint32_t skip = offset / img->clust_size;
+    uint32_t within = offset % img->clust_size;
+    uint32_t run, bytes;
+    uint16_t start;
+    uint8_t *src;
+
+    while (skip-- > 0 && cluster >= CLUST_FIRST && cluster < img->maxclust)
+	cluster = img->fat[cluster];
+
+    while (len > 0)
+    {
+	if (cluster < CLUST_FIRST || cluster >= img->maxclust)
+	{
+	    errno = EIO;
+	    return -1;
+	}
+	for (start = cluster, run = 1;
+	     img->fat[cluster] == cluster + 1 && run * img->clust_size < within + len;
+	     run++)
+	    cluster++;
+	cluster = img->fat[cluster];
+
+	bytes = run * img->clust_size - within;
+	if (bytes > len)
+	    bytes = len;
+	src = cluster_to_addr(start, img->image_buf, img->bpb) + within;
+	if (src + bytes > img->image_buf + img->size)
+	{
+	    errno = EIO;
+	    return -1;
+	}
+	if (write_full(fd, src, bytes) < 0)
+	    return -1;
+	STAT_ADD(bytes_copied, bytes);
+	within = 0;
+	len -= bytes;
+    }
+    return 0;
+}
+
+
+static int do_list(int fd, struct image *img, char *path)
+{
+    struct node key, *n, *end = img->nodes + img->nnodes;
+    struct dsrv_stat *out;
+    char dir[MAXPATHLEN];
+    uint32_t count = 0, lo = 0, hi = img->nnodes, mid;
+    int err, rv;
+
+    n = find_node(img, path, &err);
+    if (err)
+	return send_resp(fd, err, NULL, 0);
+    if (n != NULL && !(n->st.stAttr & ATTR_DIRECTORY))
+	return send_resp(fd, 0, &n->st, sizeof(n->st));
+
+    /* the directory's entries start at the first node >= (dir, "") */
+    memset(&key, 0, sizeof(key));
+    dir[0] = '\0';
+    if (n != NULL && strlen(n->dir) + strlen(n->st.stName) + 2 <= MAXPATHLEN)
+    {
+	strcpy(dir, n->dir);
+	strcat(dir, "/");
+	strcat(dir, n->st.stName);
+    }
+    key.dir = dir;
+    while (lo < hi)
+    {
+	mid = (lo + hi) / 2;
+	if (node_cmp(&img->nodes[mid], &key) < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    for (n = img->nodes + lo; n < end && strcmp(n->dir, key.dir) == 0; n++)
+	count++;
+
+    out = malloc(count * sizeof(struct dsrv_stat) + 1);
+    if (out == NULL)
+	return send_resp(fd, ENOMEM, NULL, 0);
+    for (mid = 0; mid < count; mid++)
+	out[mid] = img->nodes[lo + mid].st;
+    rv = send_resp(fd, 0, out, count * sizeof(struct dsrv_stat));
+    free(out);
+    return rv;
+}
+
+static int do_stat(int fd, struct image *img, char *path)
+{
+    struct dsrv_stat root;
+    struct node *n;
+    int err;
+
+    n = find_node(img, path, &err);
+    if (err)
+	return send_resp(fd, err, NULL, 0);
+    if (n == NULL)
+    {
+	memset(&root, 0, sizeof(root));
+	root.stAttr = ATTR_DIRECTORY;
+	strcpy(root.stName, "/");
+	return send_resp(fd, 0, &root, sizeof(root));
+    }
+    return send_resp(fd, 0, &n->st, sizeof(n->st));
+}
+
+static int do_read(int fd, struct image *img, char *path, struct dsrv_req *req)
+{
+    struct dsrv_resp resp;
+    struct node *n;
+    uint64_t len = req->reqLength;
+    int err;
+
+    n = find_node(img, path, &err);
+    if (n == NULL)
+	return send_resp(fd, err ? err : EISDIR, NULL, 0);
+    if (n->st.stAttr & ATTR_DIRECTORY)
+	return send_resp(fd, EISDIR, NULL, 0);
+
+    if (req->reqOffset >= n->st.stSize)
+	len = 0;
+    else if (len > n->st.stSize - req->reqOffset)
+	len = n->st.stSize - req->reqOffset;
+    if (len > DSRV_MAXREAD)
+	len = DSRV_MAXREAD;
+    if (len > 0 && (uint64_t)n->st.stClusters * img->clust_size < req->reqOffset + len)
+	return send_resp(fd, EIO, NULL, 0);
+
+    resp.respMagic = DSRV_MAGIC;
+    resp.respStatus = 0;
+    resp.respLength = len;
+    if (write_full(fd, &resp, sizeof(resp)) < 0)
+	return -1;
+    return copy_range(img, n, req->reqOffset, len, fd);
+}
+
+static int do_copyout(int fd, struct image *img, char *path, char *dest)
+{
+    struct node *n;
+    int err, out;
+
+    n = find_node(img, path, &err);
+    if (n == NULL)
+	return send_resp(fd, err ? err : EISDIR, NULL, 0);
+    if (n->st.stAttr & ATTR_DIRECTORY)
+	return send_resp(fd, EISDIR, NULL, 0);
+    if (dest[0] != '/')
+	return send_resp(fd, EINVAL, NULL, 0);
+    if ((uint64_t)n->st.stClusters * img->clust_size < n->st.stSize)
+	return send_resp(fd, EIO, NULL, 0);
+
+    out = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0)
+	return send_resp(fd, errno, NULL, 0);
+    err = copy_range(img, n, 0, n->st.stSize, out) < 0 ? errno : 0;
+    if (close(out) < 0 && err == 0)
+	err = errno;
+    return send_resp(fd, err, NULL, 0);
+}
+
+
+/* add_finding appends one finding to a growing buffer */
+static void add_finding(uint8_t **buf, uint64_t *len, uint64_t *alloc,
+			int kind, uint16_t cluster, struct node *n)
+{
+    struct dsrv_finding fi;
+    char path[MAXPATHLEN + sizeof(n->st.stName) + 1];
+
+    path[0] = '\0';
+    if (n != NULL)
+	snprintf(path, sizeof(path), "%s/%s", n->dir, n->st.stName);
+    fi.fiKind = kind;
+    fi.fiCluster = cluster;
+    fi.fiPathLen = strlen(path);
+    fi.fiPad = 0;
+
+    if (*len + sizeof(fi) + fi.fiPathLen > *alloc)
+    {
+	*alloc = (*alloc + sizeof(fi) + fi.fiPathLen) * 2;
+	*buf = realloc(*buf, *alloc);
+	if (*buf == NULL)
+	{
+	    fprintf(stderr, "Out of memory\n");
+	    exit(1);
+	}
+    }
+    memcpy(*buf + *len, &fi, sizeof(fi));
+    memcpy(*buf + *len + sizeof(fi), path, fi.fiPathLen);
+    *len += sizeof(fi) + fi.fiPathLen;
+}
+
+/* do_check finds the same problems scandisk does, from the cached
+   FAT and index, without repairing anything */
+static int do_check(int fd, struct image *img)
+{
+    struct bitmap *ref = bitmap_create(img->maxclust);
+    struct node *n;
+    uint8_t *buf = NULL;
+    uint64_t len = 0, alloc = 0;
+    uint32_t i, count, needed;
+    uint16_t c;
+    int rv;
+
+    for (i = 0; i < img->nnodes; i++)
+    {
+	n = &img->nodes[i];
+	for (c = n->st.stCluster, count = 0;
+	     c >= CLUST_FIRST && c < img->maxclust && count < img->maxclust;
+	     c = img->fat[c], count++)
+	{
+	    bitmap_set(ref, c);
+	    if (img->fat[c] == (FAT12_MASK & CLUST_BAD))
+	    {
+		add_finding(&buf, &len, &alloc, FIND_BAD_CLUSTER, c, n);
+		break;
+	    }
+	}
+	if (n->st.stAttr & ATTR_DIRECTORY)
+	    continue;
+	needed = (n->st.stSize + img->clust_size - 1) / img->clust_size;
+	if (n->st.stClusters > needed)
+	    add_finding(&buf, &len, &alloc, FIND_MISSING_BLOCK, n->st.stCluster, n);
+	else if (n->st.stClusters < needed)
+	    add_finding(&buf, &len, &alloc, FIND_EXCESS_BLOCKS, n->st.stCluster, n);
+    }
+
+    for (c = CLUST_FIRST; c < img->maxclust; c++)
+	if (img->fat[c] != (FAT12_MASK & CLUST_FREE)
+	    && img->fat[c] != (FAT12_MASK & CLUST_BAD) && !bitmap_test(ref, c))
+	    add_finding(&buf, &len, &alloc, FIND_ORPHAN, c, NULL);
+
+    rv = send_resp(fd, 0, buf, len);
+    free(buf);
+    bitmap_free(ref);
+    return rv;
+}
+
+
+static struct image *find_image(struct server *srv, const char *name)
+{
+    int i;
+
+    for (i = 0; i < srv->nimages; i++)
+	if (strcmp(srv->images[i].path, name) == 0
+	    || strcmp(srv->images[i].name, name) == 0)
+	    return &srv->images[i];
+    return NULL;
+}
+
+/* handle_request reads and answers one request; returns -1 when the
+   connection should be closed */
+static int handle_request(struct server *srv, int fd)
+{
+    struct dsrv_req req;
+    struct image *img;
+    char names[DSRV_MAXNAMES + 3];
+    char *path, *dest;
+    int rv;
+
+    if (read_full(fd, &req, sizeof(req)) < 0)
+	return -1;
+    if (req.reqMagic != DSRV_MAGIC || req.reqNameLen > DSRV_MAXNAMES)
+	return -1;
+    memset(names, 0, sizeof(names));
+    if (read_full(fd, names, req.reqNameLen) < 0)
+	return -1;
+    path = names + strlen(names) + 1;
+    dest = path + strlen(path) + 1;
+
+    img = find_image(srv, names);
+    if (img == NULL)
+	return send_resp(fd, ENODEV, NULL, 0);
+
+    pthread_rwlock_rdlock(&img->lock);
+    if (refresh_image(img) < 0)
+    {
+	pthread_rwlock_unlock(&img->lock);
+	return send_resp(fd, EIO, NULL, 0);
+    }
+    switch (req.reqOp)
+    {
+    case DSRV_LIST:
+	rv = do_list(fd, img, path);
+	break;
+    case DSRV_STAT:
+	rv = do_stat(fd, img, path);
+	break;
+    case DSRV_READ:
+	rv = do_read(fd, img, path, &req);
+	break;
+    case DSRV_COPYOUT:
+	rv = do_copyout(fd, img, path, dest);
+	break;
+    case DSRV_CHECK:
+	rv = do_check(fd, img);
+	break;
+    default:
+	rv = send_resp(fd, EINVAL, NULL, 0);
+    }
+    pthread_rwlock_unlock(&img->lock);
+    return rv;
+}
+
+
+struct client
+{
+    struct server *srv;
+    int fd;
+};
+
+static void *client_thread(void *arg)
+{
+    struct client *cl = arg;
+
+    while (handle_request(cl->srv, cl->fd) == 0)
+	;
+    close(cl->fd);
+    free(cl);
+    stats_flush();
+    return NULL;
+}
+
+static void remove_socket(int sig)
+{
+    if (socket_to_remove != NULL)
+	unlink(socket_to_remove);
+    _exit(0);
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [--stats] [--verbose] [-s socket] <imagename>...\n", progname);
+    fprintf(stderr, "\t-s socket  listen here (default %s)\n", DSRV_SOCKET);
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    struct server srv;
+    struct sockaddr_un addr;
+    struct client *cl;
+    pthread_t tid;
+    int opt, i, lfd, fd;
+
+    stats_option(&argc, argv);
+    report_option(&argc, argv);
+    memset(&srv, 0, sizeof(srv));
+    srv.socket_path = DSRV_SOCKET;
+    while ((opt = getopt(argc, argv, "s:")) != -1)
+    {
+	switch (opt)
+	{
+	case 's':
+	    srv.socket_path = optarg;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (optind >= argc)
+	usage(argv[0]);
+
+    srv.nimages = argc - optind;
+    srv.images = calloc(srv.nimages, sizeof(struct image));
+    for (i = 0; i < srv.nimages; i++)
+    {
+	struct image *img = &srv.images[i];
+
+	img->path = argv[optind + i];
+	img->name = strrchr(img->path, '/') ? strrchr(img->path, '/') + 1 : img->path;
+	img->fd = open(img->path, O_RDONLY);
+	if (img->fd < 0 || load_image(img) < 0)
+	{
+	    fprintf(stderr, "Cannot open disk image file %s\n", img->path);
+	    exit(1);
+	}
+	pthread_rwlock_init(&img->lock, NULL);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(srv.socket_path) >= sizeof(addr.sun_path))
+    {
+	fprintf(stderr, "Socket path too long: %s\n", srv.socket_path);
+	exit(1);
+    }
+    strcpy(addr.sun_path, srv.socket_path);
+    lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(srv.socket_path);
+    /* only our own user gets to talk to us */
+    umask(077);
+    if (lfd < 0 || bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) < 0
+	|| listen(lfd, 64) < 0)
+    {
+	fprintf(stderr, "Can't listen on %s: %s\n", srv.socket_path, strerror(errno));
+	exit(1);
+    }
+    socket_to_remove = srv.socket_path;
+    signal(SIGINT, remove_socket);
+    signal(SIGTERM, remove_socket);
+    signal(SIGPIPE, SIG_IGN);
+    dos_debug(1, "serving %d images on %s\n", srv.nimages, srv.socket_path);
+
+    while (1)
+    {
+	fd = accept(lfd, NULL, NULL);
+	if (fd < 0)
+	{
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    fprintf(stderr, "accept failed: %s\n", strerror(errno));
+	    exit(1);
+	}
+	cl = malloc(sizeof(struct client));
+	cl->srv = &srv;
+	cl->fd = fd;
+	if (pthread_create(&tid, NULL, client_thread, cl) != 0)
+	{
+	    close(fd);
+	    free(cl);
+	    continue;
+	}
+	pthread_detach(tid);
+    }
+    return 0;
+}
@@ -0,0 +1,263 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "packed.h"
+#include "stats.h"
+
+
+/* dos_sparse makes an image take up only as much disk as the data in
+   it.  Every data cluster the FAT marks free has its blocks given
+   back to the host filesystem with fallocate(PUNCH_HOLE), a run of
+   free clusters at a time; they then read as zeroes.  With -z only
+   free clusters that are already all zeroes are punched, so nothing
+   left behind in a free cluster is lost.
+
+   With -o it leaves the image alone and writes a sparse copy instead:
+   free clusters and any sector of zeroes become holes, and the data
+   in between goes out one write per run, so cp --sparse, tar -S and
+   anything else that uses SEEK_DATA/SEEK_HOLE only sees the data. */
+
+
+static int is_zero(const uint8_t *p, size_t len)
+{
+    return len == 0 || (p[0] == 0 && memcmp(p, p + 1, len - 1) == 0);
+}
+
+/* keep says whether free cluster c has to be kept: only with -z, and
+   only if something is left in it */
+static int keep_free(uint16_t c, int zero_only, uint8_t *image_buf, struct bpb33 *bpb)
+{
+    if (!zero_only)
+	return 0;
+    return !is_zero(cluster_to_addr(c, image_buf, bpb),
+		    bpb->bpbBytesPerSec * bpb->bpbSecPerClust);
+}
+
+static int is_free(uint16_t c, uint8_t *image_buf, struct bpb33 *bpb)
+{
+    return get_fat_entry(c, image_buf, bpb) == (FAT12_MASK & CLUST_FREE);
+}
+
+static uint64_t disk_usage(int fd)
+{
+    struct stat st;
+
+    STAT_INC(syscalls);
+    if (fstat(fd, &st) < 0)
+	return 0;
+    return (uint64_t)st.st_blocks * 512;
+}
+
+
+/* punch gives back the free clusters of the image in place */
+static void punch(int fd, int zero_only, uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t data = cluster_to_addr(CLUST_FIRST, image_buf, bpb) - image_buf;
+    uint16_t maxclust = get_cluster_count(bpb);
+    uint32_t punched = 0, kept = 0, runs = 0;
+    uint64_t before = disk_usage(fd);
+    uint16_t c, first;
+
+    for (c = CLUST_FIRST; c < maxclust; )
+    {
+	if (!is_free(c, image_buf, bpb))
+	{
+	    c++;
+	    continue;
+	}
+	if (keep_free(c, zero_only, image_buf, bpb))
+	{
+	    kept++;
+	    c++;
+	    continue;
+	}
+	for (first = c; c < maxclust && is_free(c, image_buf, bpb)
+		 && !keep_free(c, zero_only, image_buf, bpb); c++)
+	    ;
+	STAT_INC(syscalls);
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      data + (off_t)(first - CLUST_FIRST) * clust_size,
+		      (off_t)(c - first) * clust_size) < 0)
+	{
+	    fprintf(stderr, "Can't punch holes in the image:\n%s\n", strerror(errno));
+	    exit(1);
+	}
+	punched += c - first;
+	runs++;
+    }
+    printf("punched %u free clusters (%u bytes) in %u runs\n",
+	   punched, punched * clust_size, runs);
+    if (kept > 0)
+	printf("kept %u free clusters that weren't zero\n", kept);
+    printf("disk usage %llu -> %llu bytes\n", (unsigned long long)before,
+	   (unsigned long long)disk_usage(fd));
+}
+
+
+/* is_hole says whether sector s of the image can be left out of a
+   sparse copy */
+static int is_hole(uint32_t s, int zero_only, uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint32_t data_sec = (cluster_to_addr(CLUST_FIRST, image_buf, bpb) - image_buf)
+	/ bpb->bpbBytesPerSec;
+    uint16_t c;
+
+    if (s >= data_sec)
+    {
+	c = (s - data_sec) / bpb->bpbSecPerClust + CLUST_FIRST;
+	if (c < get_cluster_count(bpb) && is_free(c, image_buf, bpb) && !zero_only)
+	    return 1;
+    }
+    return is_zero(image_buf + (size_t)s * bpb->bpbBytesPerSec, bpb->bpbBytesPerSec);
+}
+
+/* export writes a sparse copy of the image to out */
+static void export(char *out, uint64_t size, int zero_only, uint8_t *image_buf,
+		   struct bpb33 *bpb)
+{
+    uint32_t sec = bpb->bpbBytesPerSec;
+    uint32_t nsectors = size / sec, s, first, written = 0, runs = 0;
+    ssize_t n;
+    size_t len, done, pinned;
+    uint8_t *p;
+    int fd;
+
+    STAT_INC(syscalls);
+    fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+    {
+	fprintf(stderr, "Can't create %s:\n%s\n", out, strerror(errno));
+	exit(1);
+    }
+
+    for (s = 0; s < nsectors; )
+    {
+	if (is_hole(s, zero_only, image_buf, bpb))
+	{
+	    s++;
+	    continue;
+	}
+	for (first = s; s < nsectors && !is_hole(s, zero_only, image_buf, bpb); s++)
+	    ;
+	len = (size_t)(s - first) * sec;
+	for (done = 0; done < len; done += n)
+	{
+	    p = image_buf + (size_t)first * sec + done;
+	    pinned = packed_fault_in(p, len - done);
+	    STAT_INC(syscalls);
+	    n = pwrite(fd, p, pinned, (off_t)first * sec + done);
+	    packed_release(p, pinned);
+	    if (n <= 0)
+	    {
+		fprintf(stderr, "Can't write %s:\n%s\n", out, strerror(errno));
+		exit(1);
+	    }
+	}
+	STAT_ADD(bytes_copied, len);
+	written += s - first;
+	runs++;
+    }
+
+    /* the tail of the image past the last whole sector, and the holes
+       at the end, come from setting the size */
+    if (size % sec != 0)
+    {
+	p = image_buf + (size_t)nsectors * sec;
+	pinned = packed_fault_in(p, size % sec);
+	STAT_INC(syscalls);
+	n = pwrite(fd, p, pinned, (off_t)nsectors * sec);
+	packed_release(p, pinned);
+	if (n < 0)
+	{
+	    fprintf(stderr, "Can't write %s:\n%s\n", out, strerror(errno));
+	    exit(1);
+	}
+    }
+    STAT_ADD(syscalls, 2);
+    if (ftruncate(fd, size) < 0 || close(fd) < 0)
+    {
+	fprintf(stderr, "Can't write %s:\n%s\n", out, strerror(errno));
+	exit(1);
+    }
+    printf("wrote %u of %u sectors (%llu bytes) in %u runs\n", written, nsectors,
+	   (unsigned long long)written * sec, runs);
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [--stats] [-z] [-o sparsecopy] <imagename>\n", progname);
+    fprintf(stderr, "\tpunches holes in the image where its clusters are free\n");
+    fprintf(stderr, "\t-z only where the free clusters are already zeroes\n");
+    fprintf(stderr, "\t-o leaves the image alone and writes a sparse copy\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd;
+    struct bpb33* bpb;
+    char *out = NULL;
+    int zero_only = 0;
+    int opt;
+
+    stats_option(&argc, argv);
+    while ((opt = getopt(argc, argv, "zo:")) != -1)
+    {
+	switch (opt)
+	{
+	case 'z':
+	    zero_only = 1;
+	    break;
+	case 'o':
+	    out = optarg;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (argc - optind != 1)
+	usage(argv[0]);
+
+    /* a packed image can be exported, but its free space takes up
+       nothing already */
+    if (out == NULL && packed_file(argv[optind]))
+    {
+	fprintf(stderr, "%s is packed; use -o to write a sparse copy\n", argv[optind]);
+	exit(1);
+    }
+    if (out != NULL && is_same_file(out, argv[optind]))
+    {
+	fprintf(stderr, "%s is the image itself\n", out);
+	exit(1);
+    }
+    /* an export only reads the image, so it needn't be writable */
+    if (out != NULL)
+	image_buf = mmap_file_readonly(argv[optind], &fd);
+    else
+	image_buf = mmap_file(argv[optind], &fd);
+    bpb = check_bootsector(image_buf);
+
+    if (out != NULL)
+	export(out, mmap_size(), zero_only, image_buf, bpb);
+    else
+	punch(fd, zero_only, image_buf, bpb);
+
+    unmmap_file(image_buf, &fd);
+    return 0;
+}
@@ -0,0 +1,590 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "dos_file.h"
+#include "stats.h"
+#include "crc32c.h"
+
+
+/* dos_sum prints the CRC32C of every file in an image, computed over
+   the file's extents straight out of the mapped image, in the form
+
+	e3069283  /DIR/FILE.TXT
+
+   With -c it instead checks the files listed in such a manifest, and
+   reports any that are missing or don't match.  The work is shared
+   out between threads, a file at a time.
+
+   With -d it looks for duplicated content instead: every allocated
+   cluster is hashed, in parallel over ranges of clusters, and
+   clusters with the same hash are compared byte for byte.  We report
+   how many clusters are redundant, files that are exact copies of
+   each other, and the longest runs of clusters in other files whose
+   content is found elsewhere on the disk. */
+
+struct sum_job
+{
+    char *path;
+    struct direntry *dirent;	/* NULL if it isn't in the image */
+    uint32_t expected;
+    uint32_t crc;
+};
+
+struct sum_queue
+{
+    struct sum_job *jobs;
+    int count, alloc;
+    int next;			/* claimed with an atomic add */
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+};
+
+/* per-cluster results of the dedup hashing */
+struct dedup
+{
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+    uint32_t clust_size;
+    uint16_t maxclust;
+    uint64_t *hash;		/* 0 for clusters that aren't allocated */
+    uint16_t *canon;		/* lowest cluster with the same bytes, or 0 */
+    uint16_t *copies;		/* clusters sharing a canon, indexed by canon */
+    int next;			/* next range of clusters to hash */
+};
+
+#define DEDUP_RANGE 256		/* clusters a thread hashes at a time */
+
+static struct sum_job *add_job(struct sum_queue *queue, const char *path)
+{
+    struct sum_job *job;
+
+    if (queue->count == queue->alloc)
+    {
+	queue->alloc = queue->alloc ? queue->alloc * 2 : 256;
+	queue->jobs = realloc(queue->jobs, queue->alloc * sizeof(struct sum_job));
+	if (queue->jobs == NULL)
+	{
+	    fprintf(stderr, "Out of memory\n");
+	    exit(1);
+	}
+    }
+    job = &queue->jobs[queue->count++];
+    memset(job, 0, sizeof(*job));
+    job->path = strdup(path);
+    return job;
+}
+
+static int collect_dirent(struct direntry *dirent, const char *path, int depth, void *arg)
+{
+    (void)depth;
+    if ((dirent->deAttributes & ATTR_DIRECTORY) == 0)
+	add_job(arg, path)->dirent = dirent;
+    return 0;
+}
+
+/* read_manifest reads "crc  path" lines, as dos_sum prints them */
+static void read_manifest(char *manifest, struct sum_queue *queue)
+{
+    char line[MAXPATHLEN + 32], path[MAXPATHLEN + 1];
+    struct sum_job *job;
+    unsigned int crc;
+    int lineno = 0;
+    FILE *mf;
+
+    STAT_INC(syscalls);
+    mf = fopen(manifest, "r");
+    if (mf == NULL)
+    {
+	fprintf(stderr, "Can't open manifest %s\n", manifest);
+	exit(1);
+    }
+    while (fgets(line, sizeof(line), mf) != NULL)
+    {
+	lineno++;
+	if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+	    continue;
+	if (sscanf(line, "%x %255s", &crc, path) != 2)
+	{
+	    fprintf(stderr, "%s:%d: expected a checksum and a path\n", manifest, lineno);
+	    exit(1);
+	}
+	job = add_job(queue, path);
+	job->expected = crc;
+	job->dirent = find_path(path, queue->image_buf, queue->bpb);
+	if (job->dirent != NULL && (job->dirent->deAttributes & ATTR_DIRECTORY))
+	    job->dirent = NULL;
+    }
+    fclose(mf);
+}
+
+
+/* sum_file checksums one file, a run of contiguous clusters at a time */
+static uint32_t sum_file(struct direntry *dirent, uint8_t *image_buf,
+			 struct bpb33 *bpb)
+{
+    struct dos_file *f = dos_open_dirent(dirent, image_buf, bpb);
+    const uint8_t *p;
+    uint32_t offset, n, crc = 0;
+
+    for (offset = 0; offset < f->mapped; offset += n)
+    {
+	n = f->mapped - offset;
+	p = dos_map(f, offset, &n);
+	crc = crc32c(crc, p, n);
+	STAT_ADD(bytes_copied, n);
+    }
+    if (f->mapped < f->size)
+	fprintf(stderr, "Bad file termination\n");
+    dos_close(f);
+    return crc;
+}
+
+static void *sum_worker(void *arg)
+{
+    struct sum_queue *queue = arg;
+    struct sum_job *job;
+    int i;
+
+    while ((i = __sync_fetch_and_add(&queue->next, 1)) < queue->count)
+    {
+	job = &queue->jobs[i];
+	if (job->dirent != NULL)
+	    job->crc = sum_file(job->dirent, queue->image_buf, queue->bpb);
+    }
+    stats_flush();
+    return NULL;
+}
+
+static void run_workers(struct sum_queue *queue, int nthreads)
+{
+    pthread_t *threads;
+    int i;
+
+    if (nthreads > queue->count)
+	nthreads = queue->count;
+    if (nthreads < 1)
+	nthreads = 1;
+    threads = malloc(nthreads * sizeof(pthread_t));
+    for (i = 0; i < nthreads; i++)
+    {
+	if (pthread_create(&threads[i], NULL, sum_worker, queue) != 0)
+	{
+	    /* carry on with the workers we did get */
+	    nthreads = i;
+	    break;
+	}
+    }
+    if (nthreads == 0)
+	sum_worker(queue);
+    for (i = 0; i < nthreads; i++)
+	pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+
+static int is_allocated(uint16_t cluster, struct dedup *dd)
+{
+    uint16_t value = get_fat_entry(cluster, dd->image_buf, dd->bpb);
+
+    return value != (FAT12_MASK & CLUST_FREE) && value != (FAT12_MASK & CLUST_BAD);
+}
+
+static void *hash_worker(void *arg)
+{
+    struct dedup *dd = arg;
+    uint32_t lo, hi, c;
+
+    while ((lo = __sync_fetch_and_add(&dd->next, DEDUP_RANGE)) < dd->maxclust)
+    {
+	hi = lo + DEDUP_RANGE < dd->maxclust ? lo + DEDUP_RANGE : dd->maxclust;
+	for (c = lo < CLUST_FIRST ? CLUST_FIRST : lo; c < hi; c++)
+	{
+	    if (!is_allocated(c, dd))
+		continue;
+	    /* 0 means "not allocated" */
+	    dd->hash[c] = dos_hash64(cluster_to_addr(c, dd->image_buf, dd->bpb),
+				     dd->clust_size, 0) | 1;
+	    STAT_ADD(bytes_copied, dd->clust_size);
+	}
+    }
+    stats_flush();
+    return NULL;
+}
+
+struct hashed
+{
+    uint64_t hash;
+    uint32_t id;		/* a cluster, or a file */
+};
+
+static int hashed_cmp(const void *a, const void *b)
+{
+    const struct hashed *ha = a, *hb = b;
+
+    if (ha->hash != hb->hash)
+	return ha->hash < hb->hash ? -1 : 1;
+    return ha->id < hb->id ? -1 : ha->id > hb->id;
+}
+
+/* hash_clusters fills in dd->hash, with nthreads threads */
+static void hash_clusters(struct dedup *dd, int nthreads)
+{
+    pthread_t *threads;
+    int i;
+
+    if (nthreads < 1)
+	nthreads = 1;
+    threads = malloc(nthreads * sizeof(pthread_t));
+    for (i = 0; i < nthreads; i++)
+    {
+	if (pthread_create(&threads[i], NULL, hash_worker, dd) != 0)
+	{
+	    nthreads = i;
+	    break;
+	}
+    }
+    if (nthreads == 0)
+	hash_worker(dd);
+    for (i = 0; i < nthreads; i++)
+	pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+/* group_clusters sorts the allocated clusters by hash, and within
+   each run of equal hashes compares the clusters byte for byte to set
+   canon and copies */
+static uint32_t group_clusters(struct dedup *dd, uint32_t *allocated)
+{
+    struct hashed *h = malloc(dd->maxclust * sizeof(struct hashed));
+    uint32_t n = 0, i, j, k, m, distinct = 0;
+    uint16_t c, rep;
+
+    for (c = CLUST_FIRST; c < dd->maxclust; c++)
+    {
+	if (dd->hash[c] == 0)
+	    continue;
+	h[n].hash = dd->hash[c];
+	h[n].id = c;
+	n++;
+    }
+    qsort(h, n, sizeof(struct hashed), hashed_cmp);
+
+    for (i = 0; i < n; i = j)
+    {
+	for (j = i + 1; j < n && h[j].hash == h[i].hash; j++)
+	    ;
+	/* usually one class per hash; the lowest cluster represents it */
+	for (k = i; k < j; k++)
+	{
+	    c = h[k].id;
+	    for (m = i; m < k; m++)
+	    {
+		rep = h[m].id;
+		if (dd->canon[rep] == rep
+		    && memcmp(cluster_to_addr(rep, dd->image_buf, dd->bpb),
+			      cluster_to_addr(c, dd->image_buf, dd->bpb),
+			      dd->clust_size) == 0)
+		    break;
+	    }
+	    if (m == k)
+		rep = c;
+	    dd->canon[c] = rep;
+	    if (rep == c)
+		distinct++;
+	    dd->copies[rep]++;
+	}
+    }
+    free(h);
+    *allocated = n;
+    return distinct;
+}
+
+
+/* a file's clusters, in order, for comparing files */
+struct dedup_file
+{
+    struct sum_job *job;
+    uint32_t size;
+    uint32_t nclusters;
+    uint16_t *clusters;
+    int dup;			/* part of a group of identical files */
+};
+
+struct dedup_run
+{
+    struct dedup_file *file;
+    uint32_t start, length;
+};
+
+static int run_cmp(const void *a, const void *b)
+{
+    const struct dedup_run *ra = a, *rb = b;
+
+    if (ra->length != rb->length)
+	return ra->length > rb->length ? -1 : 1;
+    return strcmp(ra->file->job->path, rb->file->job->path);
+}
+
+/* same_file says whether two files of the same size hold the same bytes */
+static int same_file(struct dedup *dd, struct dedup_file *a, struct dedup_file *b)
+{
+    uint32_t i, full = a->size / dd->clust_size;
+
+    for (i = 0; i < full; i++)
+	if (dd->canon[a->clusters[i]] != dd->canon[b->clusters[i]])
+	    return 0;
+    if (full == a->nclusters)
+	return 1;
+    return memcmp(cluster_to_addr(a->clusters[full], dd->image_buf, dd->bpb),
+		  cluster_to_addr(b->clusters[full], dd->image_buf, dd->bpb),
+		  a->size % dd->clust_size) == 0;
+}
+
+static void load_clusters(struct dedup *dd, struct dedup_file *df)
+{
+    struct dos_file *f = dos_open_dirent(df->job->dirent, dd->image_buf, dd->bpb);
+    uint32_t i, k;
+
+    df->size = f->size;
+    df->nclusters = (f->mapped + dd->clust_size - 1) / dd->clust_size;
+    df->clusters = malloc((df->nclusters + 1) * sizeof(uint16_t));
+    for (i = 0, k = 0; i < f->nextents && k < df->nclusters; i++)
+	for (uint16_t c = 0; c < f->extents[i].exCount && k < df->nclusters; c++)
+	    df->clusters[k++] = f->extents[i].exCluster + c;
+    /* a broken chain can't be compared */
+    if (f->mapped < f->size)
+	df->nclusters = 0;
+    dos_close(f);
+}
+
+static void dedup(struct sum_queue *queue, int nthreads, int nruns)
+{
+    struct dedup dd;
+    struct dedup_file *files;
+    struct dedup_run *runs;
+    struct hashed *keys;
+    uint32_t allocated, distinct, i, j, k, m, nkeys = 0, nrun = 0;
+    uint32_t groups = 0, extra_files = 0, extra_clusters = 0;
+    uint64_t extra_bytes = 0;
+
+    memset(&dd, 0, sizeof(dd));
+    dd.image_buf = queue->image_buf;
+    dd.bpb = queue->bpb;
+    dd.clust_size = queue->bpb->bpbBytesPerSec * queue->bpb->bpbSecPerClust;
+    dd.maxclust = get_cluster_count(queue->bpb);
+    dd.hash = calloc(dd.maxclust, sizeof(uint64_t));
+    dd.canon = calloc(dd.maxclust, sizeof(uint16_t));
+    dd.copies = calloc(dd.maxclust, sizeof(uint16_t));
+
+    hash_clusters(&dd, nthreads);
+    distinct = group_clusters(&dd, &allocated);
+    printf("clusters: %u allocated, %u distinct, %u redundant (%u bytes)\n",
+	   allocated, distinct, allocated - distinct,
+	   (allocated - distinct) * dd.clust_size);
+
+    /* files: same size and same cluster contents, in order */
+    files = calloc(queue->count + 1, sizeof(struct dedup_file));
+    keys = malloc((queue->count + 1) * sizeof(struct hashed));
+    for (i = 0; i < queue->count; i++)
+    {
+	files[i].job = &queue->jobs[i];
+	load_clusters(&dd, &files[i]);
+	if (files[i].size == 0 || files[i].nclusters == 0)
+	    continue;
+	keys[nkeys].hash = dos_hash64(&files[i].size, sizeof(uint32_t), 0);
+	for (k = 0; k < files[i].size / dd.clust_size; k++)
+	    keys[nkeys].hash = dos_hash64(&dd.canon[files[i].clusters[k]],
+					  sizeof(uint16_t), keys[nkeys].hash);
+	if (k < files[i].nclusters)
+	    keys[nkeys].hash = dos_hash64(cluster_to_addr(files[i].clusters[k],
+							  dd.image_buf, dd.bpb),
+					  files[i].size % dd.clust_size, keys[nkeys].hash);
+	keys[nkeys].id = i;
+	nkeys++;
+    }
+    qsort(keys, nkeys, sizeof(struct hashed), hashed_cmp);
+
+    for (i = 0; i < nkeys; i = j)
+    {
+	for (j = i + 1; j < nkeys && keys[j].hash == keys[i].hash; j++)
+	    ;
+	/* print each set of files that really are the same */
+	for (k = i; k < j; k++)
+	{
+	    struct dedup_file *a = &files[keys[k].id];
+	    uint32_t n = 1;
+
+	    if (a->dup)
+		continue;
+	    for (m = k + 1; m < j; m++)
+		if (!files[keys[m].id].dup && files[keys[m].id].size == a->size
+		    && same_file(&dd, a, &files[keys[m].id]))
+		{
+		    if (n++ == 1)
+			printf("%u bytes, copies: %s", a->size, a->job->path);
+		    files[keys[m].id].dup = 1;
+		    printf(" %s", files[keys[m].id].job->path);
+		}
+	    if (n == 1)
+		continue;
+	    a->dup = 1;
+	    printf("\n");
+	    groups++;
+	    extra_files += n - 1;
+	    extra_clusters += (n - 1) * a->nclusters;
+	    extra_bytes += (uint64_t)(n - 1) * a->size;
+	}
+    }
+    printf("files: %u sets of identical files, %u redundant copies "
+	   "(%llu bytes, %u clusters)\n", groups, extra_files,
+	   (unsigned long long)extra_bytes, extra_clusters);
+
+    /* runs of clusters, in the other files, that are found elsewhere */
+    runs = NULL;
+    for (i = 0, m = 0; i < queue->count; i++)
+    {
+	if (files[i].dup)
+	    continue;
+	for (k = 0; k < files[i].nclusters; k = j)
+	{
+	    for (j = k; j < files[i].nclusters
+		     && dd.copies[dd.canon[files[i].clusters[j]]] > 1; j++)
+		;
+	    if (j == k)
+	    {
+		j++;
+		continue;
+	    }
+	    if (nrun == m)
+	    {
+		m = m ? m * 2 : 64;
+		runs = realloc(runs, m * sizeof(struct dedup_run));
+	    }
+	    runs[nrun].file = &files[i];
+	    runs[nrun].start = k;
+	    runs[nrun].length = j - k;
+	    nrun++;
+	}
+    }
+    qsort(runs, nrun, sizeof(struct dedup_run), run_cmp);
+    printf("runs: %u runs of duplicated clusters in other files\n", nrun);
+    for (i = 0; i < nrun && i < (uint32_t)nruns; i++)
+	printf("  %s clusters %u-%u (%u clusters, %u bytes)\n",
+	       runs[i].file->job->path, runs[i].start,
+	       runs[i].start + runs[i].length - 1, runs[i].length,
+	       runs[i].length * dd.clust_size);
+
+    for (i = 0; i < queue->count; i++)
+	free(files[i].clusters);
+    free(files);
+    free(keys);
+    free(runs);
+    free(dd.hash);
+    free(dd.canon);
+    free(dd.copies);
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [--stats] [-j threads] [-c manifest | -d [-n N]] <imagename>\n", progname);
+    fprintf(stderr, "\tprints the CRC32C of every file in the image\n");
+    fprintf(stderr, "\t-c manifest  check the files listed in manifest instead\n");
+    fprintf(stderr, "\t-d           report duplicated content instead, with the\n");
+    fprintf(stderr, "\t             N longest duplicated runs of clusters (10)\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    struct sum_queue queue;
+    uint8_t *image_buf;
+    int fd, opt, i, bad = 0;
+    struct bpb33* bpb;
+    char *manifest = NULL;
+    int dedup_mode = 0, nruns = 10;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    stats_option(&argc, argv);
+    while ((opt = getopt(argc, argv, "j:c:dn:")) != -1)
+    {
+	switch (opt)
+	{
+	case 'j':
+	    nthreads = atoi(optarg);
+	    break;
+	case 'c':
+	    manifest = optarg;
+	    break;
+	case 'd':
+	    dedup_mode = 1;
+	    break;
+	case 'n':
+	    nruns = atoi(optarg);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (optind != argc - 1 || (dedup_mode && manifest != NULL))
+	usage(argv[0]);
+
+    image_buf = mmap_file_readonly(argv[optind], &fd);
+    bpb = check_bootsector(image_buf);
+
+    memset(&queue, 0, sizeof(queue));
+    queue.image_buf = image_buf;
+    queue.bpb = bpb;
+    if (manifest != NULL)
+	read_manifest(manifest, &queue);
+    else
+	walk_tree(MSDOSFSROOT, "", image_buf, bpb, collect_dirent, &queue);
+
+    if (dedup_mode)
+    {
+	dedup(&queue, nthreads, nruns);
+	for (i = 0; i < queue.count; i++)
+	    free(queue.jobs[i].path);
+	free(queue.jobs);
+	unmmap_file(image_buf, &fd);
+	return 0;
+    }
+
+    run_workers(&queue, nthreads);
+
+    for (i = 0; i < queue.count; i++)
+    {
+	struct sum_job *job = &queue.jobs[i];
+
+	if (manifest == NULL)
+	    printf("%08x  %s\n", job->crc, job->path);
+	else if (job->dirent == NULL)
+	{
+	    printf("%s: MISSING\n", job->path);
+	    bad++;
+	}
+	else if (job->crc != job->expected)
+	{
+	    printf("%s: FAILED\n", job->path);
+	    bad++;
+	}
+	free(job->path);
+    }
+    fflush(stdout);
+    if (manifest != NULL)
+	fprintf(stderr, "%d of %d files failed\n", bad, queue.count);
+    free(queue.jobs);
+
+    unmmap_file(image_buf, &fd);
+    return bad ? 1 : 0;
+}
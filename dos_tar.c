@@ -0,0 +1,366 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <time.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "packed.h"
+#include "stats.h"
+
+
+/* dos_tar writes a POSIX ustar archive of the disk image (or of one
+   directory in it) to stdout.  File data is written straight out of
+   the memory mapped image, one write per run of contiguous
+   clusters, so nothing is staged in between. */
+
+#define TAR_BLOCK 512
+
+/* the ustar header block, as laid out in POSIX.1-1988 */
+struct ustar_header
+{
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+static uint8_t zero_block[TAR_BLOCK];
+static int errors = 0;
+
+
+/* write_all writes the whole buffer to stdout, coping with short
+   writes to a pipe */
+void write_all(const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    size_t pinned;
+    ssize_t n;
+
+    while (len > 0)
+    {
+	STAT_INC(syscalls);
+	pinned = packed_fault_in(p, len);
+	n = write(STDOUT_FILENO, p, pinned);
+	packed_release(p, pinned);
+	if (n < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    fprintf(stderr, "Write failed: %s\n", strerror(errno));
+	    exit(1);
+	}
+	p += n;
+	len -= n;
+    }
+}
+
+
+/* pad the archive out to the next block boundary after len bytes */
+void write_padding(uint32_t len)
+{
+    if (len % TAR_BLOCK)
+	write_all(zero_block, TAR_BLOCK - len % TAR_BLOCK);
+}
+
+
+/* dos_mtime converts the DOS modification date and time of a
+   directory entry to a unix time.  DOS keeps local time. */
+time_t dos_mtime(struct direntry *dirent)
+{
+    uint16_t dtime = getushort(dirent->deMTime);
+    uint16_t ddate = getushort(dirent->deMDate);
+    struct tm tm;
+
+    if (ddate == 0)
+	return 0;
+
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_sec = ((dtime & DT_2SECONDS_MASK) >> DT_2SECONDS_SHIFT) * 2;
+    tm.tm_min = (dtime & DT_MINUTES_MASK) >> DT_MINUTES_SHIFT;
+    tm.tm_hour = (dtime & DT_HOURS_MASK) >> DT_HOURS_SHIFT;
+    tm.tm_mday = (ddate & DD_DAY_MASK) >> DD_DAY_SHIFT;
+    tm.tm_mon = ((ddate & DD_MONTH_MASK) >> DD_MONTH_SHIFT) - 1;
+    tm.tm_year = ((ddate & DD_YEAR_MASK) >> DD_YEAR_SHIFT) + 80;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+
+void finish_header(struct ustar_header *hdr)
+{
+    unsigned int sum = 0;
+    uint8_t *p = (uint8_t*)hdr;
+    int i;
+
+    memcpy(hdr->magic, "ustar", 6);
+    memcpy(hdr->version, "00", 2);
+    memset(hdr->chksum, ' ', sizeof(hdr->chksum));
+    for (i = 0; i < TAR_BLOCK; i++)
+	sum += p[i];
+    snprintf(hdr->chksum, sizeof(hdr->chksum), "%06o", sum);
+    hdr->chksum[7] = ' ';
+}
+
+
+/* write_pax_path emits a pax extended header carrying a path that
+   doesn't fit in the ustar name and prefix fields */
+void write_pax_path(const char *path, time_t mtime)
+{
+    struct ustar_header hdr;
+    char record[MAXPATHLEN + 32];
+    int len, digits;
+
+    /* the record length includes its own decimal digits */
+    len = strlen(" path=\n") + strlen(path);
+    for (digits = 1; ; digits++)
+    {
+	snprintf(record, sizeof(record), "%d", len + digits);
+	if ((int)strlen(record) == digits)
+	    break;
+    }
+    len = snprintf(record, sizeof(record), "%d path=%s\n",
+		   len + digits, path);
+
+    memset(&hdr, 0, sizeof(hdr));
+    snprintf(hdr.name, sizeof(hdr.name), "PaxHeader");
+    snprintf(hdr.mode, sizeof(hdr.mode), "%07o", 0644);
+    snprintf(hdr.uid, sizeof(hdr.uid), "%07o", 0);
+    snprintf(hdr.gid, sizeof(hdr.gid), "%07o", 0);
+    snprintf(hdr.size, sizeof(hdr.size), "%011o", len);
+    snprintf(hdr.mtime, sizeof(hdr.mtime), "%011lo", (unsigned long)mtime);
+    hdr.typeflag = 'x';
+    finish_header(&hdr);
+
+    write_all(&hdr, TAR_BLOCK);
+    write_all(record, len);
+    write_padding(len);
+}
+
+
+/* write_header emits the header for one archive member.  Paths that
+   are too long for name alone are split across prefix and name, and
+   failing that carried in a pax header. */
+void write_header(const char *path, char typeflag, uint32_t size,
+		  time_t mtime)
+{
+    struct ustar_header hdr;
+    int len = strlen(path);
+    const char *split = NULL;
+    const char *p;
+
+    memset(&hdr, 0, sizeof(hdr));
+
+    if (len <= (int)sizeof(hdr.name))
+    {
+	memcpy(hdr.name, path, len);
+    }
+    else
+    {
+	/* find the last '/' that leaves both halves short enough */
+	for (p = path + len - 1; p > path; p--)
+	{
+	    if (*p == '/' && p - path <= (int)sizeof(hdr.prefix)
+		&& path + len - (p + 1) <= (int)sizeof(hdr.name))
+	    {
+		split = p;
+		break;
+	    }
+	}
+	if (split)
+	{
+	    memcpy(hdr.prefix, path, split - path);
+	    memcpy(hdr.name, split + 1, path + len - (split + 1));
+	}
+	else
+	{
+	    write_pax_path(path, mtime);
+	    memcpy(hdr.name, path + len - sizeof(hdr.name), sizeof(hdr.name));
+	}
+    }
+
+    snprintf(hdr.mode, sizeof(hdr.mode), "%07o",
+	     typeflag == '5' ? 0755 : 0644);
+    snprintf(hdr.uid, sizeof(hdr.uid), "%07o", 0);
+    snprintf(hdr.gid, sizeof(hdr.gid), "%07o", 0);
+    snprintf(hdr.size, sizeof(hdr.size), "%011o", size);
+    snprintf(hdr.mtime, sizeof(hdr.mtime), "%011lo", (unsigned long)mtime);
+    hdr.typeflag = typeflag;
+    finish_header(&hdr);
+
+    write_all(&hdr, TAR_BLOCK);
+}
+
+
+/* write_file_data streams a file's clusters straight from the
+   mapped image, one write per extent */
+void write_file_data(const char *path, struct direntry *dirent,
+		     uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint32_t clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
+    uint32_t size = getulong(dirent->deFileSize);
+    uint32_t bytes_remaining = size;
+    uint32_t nbytes;
+    uint16_t cluster = getushort(dirent->deStartCluster);
+    uint16_t run_start;
+
+    while (bytes_remaining > 0 && is_valid_cluster(cluster, bpb))
+    {
+	run_start = cluster;
+	nbytes = clust_size * get_extent(cluster,
+					 (bytes_remaining - 1) / clust_size + 1,
+					 &cluster, image_buf, bpb);
+	if (nbytes > bytes_remaining)
+	    nbytes = bytes_remaining;
+	write_all(cluster_to_addr(run_start, image_buf, bpb), nbytes);
+	STAT_ADD(bytes_copied, nbytes);
+	bytes_remaining -= nbytes;
+    }
+
+    /* the header already promised size bytes, so a short chain has
+       to be made up with zeros to keep the archive readable */
+    if (bytes_remaining > 0)
+    {
+	fprintf(stderr, "Bad file termination in %s\n", path);
+	errors++;
+	while (bytes_remaining > 0)
+	{
+	    nbytes = bytes_remaining > TAR_BLOCK ? TAR_BLOCK : bytes_remaining;
+	    write_all(zero_block, nbytes);
+	    bytes_remaining -= nbytes;
+	}
+    }
+
+    write_padding(size);
+}
+
+
+struct tar_walk
+{
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+};
+
+/* archive_dirent writes one entry of the tree; names in the archive
+   don't start with '/', and directories end with one */
+int archive_dirent(struct direntry *dirent, const char *path, int depth, void *arg)
+{
+    struct tar_walk *walk = arg;
+    char name[MAXPATHLEN+2];
+
+    (void)depth;
+    if ((dirent->deAttributes & ATTR_DIRECTORY) != 0)
+    {
+	snprintf(name, sizeof(name), "%s/", path + 1);
+	write_header(name, '5', 0, dos_mtime(dirent));
+	return 0;
+    }
+
+    write_header(path + 1, '0', getulong(dirent->deFileSize), dos_mtime(dirent));
+    write_file_data(path + 1, dirent, walk->image_buf, walk->bpb);
+    return 0;
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [--stats] <imagename> [a:<dirname>]\n", progname);
+    fprintf(stderr, "\twrites a tar archive of the disk image, or of one directory in it, to stdout\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd;
+    struct bpb33* bpb;
+    struct direntry *dirent = (void*)1;
+    uint16_t cluster = MSDOSFSROOT;
+    struct tar_walk walk;
+    char *path = "";
+
+    stats_option(&argc, argv);
+    if (argc < 2 || argc > 3)
+    {
+	usage(argv[0]);
+    }
+    if (argc == 3)
+    {
+	if (strncmp("a:", argv[2], 2) != 0)
+	    usage(argv[0]);
+	path = argv[2] + 2;
+    }
+
+    if (isatty(STDOUT_FILENO))
+    {
+	fprintf(stderr, "Refusing to write an archive to a terminal\n");
+	exit(1);
+    }
+
+    image_buf = mmap_file_readonly(argv[1], &fd);
+    bpb = check_bootsector(image_buf);
+
+    while (*path == '/' || *path == '\\')
+	path++;
+    if (*path != '\0')
+    {
+	dirent = find_path(path, image_buf, bpb);
+	if (dirent == NULL)
+	{
+	    fprintf(stderr, "No file called %s exists in the disk image\n", path);
+	    exit(1);
+	}
+
+	if ((dirent->deAttributes & ATTR_DIRECTORY) != 0)
+	{
+	    cluster = getushort(dirent->deStartCluster);
+	}
+	else
+	{
+	    /* a single file is archived on its own */
+	    char name[MAXFILENAME];
+	    get_dirent_name(dirent, name);
+	    write_header(name, '0', getulong(dirent->deFileSize),
+			 dos_mtime(dirent));
+	    write_file_data(name, dirent, image_buf, bpb);
+	    dirent = NULL;
+	}
+    }
+
+    if (dirent != NULL)
+    {
+	walk.image_buf = image_buf;
+	walk.bpb = bpb;
+	errors += walk_tree(cluster, "", image_buf, bpb, archive_dirent, &walk);
+    }
+
+    /* the archive ends with two blocks of zeros */
+    write_all(zero_block, TAR_BLOCK);
+    write_all(zero_block, TAR_BLOCK);
+
+    unmmap_file(image_buf, &fd);
+    return errors ? 1 : 0;
+}
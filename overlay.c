@@ -0,0 +1,368 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "bpb.h"
+#include "dos.h"
+#include "overlay.h"
+#include "stats.h"
+
+#define DELTA_HEADER 28		/* magic, sector size, sectors, hash, runs */
+#define MAXLAYERS 16
+
+/* pagemap bits: the page is in memory, swapped out, or file backed */
+#define PM_PRESENT (1ULL << 63)
+#define PM_SWAPPED (1ULL << 62)
+#define PM_FILE (1ULL << 61)
+
+const char *overlay_path;
+static const char *layer_paths[MAXLAYERS];
+static int nlayers;
+
+/* the image as it was before the tool ran: the base, and any layers */
+static uint8_t *base_map;
+static const uint8_t **ref;
+static struct delta *layers[MAXLAYERS];
+
+
+/* overlay_option takes --overlay DELTA and any --layer DELTA out of
+   the command line before the tool's own getopt sees them.  Layers
+   are kept in the order given, and need an --overlay on top. */
+int overlay_option(int *argc, char **argv)
+{
+    int i, j, layer;
+
+    for (i = 1; i < *argc; i++)
+    {
+	if (strcmp(argv[i], "--overlay") == 0)
+	    layer = 0;
+	else if (strcmp(argv[i], "--layer") == 0)
+	    layer = 1;
+	else
+	    continue;
+
+	if (i + 1 >= *argc)
+	{
+	    fprintf(stderr, "%s: %s needs a file name\n", argv[0], argv[i]);
+	    exit(1);
+	}
+	if (!layer)
+	    overlay_path = argv[i + 1];
+	else if (nlayers == MAXLAYERS)
+	{
+	    fprintf(stderr, "%s: no more than %d layers\n", argv[0], MAXLAYERS);
+	    exit(1);
+	}
+	else
+	    layer_paths[nlayers++] = argv[i + 1];
+	for (j = i; j + 2 <= *argc; j++)
+	    argv[j] = argv[j + 2];
+	*argc -= 2;
+	i--;
+    }
+    if (nlayers > 0 && overlay_path == NULL)
+    {
+	fprintf(stderr, "%s: --layer needs --overlay\n", argv[0]);
+	exit(1);
+    }
+    return overlay_path != NULL;
+}
+
+
+static void bad_delta(const char *path, const char *why)
+{
+    fprintf(stderr, "%s is not a usable delta: %s\n", path, why);
+    exit(1);
+}
+
+/* delta_read loads a whole delta file, and checks that it hangs together */
+struct delta *delta_read(const char *path)
+{
+    struct delta *d = calloc(1, sizeof(struct delta));
+    struct stat st;
+    uint64_t off, len;
+    ssize_t n;
+    uint32_t i;
+    int fd;
+
+    STAT_ADD(syscalls, 2);
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+	fprintf(stderr, "Cannot read delta %s:\n%s\n", path, strerror(errno));
+	exit(1);
+    }
+    d->buf = malloc(st.st_size + 1);
+    for (off = 0; off < (uint64_t)st.st_size; off += n)
+    {
+	STAT_INC(syscalls);
+	n = read(fd, d->buf + off, st.st_size - off);
+	if (n <= 0)
+	{
+	    fprintf(stderr, "Cannot read delta %s:\n%s\n", path,
+		    n < 0 ? strerror(errno) : "file shrank");
+	    exit(1);
+	}
+    }
+    close(fd);
+    STAT_INC(syscalls);
+
+    if (st.st_size < DELTA_HEADER || memcmp(d->buf, DELTA_MAGIC, 8) != 0)
+	bad_delta(path, "bad header");
+    d->sector_size = (uint32_t)getulong(d->buf + 8);
+    d->nsectors = (uint32_t)getulong(d->buf + 12);
+    d->base_hash = (uint32_t)getulong(d->buf + 16)
+	| (uint64_t)(uint32_t)getulong(d->buf + 20) << 32;
+    d->nruns = (uint32_t)getulong(d->buf + 24);
+    if (d->sector_size != DELTA_SECTOR)
+	bad_delta(path, "unknown sector size");
+    if (d->nruns > (st.st_size - DELTA_HEADER) / 8)
+	bad_delta(path, "too many runs");
+
+    d->runs = calloc(d->nruns + 1, sizeof(struct delta_run));
+    off = DELTA_HEADER;
+    for (i = 0; i < d->nruns; i++)
+    {
+	if (off + 8 > (uint64_t)st.st_size)
+	    bad_delta(path, "truncated");
+	d->runs[i].first = (uint32_t)getulong(d->buf + off);
+	d->runs[i].count = (uint32_t)getulong(d->buf + off + 4);
+	off += 8;
+	len = (uint64_t)d->runs[i].count * DELTA_SECTOR;
+	if (d->runs[i].count == 0
+	    || (uint64_t)d->runs[i].first + d->runs[i].count > d->nsectors
+	    || (i > 0 && d->runs[i].first < d->runs[i - 1].first + d->runs[i - 1].count))
+	    bad_delta(path, "bad run");
+	if (off + len > (uint64_t)st.st_size)
+	    bad_delta(path, "truncated");
+	d->runs[i].data = d->buf + off;
+	off += len;
+    }
+    if (off != (uint64_t)st.st_size)
+	bad_delta(path, "trailing data");
+    return d;
+}
+
+void delta_free(struct delta *d)
+{
+    if (d == NULL)
+	return;
+    free(d->runs);
+    free(d->buf);
+    free(d);
+}
+
+/* delta_matches says whether image is the one d was made from */
+int delta_matches(struct delta *d, const uint8_t *image, size_t size)
+{
+    uint64_t hash = 0;
+    uint32_t i, s;
+
+    if (size != (uint64_t)d->nsectors * DELTA_SECTOR)
+	return 0;
+    /* a sector at a time, as overlay_commit hashes them */
+    for (i = 0; i < d->nruns; i++)
+	for (s = d->runs[i].first; s < d->runs[i].first + d->runs[i].count; s++)
+	    hash = dos_hash64(image + (size_t)s * DELTA_SECTOR, DELTA_SECTOR, hash);
+    return hash == d->base_hash;
+}
+
+void delta_apply(struct delta *d, uint8_t *image)
+{
+    uint32_t i;
+
+    for (i = 0; i < d->nruns; i++)
+	memcpy(image + (size_t)d->runs[i].first * DELTA_SECTOR, d->runs[i].data,
+	       (size_t)d->runs[i].count * DELTA_SECTOR);
+}
+
+static void apply_checked(const char *path, struct delta *d, uint8_t *image, size_t size)
+{
+    if (!delta_matches(d, image, size))
+    {
+	fprintf(stderr, "Delta %s wasn't made from this image\n", path);
+	exit(1);
+    }
+    delta_apply(d, image);
+}
+
+
+/* overlay_map maps the image for --overlay: privately, so that writes
+   go to our own copies of the pages, with the layers and any earlier
+   delta applied */
+uint8_t *overlay_map(const char *pathname, int *fd, size_t size)
+{
+    uint8_t *image;
+    uint32_t nsectors = size / DELTA_SECTOR, s, i;
+    struct delta *d;
+    int l;
+
+    if (size % DELTA_SECTOR != 0)
+    {
+	fprintf(stderr, "Image %s isn't a whole number of sectors\n", pathname);
+	exit(1);
+    }
+    STAT_ADD(syscalls, 3);
+    *fd = open(pathname, O_RDONLY);
+    if (*fd < 0)
+    {
+	fprintf(stderr, "Cannot read disk image file %s:\n%s\n",
+		pathname, strerror(errno));
+	exit(1);
+    }
+    image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, *fd, 0);
+    base_map = mmap(NULL, size, PROT_READ, MAP_SHARED, *fd, 0);
+    if (image == MAP_FAILED || base_map == MAP_FAILED)
+    {
+	fprintf(stderr, "Failed to memory map: \n%s\n", strerror(errno));
+	exit(1);
+    }
+
+    ref = malloc((nsectors + 1) * sizeof(uint8_t *));
+    for (s = 0; s < nsectors; s++)
+	ref[s] = base_map + (size_t)s * DELTA_SECTOR;
+    for (l = 0; l < nlayers; l++)
+    {
+	layers[l] = d = delta_read(layer_paths[l]);
+	apply_checked(layer_paths[l], d, image, size);
+	for (i = 0; i < d->nruns; i++)
+	    for (s = 0; s < d->runs[i].count; s++)
+		ref[d->runs[i].first + s] = d->runs[i].data + (size_t)s * DELTA_SECTOR;
+    }
+
+    /* carry on from an earlier session */
+    if (access(overlay_path, F_OK) == 0)
+    {
+	d = delta_read(overlay_path);
+	apply_checked(overlay_path, d, image, size);
+	delta_free(d);
+    }
+    return image;
+}
+
+/* dirty_pages marks the pages of image that have been written, which
+   are the ones no longer backed by the file.  If the kernel won't
+   say, every page is marked. */
+static void dirty_pages(uint8_t *image, size_t size, long page, uint8_t *dirty)
+{
+    size_t npages = (size + page - 1) / page, i;
+    uint64_t *pm = malloc(npages * sizeof(uint64_t));
+    ssize_t n = -1;
+    int fd;
+
+    STAT_INC(syscalls);
+    fd = open("/proc/self/pagemap", O_RDONLY);
+    if (fd >= 0)
+    {
+	STAT_ADD(syscalls, 2);
+	n = pread(fd, pm, npages * sizeof(uint64_t),
+		  (uintptr_t)image / page * sizeof(uint64_t));
+	close(fd);
+    }
+    for (i = 0; i < npages; i++)
+    {
+	if (n != (ssize_t)(npages * sizeof(uint64_t)))
+	    dirty[i] = 1;
+	else
+	    dirty[i] = (pm[i] & PM_SWAPPED)
+		|| ((pm[i] & PM_PRESENT) && !(pm[i] & PM_FILE));
+    }
+    free(pm);
+}
+
+/* overlay_commit writes the sectors that differ from the base and
+   layers to the delta, via a temporary file so a crash can't leave
+   half a delta behind */
+void overlay_commit(uint8_t *image, size_t size)
+{
+    uint32_t nsectors = size / DELTA_SECTOR, s, first, count, nruns = 0, nsect = 0;
+    long page = sysconf(_SC_PAGESIZE);
+    uint8_t *dirty = malloc((size + page - 1) / page + 1);
+    uint8_t *changed = calloc(nsectors + 1, 1);
+    char tmp[MAXPATHLEN + 8];
+    uint8_t head[DELTA_HEADER];
+    uint32_t sector_size = DELTA_SECTOR;
+    uint64_t hash = 0;
+    FILE *out;
+    int l, err;
+
+    dirty_pages(image, size, page, dirty);
+    for (s = 0; s < nsectors; s++)
+    {
+	if (!dirty[(size_t)s * DELTA_SECTOR / page])
+	    continue;
+	changed[s] = memcmp(image + (size_t)s * DELTA_SECTOR, ref[s], DELTA_SECTOR) != 0;
+    }
+
+    /* the hash of what the runs replace comes first, in the header */
+    for (s = 0; s < nsectors; s = first + count)
+    {
+	for (first = s; first < nsectors && !changed[first]; first++)
+	    ;
+	for (count = 0; first + count < nsectors && changed[first + count]; count++)
+	    hash = dos_hash64(ref[first + count], DELTA_SECTOR, hash);
+	if (count > 0)
+	{
+	    nruns++;
+	    nsect += count;
+	}
+    }
+
+    if (strlen(overlay_path) > MAXPATHLEN)
+    {
+	fprintf(stderr, "Delta name %s is too long\n", overlay_path);
+	exit(1);
+    }
+    strcpy(tmp, overlay_path);
+    strcat(tmp, ".tmp");
+    STAT_INC(syscalls);
+    out = fopen(tmp, "w");
+    if (out == NULL)
+    {
+	fprintf(stderr, "Cannot write delta %s:\n%s\n", tmp, strerror(errno));
+	exit(1);
+    }
+    memcpy(head, DELTA_MAGIC, 8);
+    putulong(head + 8, sector_size);
+    putulong(head + 12, nsectors);
+    putulong(head + 16, (uint32_t)hash);
+    putulong(head + 20, (uint32_t)(hash >> 32));
+    putulong(head + 24, nruns);
+    fwrite(head, DELTA_HEADER, 1, out);
+
+    for (s = 0; s < nsectors; s = first + count)
+    {
+	for (first = s; first < nsectors && !changed[first]; first++)
+	    ;
+	for (count = 0; first + count < nsectors && changed[first + count]; count++)
+	    ;
+	if (count == 0)
+	    continue;
+	putulong(head, first);
+	putulong(head + 4, count);
+	fwrite(head, 8, 1, out);
+	fwrite(image + (size_t)first * DELTA_SECTOR, DELTA_SECTOR, count, out);
+    }
+    err = ferror(out);
+    STAT_ADD(syscalls, 2);
+    if (fclose(out) != 0 || err || rename(tmp, overlay_path) < 0)
+    {
+	fprintf(stderr, "Cannot write delta %s:\n%s\n", overlay_path, strerror(errno));
+	unlink(tmp);
+	exit(1);
+    }
+    dos_debug(1, "%s: %u sectors changed, in %u runs\n", overlay_path, nsect, nruns);
+
+    munmap(base_map, size);
+    for (l = 0; l < nlayers; l++)
+	delta_free(layers[l]);
+    free(ref);
+    free(dirty);
+    free(changed);
+}
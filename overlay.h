@@ -0,0 +1,64 @@
+#ifndef __OVERLAY_H__
+#define __OVERLAY_H__
+
+/* Copy-on-write overlays, so a tool can change an image without
+   touching it.
+
+   With --overlay DELTA on the command line, mmap_file maps the image
+   privately and read only on disk, and unmmap_file writes every
+   sector the tool changed to DELTA instead.  If DELTA already exists
+   it is applied first, so a session can be carried on later; the new
+   delta holds all the changes.  --layer LOWER (any number of times)
+   applies other deltas underneath, in order, and the new delta then
+   records only the changes on top of them.  A tool that exits early
+   with an error writes no delta, and the image is untouched either
+   way.  To discard a delta, remove it; dos_delta applies one for good.
+
+   A delta file is, with all numbers little endian:
+
+     8 bytes   "DOSDLT1\n"
+     uint32    sector size
+     uint32    sectors in the image
+     uint64    hash of what the replaced sectors held before
+     uint32    number of runs
+
+   and then for each run a uint32 first sector, a uint32 count of
+   sectors and the sectors themselves.  A delta is only applied to an
+   image whose sectors hash to what it was made from, which catches
+   the wrong image, or stacked deltas applied out of order. */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DELTA_MAGIC "DOSDLT1\n"
+#define DELTA_SECTOR 512
+
+struct delta_run
+{
+    uint32_t first;		/* first sector */
+    uint32_t count;		/* sectors in the run */
+    uint8_t *data;
+};
+
+struct delta
+{
+    uint32_t sector_size;
+    uint32_t nsectors;
+    uint64_t base_hash;
+    uint32_t nruns;
+    struct delta_run *runs;
+    uint8_t *buf;		/* the whole file; runs point into it */
+};
+
+extern const char *overlay_path;
+
+int overlay_option(int *, char **);
+uint8_t *overlay_map(const char *pathname, int *fd, size_t size);
+void overlay_commit(uint8_t *image, size_t size);
+
+struct delta *delta_read(const char *path);
+int delta_matches(struct delta *, const uint8_t *image, size_t size);
+void delta_apply(struct delta *, uint8_t *image);
+void delta_free(struct delta *);
+
+#endif // __OVERLAY_H__
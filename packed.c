@@ -0,0 +1,613 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "bpb.h"
+#include "packed.h"
+#include "stats.h"
+
+#define MAXPACKED 8		/* packed images mapped at once */
+#define LZ_MINMATCH 4
+#define LZ_HASHBITS 13
+
+struct pack_entry
+{
+    uint64_t offset;
+    uint32_t len;
+    uint32_t method;
+};
+
+struct packed
+{
+    uint8_t *base;		/* NULL if the slot is unused */
+    char *path;
+    size_t size;		/* of the image */
+    size_t mapsize;		/* whole chunks */
+    int fd;
+    uint32_t chunk_size;
+    uint32_t nchunks;
+    struct pack_entry *index;
+    uint32_t *loaded;		/* per chunk: its cache slot + 1, or 0 */
+    uint32_t *pins;		/* per chunk: packed_fault_in callers using it */
+    uint64_t *gen;		/* per chunk: when it was last loaded */
+    uint32_t ndirty;		/* chunks changed, with private writes */
+    uint32_t *slot_chunk;	/* per slot: the chunk in it */
+    uint64_t *slot_used;	/* per slot: when, for dropping the oldest */
+    uint32_t nslots;		/* PACK_CACHE, or more while they're pinned */
+    uint64_t clock;
+    uint8_t *cbuf;		/* a compressed chunk, as read */
+    uint8_t *scratch;		/* where the next chunk is decompressed */
+};
+
+static struct packed packs[MAXPACKED];
+static int npacks;
+static int pack_lock;
+static int private_writes;
+static struct sigaction old_segv;
+static __thread uint8_t *last_fault;	/* where, and which load of its */
+static __thread uint64_t last_gen;	/* chunk, this thread last retried */
+
+
+/* the codec */
+
+static uint32_t lz_hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASHBITS);
+}
+
+/* put_length writes the extra bytes of a length of 15 or more */
+static uint8_t *put_length(uint8_t *op, uint8_t *oend, size_t len)
+{
+    for (len -= 15; ; len -= 255)
+    {
+	if (op >= oend)
+	    return NULL;
+	if (len < 255)
+	{
+	    *op++ = len;
+	    return op;
+	}
+	*op++ = 255;
+    }
+}
+
+static int get_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+    uint8_t b;
+
+    do
+    {
+	if (*ip >= iend)
+	    return -1;
+	b = *(*ip)++;
+	*len += b;
+    } while (b == 255);
+    return 0;
+}
+
+/* put_sequence writes nlit literals and then a match, or just the
+   literals if mlen is 0; NULL if they don't fit */
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lits,
+			     size_t nlit, size_t offset, size_t mlen)
+{
+    uint8_t *token = op++;
+
+    if (token >= oend)
+	return NULL;
+    *token = (nlit < 15 ? nlit : 15) << 4;
+    if (nlit >= 15 && (op = put_length(op, oend, nlit)) == NULL)
+	return NULL;
+    if ((size_t)(oend - op) < nlit)
+	return NULL;
+    memcpy(op, lits, nlit);
+    op += nlit;
+    if (mlen == 0)
+	return op;
+
+    mlen -= LZ_MINMATCH;
+    *token |= mlen < 15 ? mlen : 15;
+    if (oend - op < 2)
+	return NULL;
+    *op++ = offset;
+    *op++ = offset >> 8;
+    if (mlen >= 15)
+	op = put_length(op, oend, mlen);
+    return op;
+}
+
+/* lz_compress returns the compressed size, or 0 if it won't fit in cap */
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+    uint32_t table[1 << LZ_HASHBITS];
+    const uint8_t *ip = src, *anchor = src, *iend = src + len, *ref;
+    uint8_t *op = dst, *oend = dst + cap;
+    uint32_t v, h;
+    size_t mlen;
+
+    memset(table, 0xff, sizeof(table));
+    while (ip + LZ_MINMATCH <= iend)
+    {
+	memcpy(&v, ip, sizeof(v));
+	h = lz_hash(v);
+	ref = table[h] == UINT32_MAX ? NULL : src + table[h];
+	table[h] = ip - src;
+	if (ref == NULL || ip - ref > 65535 || memcmp(ref, ip, LZ_MINMATCH) != 0)
+	{
+	    ip++;
+	    continue;
+	}
+	for (mlen = LZ_MINMATCH; ip + mlen < iend && ref[mlen] == ip[mlen]; mlen++)
+	    ;
+	op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, mlen);
+	if (op == NULL)
+	    return 0;
+	ip += mlen;
+	anchor = ip;
+    }
+    op = put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+    return op == NULL ? 0 : (size_t)(op - dst);
+}
+
+/* lz_decompress returns the decompressed size, or -1 if src is corrupt
+   or won't fit in cap */
+ssize_t lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+    const uint8_t *ip = src, *iend = src + len;
+    uint8_t *op = dst, *oend = dst + cap;
+    size_t lit, mlen, offset;
+    uint8_t token;
+
+    while (ip < iend)
+    {
+	token = *ip++;
+	lit = token >> 4;
+	if (lit == 15 && get_length(&ip, iend, &lit) < 0)
+	    return -1;
+	if ((size_t)(iend - ip) < lit || (size_t)(oend - op) < lit)
+	    return -1;
+	memcpy(op, ip, lit);
+	op += lit;
+	ip += lit;
+	if (ip == iend)
+	    break;
+
+	if (iend - ip < 2)
+	    return -1;
+	offset = ip[0] | ip[1] << 8;
+	ip += 2;
+	mlen = token & 15;
+	if (mlen == 15 && get_length(&ip, iend, &mlen) < 0)
+	    return -1;
+	mlen += LZ_MINMATCH;
+	if (offset == 0 || offset > (size_t)(op - dst) || (size_t)(oend - op) < mlen)
+	    return -1;
+	if (offset >= mlen)
+	    memcpy(op, op - offset, mlen);
+	else
+	    for (size_t i = 0; i < mlen; i++)
+		op[i] = op[i - offset];
+	op += mlen;
+    }
+    return op - dst;
+}
+
+
+/* demand loading */
+
+/* fault_error is for the SIGSEGV handler, which can't use stdio */
+static void fault_error(const char *msg)
+{
+    ssize_t n = write(2, msg, strlen(msg));
+
+    (void)n;
+    _exit(1);
+}
+
+/* evict_chunk drops a chunk from memory; the caller frees its slot */
+static void evict_chunk(struct packed *p, uint32_t chunk)
+{
+    /* fresh pages with no access drop the old ones */
+    STAT_INC(syscalls);
+    if (mmap(p->base + (size_t)chunk * p->chunk_size, p->chunk_size, PROT_NONE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) == MAP_FAILED)
+	fault_error("Can't drop a chunk of a packed image\n");
+    p->loaded[chunk] = 0;
+}
+
+/* drop_slot evicts the chunk in a slot and closes the gap */
+static void drop_slot(struct packed *p, uint32_t slot)
+{
+    evict_chunk(p, p->slot_chunk[slot]);
+    p->nslots--;
+    if (slot == p->nslots)
+	return;
+    p->slot_chunk[slot] = p->slot_chunk[p->nslots];
+    p->slot_used[slot] = p->slot_used[p->nslots];
+    p->loaded[p->slot_chunk[slot]] = slot + 1;
+}
+
+/* take_slot finds a cache slot for chunk, dropping the chunk that has
+   gone longest without being used if the cache is full.  Chunks pinned
+   by packed_fault_in are never dropped; if they fill the cache it
+   grows, and shrinks again as they are released.  There is a slot for
+   every chunk, so the cache can't run out. */
+static void take_slot(struct packed *p, uint32_t chunk)
+{
+    uint32_t i, slot = p->nslots;
+
+    if (p->nslots >= PACK_CACHE)
+    {
+	for (i = 0; i < p->nslots; i++)
+	    if (p->pins[p->slot_chunk[i]] == 0
+		&& (slot == p->nslots || p->slot_used[i] < p->slot_used[slot]))
+		slot = i;
+	if (slot < p->nslots)
+	    drop_slot(p, slot);
+	slot = p->nslots;
+    }
+    p->nslots++;
+    p->slot_chunk[slot] = chunk;
+    p->slot_used[slot] = ++p->clock;
+    p->loaded[chunk] = slot + 1;
+    p->gen[chunk] = p->clock;
+}
+
+/* load_chunk decompresses a chunk into the scratch pages and then moves
+   them into place in one go, so no other thread can see a chunk half
+   decompressed */
+static void load_chunk(struct packed *p, uint32_t chunk)
+{
+    struct pack_entry *e = &p->index[chunk];
+    uint8_t *at = p->base + (size_t)chunk * p->chunk_size;
+    size_t want = p->size - (size_t)chunk * p->chunk_size;
+    ssize_t n;
+
+    if (want > p->chunk_size)
+	want = p->chunk_size;
+
+    STAT_ADD(syscalls, 3);
+    if (e->method == PACK_ZERO)
+    {
+	/* the pages are zeroes already */
+	if (mprotect(at, p->chunk_size, PROT_READ) < 0)
+	    fault_error("Can't map a chunk of a packed image\n");
+	take_slot(p, chunk);
+	return;
+    }
+    if (e->method == PACK_RAW)
+	n = pread(p->fd, p->scratch, e->len, e->offset);
+    else
+    {
+	n = pread(p->fd, p->cbuf, e->len, e->offset);
+	if (n == (ssize_t)e->len)
+	    n = lz_decompress(p->cbuf, e->len, p->scratch, p->chunk_size);
+    }
+    if (n != (ssize_t)want)
+	fault_error("A chunk of a packed image is missing or corrupt\n");
+
+    if (mprotect(p->scratch, p->chunk_size, PROT_READ) < 0
+	|| mremap(p->scratch, p->chunk_size, p->chunk_size,
+		  MREMAP_MAYMOVE | MREMAP_FIXED, at) == MAP_FAILED)
+	fault_error("Can't map a chunk of a packed image\n");
+    p->scratch = mmap(NULL, p->chunk_size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p->scratch == MAP_FAILED)
+	fault_error("Out of memory for a packed image\n");
+    take_slot(p, chunk);
+}
+
+/* write_fault stops a tool that writes to a packed image.  Like
+   fault_error it runs in the signal handler, so the message is put
+   together by hand and written with write(2); whatever the tool still
+   has buffered in stdio is lost. */
+static void write_fault(struct packed *p, uint8_t *addr)
+{
+    char msg[512], digits[24];
+    size_t at = addr - p->base;
+    int n = sizeof(digits);
+
+    digits[--n] = '\0';
+    do
+    {
+	digits[--n] = '0' + at % 10;
+	at /= 10;
+    } while (at > 0);
+
+    msg[0] = '\0';
+    strncat(msg, program_invocation_short_name, 64);
+    strcat(msg, ": can't change packed image ");
+    strncat(msg, p->path, 320);
+    strcat(msg, " (at byte ");
+    strcat(msg, digits + n);
+    strcat(msg, "); packed images are read only\n");
+    fault_error(msg);
+}
+
+/* A loaded chunk is readable, so a fault on one is either a write or
+   a read that raced with another thread loading it.  The thread tries
+   again; if it faults at the same address while the same load of the
+   chunk is still there, the page was readable all along, and it was a
+   write.  With private writes the chunk is made writable and pinned
+   for good, so the change stays until the image is unmapped. */
+static void pack_fault(int sig, siginfo_t *si, void *ctx)
+{
+    uint8_t *addr = si->si_addr;
+    struct packed *p = NULL;
+    uint32_t chunk;
+    int i;
+
+    (void)sig;
+    (void)ctx;
+    for (i = 0; i < npacks; i++)
+	if (packs[i].base != NULL && addr >= packs[i].base
+	    && addr < packs[i].base + packs[i].mapsize)
+	    p = &packs[i];
+    if (p == NULL)
+    {
+	/* not ours, so fault again the usual way */
+	sigaction(SIGSEGV, &old_segv, NULL);
+	return;
+    }
+
+    chunk = (addr - p->base) / p->chunk_size;
+    while (__sync_lock_test_and_set(&pack_lock, 1))
+	;
+    if (!p->loaded[chunk])
+    {
+	last_fault = NULL;
+	load_chunk(p, chunk);
+    }
+    else if (last_fault == addr && last_gen == p->gen[chunk] && !private_writes)
+    {
+	__sync_lock_release(&pack_lock);
+	write_fault(p, addr);
+    }
+    else if (last_fault == addr && last_gen == p->gen[chunk])
+    {
+	STAT_INC(syscalls);
+	if (mprotect(p->base + (size_t)chunk * p->chunk_size, p->chunk_size,
+		     PROT_READ | PROT_WRITE) < 0)
+	    fault_error("Can't make a chunk of a packed image writable\n");
+	p->pins[chunk]++;
+	p->ndirty++;
+	last_fault = NULL;
+    }
+    else
+    {
+	last_fault = addr;
+	last_gen = p->gen[chunk];
+    }
+    __sync_lock_release(&pack_lock);
+}
+
+
+/* find_pack finds the packed image p is in, if any, and the chunks
+   under len bytes at p, no more than PACK_CACHE / 8 of them */
+static struct packed *find_pack(const uint8_t *p, size_t *len,
+				uint32_t *first, uint32_t *last)
+{
+    struct packed *pk;
+
+    for (pk = packs; pk < packs + npacks; pk++)
+    {
+	if (pk->base == NULL || p < pk->base || p >= pk->base + pk->mapsize || *len == 0)
+	    continue;
+	*first = (p - pk->base) / pk->chunk_size;
+	*last = (p + *len - 1 - pk->base) / pk->chunk_size;
+	if (*last >= *first + PACK_CACHE / 8)
+	{
+	    *last = *first + PACK_CACHE / 8 - 1;
+	    *len = pk->base + (size_t)(*last + 1) * pk->chunk_size - p;
+	}
+	if (*last >= pk->nchunks)
+	    *last = pk->nchunks - 1;
+	return pk;
+    }
+    return NULL;
+}
+
+/* packed_fault_in loads the chunks under len bytes at p, for a system
+   call to read, and returns how many of the bytes it loaded: no more
+   than PACK_CACHE / 8 chunks.  They are pinned, so that nothing drops
+   them before the system call is done, until packed_release is called
+   with what this returned.  Other memory is left alone. */
+size_t packed_fault_in(const uint8_t *p, size_t len)
+{
+    struct packed *pk;
+    uint32_t chunk, last;
+
+    pk = find_pack(p, &len, &chunk, &last);
+    if (pk == NULL)
+	return len;
+    while (__sync_lock_test_and_set(&pack_lock, 1))
+	;
+    for (; chunk <= last; chunk++)
+    {
+	if (!pk->loaded[chunk])
+	    load_chunk(pk, chunk);
+	pk->pins[chunk]++;
+	pk->slot_used[pk->loaded[chunk] - 1] = ++pk->clock;
+    }
+    __sync_lock_release(&pack_lock);
+    return len;
+}
+
+/* packed_release unpins what packed_fault_in pinned; if pinned chunks
+   had made the cache grow, they are dropped as they come free */
+void packed_release(const uint8_t *p, size_t len)
+{
+    struct packed *pk;
+    uint32_t chunk, last;
+
+    pk = find_pack(p, &len, &chunk, &last);
+    if (pk == NULL)
+	return;
+    while (__sync_lock_test_and_set(&pack_lock, 1))
+	;
+    for (; chunk <= last; chunk++)
+	if (--pk->pins[chunk] == 0 && pk->nslots > PACK_CACHE)
+	    drop_slot(pk, pk->loaded[chunk] - 1);
+    __sync_lock_release(&pack_lock);
+}
+
+/* packed_private_writes lets the tool change packed images it maps
+   from now on.  The changes are kept in memory, and are dropped when
+   the image is unmapped, so a checker can go on past a repair and see
+   what it would have found. */
+void packed_private_writes(void)
+{
+    private_writes = 1;
+}
+
+/* packed_file says whether path is a packed image */
+int packed_file(const char *path)
+{
+    char magic[8];
+    int fd, is_packed;
+
+    STAT_ADD(syscalls, 3);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+	return 0;
+    is_packed = pread(fd, magic, 8, 0) == 8 && memcmp(magic, PACK_MAGIC, 8) == 0;
+    close(fd);
+    return is_packed;
+}
+
+static void bad_packed(const char *path, const char *why)
+{
+    fprintf(stderr, "%s is not a usable packed image: %s\n", path, why);
+    exit(1);
+}
+
+/* packed_map reserves the address space for the image, with no access,
+   and reads the index; the chunks come in as they are touched */
+uint8_t *packed_map(const char *path, int *fd, size_t *size)
+{
+    struct packed *p;
+    struct sigaction sa;
+    uint8_t head[PACK_HEADER], *raw;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t want, i;
+
+    for (p = packs; p < packs + npacks && p->base != NULL; p++)
+	;
+    if (p == packs + MAXPACKED)
+    {
+	fprintf(stderr, "Too many packed images open\n");
+	exit(1);
+    }
+    memset(p, 0, sizeof(*p));
+    p->path = strdup(path);
+
+    STAT_ADD(syscalls, 2);
+    p->fd = *fd = open(path, O_RDONLY);
+    if (*fd < 0 || pread(*fd, head, PACK_HEADER, 0) != PACK_HEADER)
+    {
+	fprintf(stderr, "Cannot read packed image %s:\n%s\n", path, strerror(errno));
+	exit(1);
+    }
+    if (memcmp(head, PACK_MAGIC, 8) != 0)
+	bad_packed(path, "bad header");
+    p->chunk_size = (uint32_t)getulong(head + 8);
+    p->nchunks = (uint32_t)getulong(head + 12);
+    p->size = (uint32_t)getulong(head + 16) | (uint64_t)(uint32_t)getulong(head + 20) << 32;
+    if (p->chunk_size == 0 || p->chunk_size % page != 0 || p->chunk_size > PACK_MAXCHUNK)
+	bad_packed(path, "bad chunk size");
+    if (p->nchunks != (p->size + p->chunk_size - 1) / p->chunk_size)
+	bad_packed(path, "wrong number of chunks");
+    p->mapsize = (size_t)p->nchunks * p->chunk_size;
+
+    raw = malloc((size_t)p->nchunks * PACK_ENTRY + 1);
+    p->index = malloc((p->nchunks + 1) * sizeof(struct pack_entry));
+    STAT_INC(syscalls);
+    if (raw == NULL || p->index == NULL
+	|| pread(*fd, raw, (size_t)p->nchunks * PACK_ENTRY, PACK_HEADER)
+	   != (ssize_t)p->nchunks * PACK_ENTRY)
+	bad_packed(path, "truncated index");
+    for (i = 0; i < p->nchunks; i++)
+    {
+	struct pack_entry *e = &p->index[i];
+	uint8_t *r = raw + i * PACK_ENTRY;
+
+	e->offset = (uint32_t)getulong(r) | (uint64_t)(uint32_t)getulong(r + 4) << 32;
+	e->len = (uint32_t)getulong(r + 8);
+	e->method = (uint32_t)getulong(r + 12);
+	want = p->size - i * p->chunk_size < p->chunk_size
+	    ? p->size - i * p->chunk_size : p->chunk_size;
+	if ((e->method == PACK_ZERO && e->len != 0)
+	    || (e->method == PACK_RAW && e->len != want)
+	    || (e->method == PACK_LZ && (e->len == 0 || e->len > p->chunk_size))
+	    || e->method > PACK_LZ)
+	    bad_packed(path, "bad index entry");
+    }
+    free(raw);
+
+    p->loaded = calloc(p->nchunks + 1, sizeof(uint32_t));
+    p->pins = calloc(p->nchunks + 1, sizeof(uint32_t));
+    p->gen = calloc(p->nchunks + 1, sizeof(uint64_t));
+    p->slot_chunk = malloc((p->nchunks + 1) * sizeof(uint32_t));
+    p->slot_used = malloc((p->nchunks + 1) * sizeof(uint64_t));
+    p->cbuf = malloc(p->chunk_size);
+    STAT_ADD(syscalls, 2);
+    p->scratch = mmap(NULL, p->chunk_size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    p->base = mmap(NULL, p->mapsize, PROT_NONE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p->path == NULL || p->loaded == NULL || p->pins == NULL || p->gen == NULL
+	|| p->slot_chunk == NULL || p->slot_used == NULL || p->cbuf == NULL
+	|| p->scratch == MAP_FAILED || p->base == MAP_FAILED)
+    {
+	fprintf(stderr, "Out of memory for packed image %s\n", path);
+	exit(1);
+    }
+
+    if (npacks == 0)
+    {
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = pack_fault;
+	sa.sa_flags = SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGSEGV, &sa, &old_segv);
+    }
+    if (p == packs + npacks)
+	npacks++;
+    *size = p->size;
+    return p->base;
+}
+
+/* packed_unmap unmaps image if it is a packed image, and says whether
+   it was; the caller closes the file */
+int packed_unmap(uint8_t *image)
+{
+    struct packed *p;
+
+    for (p = packs; p < packs + npacks; p++)
+    {
+	if (p->base != image || image == NULL)
+	    continue;
+	if (p->ndirty > 0)
+	    fprintf(stderr, "The changes to packed image %s were not saved\n", p->path);
+	STAT_ADD(syscalls, 2);
+	munmap(p->base, p->mapsize);
+	munmap(p->scratch, p->chunk_size);
+	free(p->path);
+	free(p->index);
+	free(p->loaded);
+	free(p->pins);
+	free(p->gen);
+	free(p->slot_chunk);
+	free(p->slot_used);
+	free(p->cbuf);
+	p->base = NULL;
+	return 1;
+    }
+    return 0;
+}
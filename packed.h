@@ -0,0 +1,72 @@
+#ifndef __PACKED_H__
+#define __PACKED_H__
+
+/* Packed images: a disk image cut into fixed-size chunks, each one
+   compressed on its own, with an index saying where each chunk is.
+   dos_pack makes them.
+
+   mmap_file recognises a packed image and maps it anyway, so every
+   tool can read one as it is.  The image is mapped with no access at
+   all, and the first touch of a chunk faults; the SIGSEGV handler
+   reads just that chunk, decompresses it and moves it into place, so
+   a tool only ever decompresses the chunks it looks at.  A few chunks
+   are kept (PACK_CACHE per image); past that the one loaded or handed
+   to packed_fault_in longest ago is dropped, and read again if it is
+   touched again.  Packed images are read only: a tool that tries to
+   change one is stopped with an error, unless it has asked for
+   packed_private_writes, when the changed chunks are kept in memory
+   until the image is unmapped and then thrown away.
+
+   The kernel doesn't fault chunks in for us, so before part of the
+   image is handed to write(2) and friends it has to go through
+   packed_fault_in, which loads and pins it and says how much of it (a
+   few chunks at most) is safe to pass on, and afterwards through
+   packed_release.  Pinned chunks are never dropped, however many
+   threads are doing the same.
+
+   A packed image is, with all numbers little endian:
+
+     8 bytes   "DOSPAK1\n"
+     uint32    chunk size, a multiple of the page size
+     uint32    number of chunks
+     uint64    size of the image
+
+   then for each chunk a 16 byte index entry: a uint64 file offset,
+   a uint32 length and a uint32 method (enum pack_method), and after
+   that the chunks themselves.  The last chunk may be short.
+
+   The codec is a small LZ77 in the style of LZ4: a token byte gives
+   the number of literals and the match length in its two nibbles (15
+   means more length bytes follow, each adding up to 255), then the
+   literals, then a 2 byte offset back to the match.  The last
+   sequence is literals only. */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define PACK_MAGIC "DOSPAK1\n"
+#define PACK_HEADER 24
+#define PACK_ENTRY 16
+#define PACK_CHUNK (64 * 1024)	/* the default chunk size */
+#define PACK_MAXCHUNK (1024 * 1024)
+#define PACK_CACHE 32		/* decompressed chunks kept per image */
+
+enum pack_method
+{
+    PACK_ZERO,			/* all zeroes, no data stored */
+    PACK_RAW,			/* stored as it is */
+    PACK_LZ			/* compressed */
+};
+
+int packed_file(const char *path);
+uint8_t *packed_map(const char *path, int *fd, size_t *size);
+int packed_unmap(uint8_t *image);
+size_t packed_fault_in(const uint8_t *p, size_t len);
+void packed_release(const uint8_t *p, size_t len);
+void packed_private_writes(void);
+
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+ssize_t lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+
+#endif // __PACKED_H__
@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "direntry.h"
+#include "dos.h"
+#include "report.h"
+
+#define REPORT_BUFSIZE (1 << 20)
+#define REPORT_MAXREC 2048	/* more than any one record needs */
+
+int report_quiet;
+
+static enum report_format report_format = REPORT_HUMAN;
+static uint8_t *report_buf;
+static uint32_t report_used;
+
+
+void report_flush(void)
+{
+    uint8_t *p = report_buf;
+    ssize_t n;
+
+    while (report_used > 0) 
+    {
+	n = write(STDOUT_FILENO, p, report_used);
+	if (n < 0) 
+	{
+	    if (errno == EINTR)
+		continue;
+	    /* nowhere left to report to */
+	    report_used = 0;
+	    return;
+	}
+	p += n;
+	report_used -= n;
+    }
+}
+
+/* report_space makes sure there's room for one more record */
+static char *report_space(void)
+{
+    if (report_buf == NULL) 
+    {
+	report_buf = malloc(REPORT_BUFSIZE);
+	if (report_buf == NULL) 
+	{
+	    fprintf(stderr, "Out of memory for report buffer\n");
+	    exit(1);
+	}
+	atexit(report_flush);
+	if (report_format == REPORT_BINARY) 
+	{
+	    memcpy(report_buf, "DOSRPT1\n", 8);
+	    report_used = 8;
+	}
+    }
+    if (report_used + REPORT_MAXREC > REPORT_BUFSIZE)
+	report_flush();
+    return (char*)report_buf + report_used;
+}
+
+/* report_printf appends formatted text; records are always short */
+static void report_printf(const char *fmt, ...) 
+    __attribute__((format(printf, 1, 2)));
+
+static void report_printf(const char *fmt, ...)
+{
+    char *p = report_space();
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(p, REPORT_MAXREC, fmt, ap);
+    va_end(ap);
+    if (n >= REPORT_MAXREC)
+	n = REPORT_MAXREC - 1;
+    if (n > 0)
+	report_used += n;
+}
+
+/* json_name copies a name into a JSON string literal, escaping
+   anything odd a corrupt directory might hold */
+static const char *json_name(const char *name, char *buf, size_t size)
+{
+    char *p = buf;
+
+    *p++ = '"';
+    for (; *name && p + 8 < buf + size; name++) 
+    {
+	uint8_t c = *name;
+
+	if (c == '"' || c == '\\') 
+	{
+	    *p++ = '\\';
+	    *p++ = c;
+	}
+	else if (c < 0x20 || c >= 0x7f)
+	    p += sprintf(p, "\\u%04x", c);
+	else
+	    *p++ = c;
+    }
+    *p++ = '"';
+    *p = '\0';
+    return buf;
+}
+
+static void binary_record(enum report_type type, int kind, int depth, 
+			  uint8_t attr, uint16_t cluster, uint32_t size,
+			  const char *name, const char *ext)
+{
+    uint8_t *p = (uint8_t*)report_space();
+    size_t name_len = name ? strnlen(name, 255) : 0;
+    size_t ext_len = ext ? strnlen(ext, 255) : 0;
+
+    if (12 + name_len + ext_len > REPORT_MAXREC)
+	name_len = ext_len = 0;
+    p[0] = type;
+    p[1] = kind;
+    p[2] = depth > 255 ? 255 : depth;
+    p[3] = attr;
+    p[4] = cluster & 0xff;
+    p[5] = cluster >> 8;
+    p[6] = name_len;
+    p[7] = ext_len;
+    p[8] = size & 0xff;
+    p[9] = (size >> 8) & 0xff;
+    p[10] = (size >> 16) & 0xff;
+    p[11] = size >> 24;
+    memcpy(p + 12, name, name_len);
+    memcpy(p + 12 + name_len, ext, ext_len);
+    report_used += 12 + name_len + ext_len;
+}
+
+
+void report_volume(const char *name)
+{
+    char js[6 * MAXFILENAME + 3];
+
+    if (report_quiet)
+	return;
+    if (report_format == REPORT_BINARY)
+	binary_record(REC_VOLUME, 0, 0, 0, 0, 0, name, NULL);
+    else if (report_format == REPORT_JSONL)
+	report_printf("{\"type\":\"volume\",\"name\":%s}\n", json_name(name, js, sizeof(js)));
+    else
+	report_printf("Volume: %s\n", name);
+}
+
+void report_dir(int depth, const char *name, uint16_t cluster)
+{
+    char js[6 * MAXFILENAME + 3];
+
+    if (report_quiet)
+	return;
+    if (report_format == REPORT_BINARY)
+	binary_record(REC_DIR, 0, depth, 0, cluster, 0, name, NULL);
+    else if (report_format == REPORT_JSONL)
+	report_printf("{\"type\":\"dir\",\"depth\":%d,\"name\":%s,\"cluster\":%u}\n",
+		      depth, json_name(name, js, sizeof(js)), cluster);
+    else
+	report_printf("%*s%s/ (directory)\n", depth * 4, "", name);
+}
+
+void report_file(int depth, const char *name, const char *ext,
+		 uint32_t size, uint16_t cluster, uint8_t attr)
+{
+    char js[6 * MAXFILENAME + 3], jx[6 * MAXFILENAME + 3];
+    char flags[5];
+
+    if (report_quiet)
+	return;
+    flags[0] = (attr & ATTR_READONLY) ? 'r' : ' ';
+    flags[1] = (attr & ATTR_HIDDEN) ? 'h' : ' ';
+    flags[2] = (attr & ATTR_SYSTEM) ? 's' : ' ';
+    flags[3] = (attr & ATTR_ARCHIVE) ? 'a' : ' ';
+    flags[4] = '\0';
+
+    if (report_format == REPORT_BINARY)
+	binary_record(REC_FILE, 0, depth, attr, cluster, size, name, ext);
+    else if (report_format == REPORT_JSONL)
+	report_printf("{\"type\":\"file\",\"depth\":%d,\"name\":%s,\"ext\":%s,"
+		      "\"size\":%u,\"cluster\":%u,\"attr\":\"%s\"}\n",
+		      depth, json_name(name, js, sizeof(js)), json_name(ext, jx, sizeof(jx)), 
+		      size, cluster, flags);
+    else
+	report_printf("%*s%s.%s (%u bytes) (starting cluster %d) %s\n", 
+		      depth * 4, "", name, ext, size, cluster, flags);
+}
+
+void report_finding(enum finding_kind kind, const char *name, uint16_t cluster)
+{
+    static const char *kinds[] = 
+	{ "", "bad_cluster", "missing_block", "excessive_blocks", "orphan" };
+    char js[6 * MAXFILENAME + 3];
+
+    if (report_format == REPORT_BINARY) 
+    {
+	binary_record(REC_FINDING, kind, 0, 0, cluster, 0, name, NULL);
+	return;
+    }
+    if (report_format == REPORT_JSONL) 
+    {
+	report_printf("{\"type\":\"finding\",\"kind\":\"%s\",\"name\":%s,\"cluster\":%u}\n",
+		      kinds[kind], json_name(name ? name : "", js, sizeof(js)), cluster);
+	return;
+    }
+
+    switch (kind) 
+    {
+    case FIND_BAD_CLUSTER:
+	report_printf("Bad referenced from cluster: %d\n", cluster);
+	break;
+    case FIND_MISSING_BLOCK:
+	report_printf("missing block: name of file is %s\n", name);
+	break;
+    case FIND_EXCESS_BLOCKS:
+	report_printf("excessive blocks: name of file is %s\n", name);
+	break;
+    case FIND_ORPHAN:
+	report_printf("Orphan cluster: %d\n", cluster);
+	break;
+    }
+}
+
+void report_usage(int depth, const char *path, uint64_t bytes, 
+		  uint32_t clusters, uint32_t clust_size, uint32_t files)
+{
+    char js[6 * MAXPATHLEN + 3];
+    uint8_t *p;
+
+    if (report_format == REPORT_BINARY) 
+    {
+	binary_record(REC_USAGE, 0, depth, 0, clusters, 
+		      bytes > UINT32_MAX ? UINT32_MAX : bytes, path, NULL);
+	p = report_buf + report_used;
+	p[0] = files & 0xff;
+	p[1] = (files >> 8) & 0xff;
+	p[2] = (files >> 16) & 0xff;
+	p[3] = files >> 24;
+	report_used += 4;
+    }
+    else if (report_format == REPORT_JSONL)
+	report_printf("{\"type\":\"usage\",\"depth\":%d,\"path\":%s,\"bytes\":%llu,"
+		      "\"clusters\":%u,\"alloc_bytes\":%llu,\"files\":%u}\n",
+		      depth, json_name(path, js, sizeof(js)), (unsigned long long)bytes,
+		      clusters, (unsigned long long)clusters * clust_size, files);
+    else
+	report_printf("%12llu %12llu %8u  %s\n", (unsigned long long)bytes,
+		      (unsigned long long)clusters * clust_size, files, path);
+}
+
+void report_count(const char *name, uint32_t value)
+{
+    if (report_format == REPORT_BINARY)
+	binary_record(REC_COUNT, 0, 0, 0, 0, value, name, NULL);
+    else if (report_format == REPORT_JSONL)
+	report_printf("{\"type\":\"count\",\"name\":\"%s\",\"value\":%u}\n", name, value);
+    else
+	report_printf("%s: %u\n", name, value);
+}
+
+
+/* report_option takes --quiet, --verbose and --format (human, jsonl
+   or binary, as --format=F or --format F) out of the command line,
+   and returns the format chosen.  --verbose may be repeated. */
+int report_option(int *argc, char **argv)
+{
+    int i, j, used;
+    char *fmt;
+
+    for (i = 1; i < *argc; ) 
+    {
+	used = 0;
+	fmt = NULL;
+	if (strcmp(argv[i], "--quiet") == 0) 
+	{
+	    report_quiet = 1;
+	    used = 1;
+	}
+	else if (strcmp(argv[i], "--verbose") == 0) 
+	{
+	    dos_verbosity++;
+	    used = 1;
+	}
+	else if (strncmp(argv[i], "--format=", 9) == 0) 
+	{
+	    fmt = argv[i] + 9;
+	    used = 1;
+	}
+	else if (strcmp(argv[i], "--format") == 0 && i + 1 < *argc) 
+	{
+	    fmt = argv[i + 1];
+	    used = 2;
+	}
+
+	if (fmt != NULL) 
+	{
+	    if (strcmp(fmt, "human") == 0)
+		report_format = REPORT_HUMAN;
+	    else if (strcmp(fmt, "jsonl") == 0 || strcmp(fmt, "json") == 0)
+		report_format = REPORT_JSONL;
+	    else if (strcmp(fmt, "binary") == 0)
+		report_format = REPORT_BINARY;
+	    else 
+	    {
+		fprintf(stderr, "%s: unknown report format %s\n", argv[0], fmt);
+		exit(1);
+	    }
+	}
+	if (used == 0) 
+	{
+	    i++;
+	    continue;
+	}
+	for (j = i; j + used <= *argc; j++)
+	    argv[j] = argv[j + used];
+	*argc -= used;
+    }
+    return report_format;
+}
@@ -0,0 +1,73 @@
+#ifndef __REPORT_H__
+#define __REPORT_H__
+
+/* Structured output for dos_ls and scandisk.
+
+   Everything a tool reports goes through here, into one large buffer
+   that is written to stdout with write(2) when it fills and at exit.
+   The format is picked on the command line:
+
+     --format human   the traditional listing (the default)
+     --format jsonl   one JSON object per line
+     --format binary  compact records, described below
+     --quiet          leave out the listing; findings are still reported
+     --verbose        more debugging chatter on stderr (repeatable)
+
+   A binary report starts with the 8 bytes "DOSRPT1\n".  Each record
+   is then a fixed 12 byte header followed by the name:
+
+     uint8   type (enum report_type)
+     uint8   kind (enum finding_kind, findings only)
+     uint8   depth
+     uint8   attributes
+     uint16  cluster, little endian
+     uint8   name length
+     uint8   extension length
+     uint32  size or count, little endian
+
+   and then the name and extension bytes, not NUL terminated.  In a
+   usage record the name is the directory's path, the cluster field
+   the clusters allocated under it, and the size its logical bytes;
+   a uint32 count of files follows the name. */
+
+#include <stdint.h>
+
+enum report_format 
+{
+    REPORT_HUMAN,
+    REPORT_JSONL,
+    REPORT_BINARY
+};
+
+enum report_type 
+{
+    REC_VOLUME = 1,
+    REC_DIR,
+    REC_FILE,
+    REC_FINDING,
+    REC_COUNT,			/* a named summary number */
+    REC_USAGE			/* disk usage of a directory tree */
+};
+
+enum finding_kind 
+{
+    FIND_BAD_CLUSTER = 1,	/* a chain runs into a bad cluster */
+    FIND_MISSING_BLOCK,		/* the chain is longer than the size */
+    FIND_EXCESS_BLOCKS,		/* the chain is shorter than the size */
+    FIND_ORPHAN			/* allocated but not referenced */
+};
+
+extern int report_quiet;
+
+int report_option(int *, char **);
+void report_volume(const char *name);
+void report_dir(int depth, const char *name, uint16_t cluster);
+void report_file(int depth, const char *name, const char *ext,
+		 uint32_t size, uint16_t cluster, uint8_t attr);
+void report_finding(enum finding_kind kind, const char *name, uint16_t cluster);
+void report_count(const char *name, uint32_t value);
+void report_usage(int depth, const char *path, uint64_t bytes, 
+		  uint32_t clusters, uint32_t clust_size, uint32_t files);
+void report_flush(void);
+
+#endif // __REPORT_H__
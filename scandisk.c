@@ -14,15 +14,107 @@
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
+#include "overlay.h"
+#include "packed.h"
+#include "stats.h"
+#include "trace.h"
+#include "bitmap.h"
+#include "dos_dir.h"
+#include "report.h"
+
+
+/* Incremental checking (-i statefile).  After a clean check we save
+   a hash of every FAT sector and of every directory, and for each
+   directory the FAT sectors its entries' chains run through and the
+   clusters they reference.  On the next run, a directory that hashes
+   the same and whose FAT sectors are unchanged must give the same
+   findings, so we replay its references instead of analyzing it
+   again.  Its entries are still listed, from the directory itself,
+   so the output is the same either way. */
+
+#define STATE_MAGIC "SDSTATE2"
+#define MAX_FAT_SECS 32
+#define MAX_CLUSTERS 4096
+
+struct extent 
+{
+    uint16_t start;
+    uint16_t len;
+};
+
+struct dir_record 
+{
+    uint16_t cluster;		/* first cluster, 0 for the root */
+    uint32_t fat_mask;		/* FAT sectors its chains run through */
+    uint64_t hash;		/* hash of the directory's contents */
+    uint32_t nextents;
+    struct extent *extents;	/* clusters its entries reference */
+};
+
+struct inc_state 
+{
+    uint32_t geometry[6];
+    uint32_t nfatsecs;
+    uint64_t fat_hash[MAX_FAT_SECS];
+    uint32_t ndirs, size;
+    struct dir_record *dirs;
+};
+
+static struct inc_state *old_state;	/* from the last clean check */
+static struct inc_state *new_state;	/* being built by this one */
+static struct dir_record *old_dirs[MAX_CLUSTERS];
+static uint32_t changed_fat;		/* FAT sectors unlike old_state's */
+static int cur_rec = -1;		/* index in new_state->dirs */
+static int replaying;			/* listing a replayed directory */
+static int bytes_per_sec;
+static int repairs_made, repairs_seen;
+static int dirs_checked, dirs_reused;
+
+
+/* fat_sectors returns the mask of FAT sectors holding cluster's entry */
+static uint32_t fat_sectors(uint16_t cluster)
+{
+    uint32_t offset = cluster + cluster / 2;
 
+    return (1u << (offset / bytes_per_sec)) | (1u << ((offset + 1) / bytes_per_sec));
+}
 
-void update_bitmap(uint16_t cluster, uint8_t *clust_bitmap)
+/* note_cluster records that the directory being analyzed references
+   cluster */
+static void note_cluster(uint16_t cluster)
 {
-    clust_bitmap[cluster/8] |= (1 << (7 - (cluster % 8)));
+    struct dir_record *rec;
+    struct extent *last;
+
+    if (cur_rec < 0 || cluster >= MAX_CLUSTERS)
+	return;
+    rec = &new_state->dirs[cur_rec];
+    rec->fat_mask |= fat_sectors(cluster);
+    last = rec->nextents ? &rec->extents[rec->nextents - 1] : NULL;
+    if (last != NULL && last->start + last->len == cluster) 
+    {
+	last->len++;
+	return;
+    }
+    if ((rec->nextents & (rec->nextents - 1)) == 0) 
+    {
+	rec->extents = realloc(rec->extents, 
+			       (rec->nextents ? rec->nextents * 2 : 1) * sizeof(struct extent));
+	if (rec->extents == NULL) 
+	{
+	    fprintf(stderr, "Out of memory\n");
+	    exit(1);
+	}
+    }
+    rec->extents[rec->nextents].start = cluster;
+    rec->extents[rec->nextents].len = 1;
+    rec->nextents++;
 }
 
-uint16_t is_data_cluster(uint16_t cluster, uint8_t *clust_bitmap){
-    return clust_bitmap[cluster/8] & (1 << (7 - (cluster % 8)));
+void update_bitmap(uint16_t cluster, struct bitmap *clust_bitmap)
+{
+    bitmap_set(clust_bitmap, cluster);
+    note_cluster(cluster);
 }
 
 
@@ -31,6 +123,7 @@ uint16_t is_data_cluster(uint16_t cluster, uint8_t *clust_bitmap){
 
 
 
+
 /* write the values into a directory entry */
 void write_dirent(struct direntry *dirent, char *filename, 
 		  uint16_t start_cluster, uint32_t size)
@@ -99,50 +192,26 @@ void write_dirent(struct direntry *dirent, char *filename,
 
 
 
-/* create_dirent finds a free slot in the directory, and write the
-   directory entry */
+/* create_dirent writes a directory entry into a free slot from the
+   directory's index; it fails only if the directory is full */
 
-void create_dirent(struct direntry *dirent, char *filename, 
-		   uint16_t start_cluster, uint32_t size,
-		   uint8_t *image_buf, struct bpb33* bpb)
+int create_dirent(struct dir_index *dir, char *filename, 
+		  uint16_t start_cluster, uint32_t size)
 {
-    while (1) 
-    {
-	if (dirent->deName[0] == SLOT_EMPTY) 
-	{
-	    /* we found an empty slot at the end of the directory */
-	    write_dirent(dirent, filename, start_cluster, size);
-	    dirent++;
-
-	    /* make sure the next dirent is set to be empty, just in
-	       case it wasn't before */
-	    memset((uint8_t*)dirent, 0, sizeof(struct direntry));
-	    dirent->deName[0] = SLOT_EMPTY;
-	    return;
-	}
+    struct direntry *dirent = dir_index_slot(dir);
 
-	if (dirent->deName[0] == SLOT_DELETED) 
-	{
-	    /* we found a deleted entry - we can just overwrite it */
-	    write_dirent(dirent, filename, start_cluster, size);
-	    return;
-	}
-	dirent++;
-    }
+    if (dirent == NULL)
+        return -1;
+    write_dirent(dirent, filename, start_cluster, size);
+    return 0;
 }
 
 
-
-
-
-
-
-
 int is_taken_cluster(uint16_t cluster, struct bpb33 *bpb, uint8_t *image_buf)
 {
     uint16_t max_cluster = (bpb->bpbSectors / bpb->bpbSecPerClust) & FAT12_MASK;
     if (get_fat_entry(cluster, image_buf, bpb) == (FAT12_MASK & CLUST_BAD)){
-        printf("BAD\n");
+        dos_debug(2, "Bad cluster %d\n", cluster);
     }
     return  cluster >= (FAT12_MASK & CLUST_FIRST) && 
             cluster <= (FAT12_MASK & CLUST_LAST) &&
@@ -153,13 +222,11 @@ int is_taken_cluster(uint16_t cluster, struct bpb33 *bpb, uint8_t *image_buf)
 }
 
 void reclaim_blocks(uint16_t startCluster, uint8_t *image_buf, struct bpb33* bpb, int size_sig){
-    printf("func!\n");
     int bytesPerClust = bpb->bpbBytesPerSec * bpb->bpbSecPerClust; // # of bytes in a cluster (512)
     double num_blocks = (size_sig / bytesPerClust) + 0.99; // should be ceil()!!
     uint16_t cluster = startCluster;
     for (int i=0; i<num_blocks-1; i++){ // -1 so we can set the LAST cluster to eof
         cluster = get_fat_entry(cluster, image_buf, bpb);
-        printf("for!\n");
     }
     uint16_t old_fat_entry = cluster;
     cluster = get_fat_entry(cluster, image_buf, bpb);
@@ -169,7 +236,6 @@ void reclaim_blocks(uint16_t startCluster, uint8_t *image_buf, struct bpb33* bpb
         old_fat_entry = cluster;
         cluster = get_fat_entry(cluster, image_buf, bpb);
         set_fat_entry(old_fat_entry, FAT12_MASK & CLUST_FREE, image_buf, bpb);
-        printf("while!\n");
     }
 }
 
@@ -180,7 +246,6 @@ void declaim_blocks(struct direntry *dirent, uint8_t *image_buf, struct bpb33* b
     uint16_t old_fat_entry = cluster;
     int cl_count = 0;
     while(is_taken_cluster(cluster, bpb, image_buf) && cluster != (FAT12_MASK & CLUST_EOFS)){ // adding eofs to taken cluster messes up badimage1 - fix!!!!!
-        printf("loop!\n");
         old_fat_entry = cluster;
         cluster = get_fat_entry(cluster, image_buf, bpb);
         cl_count++;
@@ -191,14 +256,7 @@ void declaim_blocks(struct direntry *dirent, uint8_t *image_buf, struct bpb33* b
 
 // TAKEN FROM DOS_LS.C. COPYRIGHT JOEL SOMMERS
 
-void print_indent(int indent)
-{
-    int i;
-    for (i = 0; i < indent*4; i++)
-	printf(" ");
-}
-
-uint16_t analyze_dirent(struct direntry *dirent, int indent, uint8_t *image_buf, struct bpb33* bpb, uint8_t *clust_bitmap)
+uint16_t analyze_dirent(struct direntry *dirent, int indent, uint8_t *image_buf, struct bpb33* bpb, struct bitmap *clust_bitmap)
 {
     uint16_t followclust = 0;
 
@@ -211,6 +269,7 @@ uint16_t analyze_dirent(struct direntry *dirent, int indent, uint8_t *image_buf,
     extension[3] = ' ';
     memcpy(name, &(dirent->deName[0]), 8);
     memcpy(extension, dirent->deExtension, 3);
+    STAT_INC(dirents_parsed);
     if (name[0] == SLOT_EMPTY){
 	    return followclust;
     }
@@ -248,20 +307,20 @@ uint16_t analyze_dirent(struct direntry *dirent, int indent, uint8_t *image_buf,
 	    // printf("Win95 long-filename entry seq 0x%0x\n", dirent->deName[0]);
     }
     else if ((dirent->deAttributes & ATTR_VOLUME) != 0) {
-	    printf("Volume: %s\n", name);
+	    report_volume(name);
     } 
     else if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) {
         // don't deal with hidden directories; MacOS makes these
         // for trash directories and such; just ignore them.
 	    
         if ((dirent->deAttributes & ATTR_HIDDEN) != ATTR_HIDDEN){
-	        print_indent(indent);
-    	    printf("%s/ (directory)\n", name);
             file_cluster = getushort(dirent->deStartCluster);
+            report_dir(indent, name, file_cluster);
             followclust = file_cluster;
             
             uint16_t cluster = file_cluster;
-            while (!is_end_of_file(cluster)) {
+            // a replayed directory's references are already marked
+            while (!replaying && !is_end_of_file(cluster)) {
                 update_bitmap(cluster, clust_bitmap);
                 cluster = get_fat_entry(cluster, image_buf, bpb);
             }
@@ -273,19 +332,11 @@ uint16_t analyze_dirent(struct direntry *dirent, int indent, uint8_t *image_buf,
          * print attributes, size, starting cluster, etc.
          */
 
-	    int ro = (dirent->deAttributes & ATTR_READONLY) == ATTR_READONLY;
-	    int hidden = (dirent->deAttributes & ATTR_HIDDEN) == ATTR_HIDDEN;
-	    int sys = (dirent->deAttributes & ATTR_SYSTEM) == ATTR_SYSTEM;
-	    int arch = (dirent->deAttributes & ATTR_ARCHIVE) == ATTR_ARCHIVE;
-
 	    size = getulong(dirent->deFileSize);
-	    print_indent(indent);
-	    printf("%s.%s (%u bytes) (starting cluster %d) %c%c%c%c\n", 
-	        name, extension, size, getushort(dirent->deStartCluster),
-	            ro?'r':' ', 
-                hidden?'h':' ', 
-                sys?'s':' ', 
-                arch?'a':' ');
+	    report_file(indent, name, extension, size, 
+	                getushort(dirent->deStartCluster), dirent->deAttributes);
+        if (replaying)
+            return followclust;
         
         int cl_count = 0; //#of clusters in a file
         int bytesPerClust = bpb->bpbBytesPerSec * bpb->bpbSecPerClust; // # of bytes in a cluster (512)
@@ -293,14 +344,17 @@ uint16_t analyze_dirent(struct direntry *dirent, int indent, uint8_t *image_buf,
         int size_sig = size; // can't do arithmetic w/ unsigned
 
         uint16_t old_fat_entry;
-        while (!is_end_of_file(cluster)) {
+        // empty files don't have any clusters
+        while (cluster != (FAT12_MASK & CLUST_FREE) && !is_end_of_file(cluster)) {
             update_bitmap(cluster, clust_bitmap);
             cl_count++;
             //bad image 4
             if (get_fat_entry(cluster, image_buf, bpb) == (FAT12_MASK & CLUST_BAD)) {
-                printf("Bad referenced from cluster: %d\n", cluster );
+                report_finding(FIND_BAD_CLUSTER, name, cluster);
                 set_fat_entry(old_fat_entry, FAT12_MASK & CLUST_EOFS, image_buf, bpb);
                 set_fat_entry(cluster, FAT12_MASK & CLUST_FREE, image_buf, bpb);
+                STAT_INC(repairs);
+                repairs_made++;
                 break;
             }
             old_fat_entry = cluster;
@@ -315,14 +369,22 @@ uint16_t analyze_dirent(struct direntry *dirent, int indent, uint8_t *image_buf,
         //updated FAT, but didnt write the data
         if (cl_size - size_sig >= bytesPerClust) { //badimage1
             //missing a block
-            printf("missing block: name of file is %s\n", name);
+            report_finding(FIND_MISSING_BLOCK, name, getushort(dirent->deStartCluster));
+            TRACE_BEGIN(TRACE_PHASE, "reclaim_blocks", getushort(dirent->deStartCluster));
             reclaim_blocks(getushort(dirent->deStartCluster), image_buf, bpb, size_sig);
+            TRACE_END(TRACE_PHASE, "reclaim_blocks", -1);
+            STAT_INC(repairs);
+            repairs_made++;
         }
         //wrote the data but didnt update the fat
         if ((cl_size - size_sig) < 0) { //badimage2
             //excessive blocks
-            printf("excessive blocks: name of file is %s\n", name);
+            report_finding(FIND_EXCESS_BLOCKS, name, getushort(dirent->deStartCluster));
+            TRACE_BEGIN(TRACE_PHASE, "declaim_blocks", getushort(dirent->deStartCluster));
             declaim_blocks(dirent, image_buf, bpb, size_sig);
+            TRACE_END(TRACE_PHASE, "declaim_blocks", -1);
+            STAT_INC(repairs);
+            repairs_made++;
         }
 
     }
@@ -331,9 +393,13 @@ uint16_t analyze_dirent(struct direntry *dirent, int indent, uint8_t *image_buf,
 }
 
 
+void check_dir(uint16_t cluster, int indent,
+	       uint8_t *image_buf, struct bpb33* bpb, struct bitmap *clust_bitmap);
+
 void follow_dir(uint16_t cluster, int indent,
-		uint8_t *image_buf, struct bpb33* bpb, uint8_t *clust_bitmap)
+		uint8_t *image_buf, struct bpb33* bpb, struct bitmap *clust_bitmap)
 {
+    TRACE_BEGIN(TRACE_DIR, "follow_dir", cluster);
     while (is_valid_cluster(cluster, bpb))
     {
         struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
@@ -345,16 +411,17 @@ void follow_dir(uint16_t cluster, int indent,
             
             uint16_t followclust = analyze_dirent(dirent, indent, image_buf, bpb, clust_bitmap);
             if (followclust)
-                follow_dir(followclust, indent+1, image_buf, bpb, clust_bitmap);
+                check_dir(followclust, indent+1, image_buf, bpb, clust_bitmap);
             dirent++;
 	}
 
 	cluster = get_fat_entry(cluster, image_buf, bpb);
     }
+    TRACE_END(TRACE_DIR, "follow_dir", -1);
 }
 
 
-void traverse_root(uint8_t *image_buf, struct bpb33* bpb, uint8_t *clust_bitmap)
+void traverse_root(uint8_t *image_buf, struct bpb33* bpb, struct bitmap *clust_bitmap)
 {
     uint16_t cluster = 0;
 
@@ -365,7 +432,7 @@ void traverse_root(uint8_t *image_buf, struct bpb33* bpb, uint8_t *clust_bitmap)
     {
         uint16_t followclust = analyze_dirent(dirent, 0, image_buf, bpb, clust_bitmap);
         if (is_valid_cluster(followclust, bpb))
-            follow_dir(followclust, 1, image_buf, bpb, clust_bitmap);
+            check_dir(followclust, 1, image_buf, bpb, clust_bitmap);
 
         dirent++;
     }
@@ -373,37 +440,330 @@ void traverse_root(uint8_t *image_buf, struct bpb33* bpb, uint8_t *clust_bitmap)
 
 // END TAKEN FUNCTIONS
 
-void cluster_scan(uint8_t *image_buf, struct bpb33* bpb, uint8_t *clust_bitmap)
+
+/* hash_dir hashes the contents of a directory, and collects the FAT
+   sectors its own chain runs through */
+uint64_t hash_dir(uint16_t cluster, uint32_t *mask, 
+		  uint8_t *image_buf, struct bpb33 *bpb)
 {
-    int count = 0;
-    uint16_t totalClusters = CLUST_LAST & FAT12_MASK;
-    for (int i=CLUST_FIRST; i<totalClusters; i++){
-        if (is_taken_cluster((uint16_t)i, bpb, image_buf) && !is_data_cluster((uint16_t)i, clust_bitmap)){
-            printf("Orphan cluster: %d\n", i);
-            set_fat_entry((uint16_t)i, FAT12_MASK & CLUST_EOFS, image_buf, bpb);
-            count++;
-            struct direntry *dirent;
-            uint8_t *p;
-            
-            p = root_dir_addr(image_buf, bpb);
-            dirent = (struct direntry*)p;
-            char filename[12];
-            sprintf(filename, "found%d.dat", count);  
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint64_t hash = 0;
+    int n = 0;
 
-            create_dirent(dirent, filename, (uint16_t) i, 512, image_buf, bpb);
-            
+    *mask = 0;
+    if (cluster == MSDOSFSROOT)
+	return dos_hash64(root_dir_addr(image_buf, bpb), 
+			  bpb->bpbRootDirEnts * sizeof(struct direntry), 0);
+
+    while (is_valid_cluster(cluster, bpb) && n++ < MAX_CLUSTERS) 
+    {
+	hash = dos_hash64(cluster_to_addr(cluster, image_buf, bpb), clust_size, hash);
+	*mask |= fat_sectors(cluster);
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+    }
+    return hash;
+}
+
+/* hash_fat hashes each sector of the first FAT that cluster_scan
+   reads, and notes which ones differ from the saved state */
+void hash_fat(uint64_t *fat_hash, uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint8_t *fat = image_buf + bpb->bpbResSectors * bpb->bpbBytesPerSec;
+    uint32_t i;
+
+    changed_fat = 0;
+    for (i = 0; i < new_state->nfatsecs; i++) 
+    {
+	fat_hash[i] = dos_hash64(fat + i * bpb->bpbBytesPerSec, bpb->bpbBytesPerSec, i);
+	if (old_state == NULL || old_state->fat_hash[i] != fat_hash[i])
+	    changed_fat |= 1u << i;
+    }
+    repairs_seen = repairs_made;
+}
+
+struct dir_record *new_record(uint16_t cluster, uint64_t hash, uint32_t mask)
+{
+    struct dir_record *rec;
+
+    if (new_state->ndirs == new_state->size) 
+    {
+	new_state->size = new_state->size ? new_state->size * 2 : 64;
+	new_state->dirs = realloc(new_state->dirs, 
+				  new_state->size * sizeof(struct dir_record));
+	if (new_state->dirs == NULL) 
+	{
+	    fprintf(stderr, "Out of memory\n");
+	    exit(1);
+	}
+    }
+    rec = &new_state->dirs[new_state->ndirs++];
+    memset(rec, 0, sizeof(*rec));
+    rec->cluster = cluster;
+    rec->hash = hash;
+    rec->fat_mask = mask;
+    return rec;
+}
+
+
+/* check_dir checks one directory and everything under it.  Without
+   -i it just analyzes the directory; with it, an unchanged directory
+   is replayed from the saved state, and only listed.  Its
+   subdirectories are checked as the listing comes to them. */
+void check_dir(uint16_t cluster, int indent,
+	       uint8_t *image_buf, struct bpb33* bpb, struct bitmap *clust_bitmap)
+{
+    struct dir_record *old, *rec;
+    uint64_t hash;
+    uint32_t mask, i, j;
+    int saved = cur_rec, was_replaying = replaying;
+
+    if (new_state == NULL) 
+    {
+	if (cluster == MSDOSFSROOT)
+	    traverse_root(image_buf, bpb, clust_bitmap);
+	else
+	    follow_dir(cluster, indent, image_buf, bpb, clust_bitmap);
+	return;
+    }
 
+    /* a repair may have rewritten part of the FAT */
+    if (repairs_made != repairs_seen)
+	hash_fat(new_state->fat_hash, image_buf, bpb);
+
+    hash = hash_dir(cluster, &mask, image_buf, bpb);
+    old = cluster < MAX_CLUSTERS ? old_dirs[cluster] : NULL;
+    if (old != NULL && old->hash == hash && (old->fat_mask & changed_fat) == 0) 
+    {
+	TRACE_BEGIN(TRACE_DIR, "replay_dir", cluster);
+	rec = new_record(cluster, hash, old->fat_mask);
+	rec->nextents = old->nextents;
+	rec->extents = old->extents;
+	cur_rec = -1;
+	for (i = 0; i < old->nextents; i++)
+	    for (j = 0; j < old->extents[i].len; j++)
+		update_bitmap(old->extents[i].start + j, clust_bitmap);
+	dirs_reused++;
+	TRACE_END(TRACE_DIR, "replay_dir", -1);
+	replaying = 1;
+    }
+    else
+    {
+	new_record(cluster, hash, mask);
+	cur_rec = new_state->ndirs - 1;
+	dirs_checked++;
+	replaying = 0;
+    }
+
+    if (cluster == MSDOSFSROOT)
+	traverse_root(image_buf, bpb, clust_bitmap);
+    else
+	follow_dir(cluster, indent, image_buf, bpb, clust_bitmap);
+    cur_rec = saved;
+    replaying = was_replaying;
+}
 
 
+/* the geometry must match for a saved state to apply */
+void state_geometry(uint32_t *geometry, struct bpb33 *bpb)
+{
+    geometry[0] = bpb->bpbBytesPerSec;
+    geometry[1] = bpb->bpbSecPerClust;
+    geometry[2] = bpb->bpbResSectors;
+    geometry[3] = bpb->bpbRootDirEnts;
+    geometry[4] = bpb->bpbSectors;
+    geometry[5] = bpb->bpbFATsecs;
+}
+
+/* load_state reads the state saved by the last clean check.  A
+   missing or unusable state file just means a full check. */
+struct inc_state *load_state(const char *path, struct bpb33 *bpb)
+{
+    struct inc_state *st;
+    struct dir_record *rec;
+    uint32_t geometry[6];
+    char magic[8];
+    uint32_t i;
+    int ok;
+    FILE *fp;
+
+    fp = fopen(path, "r");
+    if (fp == NULL)
+	return NULL;
+
+    st = calloc(1, sizeof(struct inc_state));
+    state_geometry(geometry, bpb);
+    ok = fread(magic, sizeof(magic), 1, fp) == 1
+	&& memcmp(magic, STATE_MAGIC, sizeof(magic)) == 0
+	&& fread(st->geometry, sizeof(st->geometry), 1, fp) == 1
+	&& memcmp(st->geometry, geometry, sizeof(geometry)) == 0
+	&& fread(&st->nfatsecs, sizeof(st->nfatsecs), 1, fp) == 1
+	&& st->nfatsecs <= MAX_FAT_SECS
+	&& fread(st->fat_hash, sizeof(uint64_t), st->nfatsecs, fp) == st->nfatsecs
+	&& fread(&st->ndirs, sizeof(st->ndirs), 1, fp) == 1
+	&& st->ndirs <= MAX_CLUSTERS;
+    if (ok)
+	st->dirs = calloc(st->ndirs, sizeof(struct dir_record));
+
+    for (i = 0; ok && i < st->ndirs; i++) 
+    {
+	rec = &st->dirs[i];
+	ok = fread(&rec->cluster, sizeof(rec->cluster), 1, fp) == 1
+	    && fread(&rec->fat_mask, sizeof(rec->fat_mask), 1, fp) == 1
+	    && fread(&rec->hash, sizeof(rec->hash), 1, fp) == 1
+	    && fread(&rec->nextents, sizeof(rec->nextents), 1, fp) == 1
+	    && rec->cluster < MAX_CLUSTERS
+	    && rec->nextents <= MAX_CLUSTERS;
+	if (!ok)
+	    break;
+	rec->extents = malloc(rec->nextents * sizeof(struct extent) + 1);
+	ok = fread(rec->extents, sizeof(struct extent), rec->nextents, fp) == rec->nextents;
+	old_dirs[rec->cluster] = rec;
+    }
+    fclose(fp);
+
+    if (!ok) 
+    {
+	fprintf(stderr, "Ignoring unusable state file %s\n", path);
+	memset(old_dirs, 0, sizeof(old_dirs));
+	return NULL;
+    }
+    return st;
+}
+
+void save_state(const char *path)
+{
+    struct inc_state *st = new_state;
+    struct dir_record *rec;
+    char tmp[MAXPATHLEN + 8];
+    uint32_t i;
+    int ok;
+    FILE *fp;
+
+    /* write a new file and rename it, so a crash never leaves a
+       half-written state behind */
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fp = fopen(tmp, "w");
+    if (fp == NULL) 
+    {
+	fprintf(stderr, "Can't write state file %s\n", tmp);
+	return;
+    }
+
+    ok = fwrite(STATE_MAGIC, 8, 1, fp) == 1
+	&& fwrite(st->geometry, sizeof(st->geometry), 1, fp) == 1
+	&& fwrite(&st->nfatsecs, sizeof(st->nfatsecs), 1, fp) == 1
+	&& fwrite(st->fat_hash, sizeof(uint64_t), st->nfatsecs, fp) == st->nfatsecs
+	&& fwrite(&st->ndirs, sizeof(st->ndirs), 1, fp) == 1;
+    for (i = 0; ok && i < st->ndirs; i++) 
+    {
+	rec = &st->dirs[i];
+	ok = fwrite(&rec->cluster, sizeof(rec->cluster), 1, fp) == 1
+	    && fwrite(&rec->fat_mask, sizeof(rec->fat_mask), 1, fp) == 1
+	    && fwrite(&rec->hash, sizeof(rec->hash), 1, fp) == 1
+	    && fwrite(&rec->nextents, sizeof(rec->nextents), 1, fp) == 1
+	    && fwrite(rec->extents, sizeof(struct extent), rec->nextents, fp) == rec->nextents;
+    }
+    if (fclose(fp) != 0 || !ok || rename(tmp, path) < 0) 
+    {
+	fprintf(stderr, "Can't write state file %s\n", path);
+	unlink(tmp);
+    }
+}
+
+
+/* build_alloc_bitmap sets a bit for every cluster the FAT marks as
+   in use, i.e. anything but free or bad.  Entries are decoded four at
+   a time: six bytes of FAT are spread into four 16-bit lanes of one
+   word, and both tests are done on all lanes at once. */
+void build_alloc_bitmap(struct bitmap *alloc, uint8_t *image_buf, struct bpb33* bpb)
+{
+    const uint64_t lanes = 0x0fff0fff0fff0fffULL;
+    const uint64_t bad = 0x0ff70ff70ff70ff7ULL;
+    const uint64_t top = 0x1000100010001000ULL;
+    uint8_t *p = image_buf + bpb->bpbResSectors * bpb->bpbBytesPerSec;
+    uint64_t x, y, z, bits;
+    uint32_t w, g;
+
+    for (w = 0; w < alloc->nwords; w++) {
+        bits = 0;
+        for (g = 0; g < 16; g++, p += 6) {
+            x = (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16
+                | (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40;
+            y = (x & 0xfff) | (x << 4 & 0xfff0000ULL)
+                | (x << 8 & 0xfff00000000ULL) | (x << 12 & 0xfff000000000000ULL);
+            z = y ^ bad;
+            // adding 0xfff carries into bit 12 of a lane iff it is nonzero
+            y = (y + lanes) & (z + lanes) & top;
+            // gather bits 12, 28, 44 and 60 into bits 48..51
+            bits |= (((y >> 12) * 0x0001000200040008ULL) >> 48) << (g * 4);
+        }
+        if (w == 0)
+            bits &= ~3ULL;   // clusters 0 and 1 are not real clusters
+        bitmap_set_word(alloc, w, bits);
+    }
+}
+
+typedef uint64_t u64x4 __attribute__((vector_size(32)));
+
+void cluster_scan(uint8_t *image_buf, struct bpb33* bpb, struct bitmap *clust_bitmap)
+{
+    int count = 0;
+    struct bitmap *alloc = bitmap_create(clust_bitmap->nbits);
+    struct dir_index *root = NULL;
+    char filename[24];
+    u64x4 a, r, o;
+    uint64_t bits;
+    uint32_t w, k;
+    int i;
+
+    if (new_state != NULL && repairs_made != repairs_seen)
+        hash_fat(new_state->fat_hash, image_buf, bpb);
+    build_alloc_bitmap(alloc, image_buf, bpb);
+
+    // orphans are allocated and not referenced; a clean stretch of
+    // 256 clusters costs one AND NOT and one test
+    for (w = 0; w < alloc->nwords; w += 4) {
+        memcpy(&a, alloc->bits + w, sizeof(a));
+        memcpy(&r, clust_bitmap->bits + w, sizeof(r));
+        o = a & ~r;
+        if ((o[0] | o[1] | o[2] | o[3]) == 0)
+            continue;
+
+        for (k = 0; k < 4; k++) {
+          for (bits = o[k]; bits != 0; bits &= bits - 1) {
+            i = (w + k) * 64 + __builtin_ctzll(bits);
+            report_finding(FIND_ORPHAN, NULL, i);
+            TRACE_BEGIN(TRACE_PHASE, "reclaim_orphan", i);
+            // the root directory is indexed once, on the first orphan
+            if (root == NULL)
+                root = dir_index_build(MSDOSFSROOT, image_buf, bpb);
+            snprintf(filename, sizeof(filename), "found%d.dat", count + 1);
+            if (create_dirent(root, filename, (uint16_t) i, 512) < 0) {
+                fprintf(stderr, "Root directory is full, can't reclaim cluster %d\n", i);
+                TRACE_END(TRACE_PHASE, "reclaim_orphan", -1);
+                continue;
+            }
+            set_fat_entry((uint16_t)i, FAT12_MASK & CLUST_EOFS, image_buf, bpb);
+            STAT_INC(repairs);
+            repairs_made++;
+            count++;
+            TRACE_END(TRACE_PHASE, "reclaim_orphan", -1);
+          }
         }
     }
+    dir_index_free(root);
+    bitmap_free(alloc);
 }
 
 
 
 
 void usage(char *progname) {
-    fprintf(stderr, "usage: %s <imagename>\n", progname);
+    fprintf(stderr, "usage: %s [--stats] [--trace file | --trace-dirs file] [-i statefile]\n"
+                    "\t[--format human|jsonl|binary] [--quiet] [--verbose]\n"
+                    "\t[--overlay delta [--layer delta]...] <imagename>\n", progname);
+    fprintf(stderr, "\t-i statefile  only re-check what changed since the state saved by\n"
+                    "\t              the last clean check, and save a new state if clean\n");
     exit(1);
 }
 
@@ -412,27 +772,80 @@ int main(int argc, char** argv) {
     uint8_t *image_buf;
     int fd;
     struct bpb33* bpb;
-    if (argc < 2) {
+    char *state_path = NULL;
+    int opt;
+
+    stats_option(&argc, argv);
+    trace_option(&argc, argv);
+    report_option(&argc, argv);
+    overlay_option(&argc, argv);
+    while ((opt = getopt(argc, argv, "i:")) != -1) {
+        switch (opt) {
+        case 'i':
+            state_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1) {
 	usage(argv[0]);
     }
 
-    image_buf = mmap_file(argv[1], &fd);
+    // a packed image can't be repaired, but it can be checked: the
+    // repairs go to private copies and are dropped at the end
+    packed_private_writes();
+    TRACE_BEGIN(TRACE_PHASE, "mmap_file", -1);
+    image_buf = mmap_file(argv[optind], &fd);
+    TRACE_END(TRACE_PHASE, "mmap_file", -1);
+    TRACE_BEGIN(TRACE_PHASE, "check_bootsector", -1);
     bpb = check_bootsector(image_buf);
+    TRACE_END(TRACE_PHASE, "check_bootsector", -1);
     
-    uint16_t totalClusters = CLUST_LAST & FAT12_MASK;
-    // +1 in case there is a partial byte in the bitmap for the last clusters
-    uint8_t clust_bitmap[totalClusters/8 + 1];
-    memset(clust_bitmap, 0, sizeof(uint8_t) * totalClusters/8 + 1);
+    // one bit per real cluster, on the heap
+    uint16_t totalClusters = get_cluster_count(bpb);
+    struct bitmap *clust_bitmap = bitmap_create(totalClusters);
+    if (state_path != NULL) {
+        TRACE_BEGIN(TRACE_PHASE, "load_state", -1);
+        bytes_per_sec = bpb->bpbBytesPerSec;
+        new_state = calloc(1, sizeof(struct inc_state));
+        state_geometry(new_state->geometry, bpb);
+        new_state->nfatsecs = 32 - __builtin_clz(fat_sectors(totalClusters - 1));
+        if (new_state->nfatsecs > MAX_FAT_SECS || totalClusters > MAX_CLUSTERS) {
+            fprintf(stderr, "Incremental checking not supported for this geometry\n");
+            exit(1);
+        }
+        old_state = load_state(state_path, bpb);
+        hash_fat(new_state->fat_hash, image_buf, bpb);
+        TRACE_END(TRACE_PHASE, "load_state", -1);
+    }
+
     // Unlike dos_ls.c, we're traversing the root to analyze directories here
     // and filling in the bitmap with referenced clusters
-    traverse_root(image_buf, bpb, clust_bitmap);
+    TRACE_BEGIN(TRACE_PHASE, "traverse_root", -1);
+    check_dir(MSDOSFSROOT, 0, image_buf, bpb, clust_bitmap);
+    TRACE_END(TRACE_PHASE, "traverse_root", -1);
     
-
+    TRACE_BEGIN(TRACE_PHASE, "cluster_scan", -1);
     cluster_scan(image_buf, bpb, clust_bitmap);
+    TRACE_END(TRACE_PHASE, "cluster_scan", -1);
+
+    if (state_path != NULL) {
+        report_count("dirs_checked", dirs_checked);
+        report_count("dirs_unchanged", dirs_reused);
+        report_count("fat_sectors_changed", __builtin_popcount(changed_fat));
+        report_count("fat_sectors", new_state->nfatsecs);
+        // only a clean check may vouch for the next run
+        if (repairs_made == 0)
+            save_state(state_path);
+    }
 
 
 
 
+    bitmap_free(clust_bitmap);
+    TRACE_BEGIN(TRACE_PHASE, "unmmap_file", -1);
     unmmap_file(image_buf, &fd);
+    TRACE_END(TRACE_PHASE, "unmmap_file", -1);
     return 0;
 }
\ No newline at end of file
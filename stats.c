@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+#ifdef DOS_STATS
+__thread struct dos_stats dos_stats;
+static struct dos_stats total_stats;
+#endif
+
+static const char *stats_progname;
+
+
+/* stats_flush adds this thread's counts into the process totals */
+void stats_flush(void)
+{
+#ifdef DOS_STATS
+    uint64_t *from = (uint64_t*)&dos_stats;
+    uint64_t *to = (uint64_t*)&total_stats;
+    int i;
+
+    for (i = 0; i < (int)(sizeof(struct dos_stats) / sizeof(uint64_t)); i++) 
+    {
+	__atomic_fetch_add(&to[i], from[i], __ATOMIC_RELAXED);
+	from[i] = 0;
+    }
+#endif
+}
+
+
+#ifdef DOS_STATS
+static void print_stats(void)
+{
+    stats_flush();
+    fprintf(stderr, "{\"tool\":\"%s\",\"fat_reads\":%llu,\"fat_writes\":%llu,"
+	    "\"clusters_visited\":%llu,\"dirents_parsed\":%llu,"
+	    "\"bytes_copied\":%llu,\"syscalls\":%llu,\"repairs\":%llu}\n",
+	    stats_progname,
+	    (unsigned long long)total_stats.fat_reads,
+	    (unsigned long long)total_stats.fat_writes,
+	    (unsigned long long)total_stats.clusters_visited,
+	    (unsigned long long)total_stats.dirents_parsed,
+	    (unsigned long long)total_stats.bytes_copied,
+	    (unsigned long long)total_stats.syscalls,
+	    (unsigned long long)total_stats.repairs);
+}
+#endif
+
+
+/* stats_option looks for --stats on the command line and removes it,
+   so the rest of the argument handling never sees it.  If it was
+   there, the counters are printed when the program exits. */
+int stats_option(int *argc, char **argv)
+{
+    int i, j, found = 0;
+
+    for (i = 1; i < *argc; i++) 
+    {
+	if (strcmp(argv[i], "--stats") == 0) 
+	{
+	    found = 1;
+	    for (j = i; j < *argc; j++)
+		argv[j] = argv[j + 1];
+	    (*argc)--;
+	    i--;
+	}
+    }
+
+    if (found) 
+    {
+	stats_progname = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+#ifdef DOS_STATS
+	atexit(print_stats);
+#else
+	fprintf(stderr, "%s: built without stats (STATS=0); ignoring --stats\n",
+		stats_progname);
+#endif
+    }
+    return found;
+}
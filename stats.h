@@ -0,0 +1,36 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+/* Operation counters, reported as JSON on stderr by any tool run
+   with --stats.  Build with STATS=0 and the counting compiles away
+   to nothing.
+
+   Each thread counts into its own copy; threads other than the main
+   one must call stats_flush() before they exit. */
+
+#include <stdint.h>
+
+struct dos_stats 
+{
+    uint64_t fat_reads;		/* FAT entries read */
+    uint64_t fat_writes;	/* FAT entries written */
+    uint64_t clusters_visited;	/* data clusters located */
+    uint64_t dirents_parsed;	/* directory entries examined */
+    uint64_t bytes_copied;	/* file data copied in or out */
+    uint64_t syscalls;		/* open, mmap, read, write and friends */
+    uint64_t repairs;		/* fixes applied to the image */
+};
+
+#ifdef DOS_STATS
+extern __thread struct dos_stats dos_stats;
+#define STAT_ADD(field, n) (dos_stats.field += (n))
+#else
+#define STAT_ADD(field, n) ((void)0)
+#endif
+
+#define STAT_INC(field) STAT_ADD(field, 1)
+
+int stats_option(int *, char **);
+void stats_flush(void);
+
+#endif // __STATS_H__
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+struct trace_rec 
+{
+    const char *name;
+    long arg;
+    double ts;			/* microseconds since trace_option */
+    int tid;
+    char ph;
+};
+
+int trace_level;
+
+#ifdef DOS_TRACE
+static struct trace_rec *trace_buf;
+static size_t trace_used, trace_size;
+static int trace_lock;
+static double trace_start;
+static const char *trace_path;
+static __thread int trace_tid;
+
+
+static double now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+/* trace_event records one begin ('B') or end ('E') event.  Events are
+   kept in memory and only written out at exit, so tracing doesn't
+   perturb the timings with file I/O. */
+void trace_event(char ph, const char *name, long arg)
+{
+    struct trace_rec *rec;
+    double ts = now_us() - trace_start;
+
+    if (trace_tid == 0)
+	trace_tid = syscall(SYS_gettid);
+
+    while (__sync_lock_test_and_set(&trace_lock, 1))
+	;
+    if (trace_used == trace_size) 
+    {
+	trace_size = trace_size ? trace_size * 2 : 4096;
+	trace_buf = realloc(trace_buf, trace_size * sizeof(struct trace_rec));
+	if (trace_buf == NULL) 
+	{
+	    fprintf(stderr, "Out of memory for trace events\n");
+	    exit(1);
+	}
+    }
+    rec = &trace_buf[trace_used++];
+    rec->name = name;
+    rec->arg = arg;
+    rec->ts = ts;
+    rec->tid = trace_tid;
+    rec->ph = ph;
+    __sync_lock_release(&trace_lock);
+}
+
+
+static void write_trace(void)
+{
+    FILE *fp;
+    size_t i;
+    int pid = getpid();
+
+    trace_level = 0;
+    fp = fopen(trace_path, "w");
+    if (fp == NULL) 
+    {
+	fprintf(stderr, "Can't open trace file %s\n", trace_path);
+	return;
+    }
+
+    fprintf(fp, "{\"traceEvents\":[\n");
+    for (i = 0; i < trace_used; i++) 
+    {
+	struct trace_rec *rec = &trace_buf[i];
+
+	fprintf(fp, "{\"name\":\"%s\",\"cat\":\"dos\",\"ph\":\"%c\",\"ts\":%.3f,"
+		"\"pid\":%d,\"tid\":%d", 
+		rec->name, rec->ph, rec->ts, pid, rec->tid);
+	if (rec->arg >= 0)
+	    fprintf(fp, ",\"args\":{\"cluster\":%ld}", rec->arg);
+	fprintf(fp, "}%s\n", i + 1 < trace_used ? "," : "");
+    }
+    fprintf(fp, "],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(fp);
+    free(trace_buf);
+}
+#endif
+
+
+/* trace_option looks for --trace FILE or --trace-dirs FILE on the
+   command line and removes it.  --trace-dirs also records every
+   directory visited; without DOS_TRACE the option is only warned
+   about. */
+int trace_option(int *argc, char **argv)
+{
+    int i, j, level;
+
+    for (i = 1; i < *argc; i++) 
+    {
+	if (strcmp(argv[i], "--trace") == 0)
+	    level = TRACE_PHASE;
+	else if (strcmp(argv[i], "--trace-dirs") == 0)
+	    level = TRACE_DIR;
+	else
+	    continue;
+
+	if (i + 1 >= *argc) 
+	{
+	    fprintf(stderr, "%s: %s needs a file name\n", argv[0], argv[i]);
+	    exit(1);
+	}
+#ifdef DOS_TRACE
+	if (trace_path == NULL)
+	    atexit(write_trace);
+	trace_path = argv[i + 1];
+	trace_level = level;
+	trace_start = now_us();
+#else
+	(void)level;
+	fprintf(stderr, "%s: built without tracing (TRACE=0); ignoring %s\n",
+		argv[0], argv[i]);
+#endif
+	for (j = i; j + 2 <= *argc; j++)
+	    argv[j] = argv[j + 2];
+	*argc -= 2;
+	i--;
+    }
+    return trace_level;
+}
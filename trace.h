@@ -0,0 +1,31 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+/* Phase tracing.  A tool run with --trace FILE records when each
+   phase begins and ends, and writes the timeline to FILE on exit in
+   the Chrome trace-event format (load it in chrome://tracing or
+   Perfetto).  --trace-dirs FILE also records a span for every
+   directory visited.
+
+   When tracing is off each trace point is a single test of
+   trace_level; build with TRACE=0 and they compile away entirely. */
+
+#define TRACE_PHASE 1		/* whole phases of the program */
+#define TRACE_DIR 2		/* one span per directory */
+
+#ifdef DOS_TRACE
+extern int trace_level;
+#define TRACE_BEGIN(level, name, arg) \
+    do { if (trace_level >= (level)) trace_event('B', name, arg); } while (0)
+#define TRACE_END(level, name, arg) \
+    do { if (trace_level >= (level)) trace_event('E', name, arg); } while (0)
+#else
+#define TRACE_BEGIN(level, name, arg) ((void)0)
+#define TRACE_END(level, name, arg) ((void)0)
+#endif
+
+/* arg is recorded as the span's cluster number; pass -1 for none */
+void trace_event(char ph, const char *name, long arg);
+int trace_option(int *, char **);
+
+#endif // __TRACE_H__